@@ -0,0 +1,106 @@
+#include "./admit.h"
+#include <time.h>
+
+static int max_connections;
+static int max_pending;
+static double rate;
+static double burst;
+
+static int connections;
+static int pending;
+static unsigned long refused_connections;
+static unsigned long busy_commands;
+
+// The bucket of the command the calling thread is executing, for
+// admit_pace().
+static __thread admit_bucket_t *current;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void refill(admit_bucket_t *bucket) {
+    long long now = now_ns();
+
+    bucket->tokens += (now - bucket->last_ns) * rate / 1e9;
+    if (bucket->tokens > burst) bucket->tokens = burst;
+    bucket->last_ns = now;
+}
+
+void admit_configure(int max_conns, int max_pend, double r, double b) {
+    max_connections = max_conns;
+    max_pending = max_pend;
+    rate = r;
+    burst = b >= 1 ? b : 1;
+}
+
+int admit_connection(void) {
+    int n = __atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED);
+
+    if (max_connections != 0 && n > max_connections) {
+        __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&refused_connections, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+void admit_release_connection(void) {
+    __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+}
+
+void admit_bucket_init(admit_bucket_t *bucket) {
+    bucket->tokens = burst;
+    bucket->last_ns = now_ns();
+}
+
+int admit_command(admit_bucket_t *bucket) {
+    current = bucket;
+    if (rate > 0) {
+        refill(bucket);
+        if (bucket->tokens < 1) {
+            __atomic_add_fetch(&busy_commands, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+    }
+    int n = __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+    if (max_pending != 0 && n > max_pending) {
+        __atomic_sub_fetch(&pending, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&busy_commands, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    // only admitted commands pay for a token
+    if (rate > 0) bucket->tokens -= 1;
+    return 0;
+}
+
+void admit_done(void) { __atomic_sub_fetch(&pending, 1, __ATOMIC_RELAXED); }
+
+void admit_pace(void) {
+    admit_bucket_t *bucket = current;
+    struct timespec wait;
+    double seconds;
+
+    if (rate == 0 || bucket == NULL) return;
+    for (refill(bucket); bucket->tokens < 1; refill(bucket)) {
+        seconds = (1 - bucket->tokens) / rate;
+        wait.tv_sec = (time_t)seconds;
+        wait.tv_nsec = (long)((seconds - wait.tv_sec) * 1e9);
+        nanosleep(&wait, NULL);  // a cancellation point
+    }
+    bucket->tokens -= 1;
+}
+
+void admit_print_status(FILE *out) {
+    fprintf(out,
+            "%d connections (limit %d), %d commands in flight (limit %d), "
+            "%.0f commands/s per connection (burst %.0f)\n",
+            __atomic_load_n(&connections, __ATOMIC_RELAXED), max_connections,
+            __atomic_load_n(&pending, __ATOMIC_RELAXED), max_pending, rate,
+            rate > 0 ? burst : 0);
+    fprintf(out, "%lu connections refused, %lu commands answered busy\n",
+            __atomic_load_n(&refused_connections, __ATOMIC_RELAXED),
+            __atomic_load_n(&busy_commands, __ATOMIC_RELAXED));
+}
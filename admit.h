@@ -0,0 +1,77 @@
+#ifndef ADMIT_H_
+#define ADMIT_H_
+
+#include <stdio.h>
+
+/*
+ * Admission control, so that an overloaded server sheds load with an
+ * explicit "busy" reply instead of slowing down for everyone. There are
+ * three independent limits, all off by default:
+ *
+ *   - a maximum number of connections; the listener answers any beyond it
+ *     with "busy" and closes them,
+ *   - a maximum number of commands being executed at once (every connection
+ *     has a thread of its own, so this is what bounds the commands waiting
+ *     for the tree's locks); a command beyond it is answered "busy",
+ *   - a token bucket per connection, refilled at a fixed rate, from which
+ *     every command takes a token; a command that finds the bucket empty is
+ *     answered "busy". The lines of a file run by the f command also take a
+ *     token each, but wait for one instead, so a bulk load is slowed down to
+ *     the rate rather than failing halfway.
+ */
+
+typedef struct admit_bucket {
+    double tokens;
+    long long last_ns;  // time of the last refill
+} admit_bucket_t;
+
+/*
+ * Sets the limits: connections and commands in flight (0 for no limit), and
+ * the rate in commands per second and burst size of the token buckets (a
+ * rate of 0 turns them off).
+ */
+void admit_configure(int max_connections, int max_pending, double rate,
+                     double burst);
+
+/*
+ * Admits a new connection, returning 0, or returns -1 if there are already
+ * too many.
+ */
+int admit_connection(void);
+
+/*
+ * Releases a connection admitted by admit_connection().
+ */
+void admit_release_connection(void);
+
+/*
+ * Fills the bucket of a new connection.
+ */
+void admit_bucket_init(admit_bucket_t *bucket);
+
+/*
+ * Admits a command of the connection whose bucket is given, returning 0, or
+ * returns -1 if it should be answered "busy". An admitted command must be
+ * followed by admit_done() once it has been executed.
+ */
+int admit_command(admit_bucket_t *bucket);
+
+/*
+ * Ends a command admitted by admit_command().
+ */
+void admit_done(void);
+
+/*
+ * Waits for a token from the bucket of the command being executed by the
+ * calling thread. Called for every line of a file run by the f command (see
+ * db_set_file_pacer()).
+ */
+void admit_pace(void);
+
+/*
+ * Prints the current connections and commands in flight, their limits and
+ * how many connections and commands have been refused.
+ */
+void admit_print_status(FILE *out);
+
+#endif  // ADMIT_H_
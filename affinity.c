@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include "./affinity.h"
+#include <ctype.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "./comm.h"
+
+static int cpus[CPU_SETSIZE];
+static int num_cpus;
+static unsigned int next_cpu;
+// Indices into cpus grouped by node: those of node n are the node_len[n]
+// from node_first[n] on, and node_next[n] goes round them.
+static int node_cpus[CPU_SETSIZE];
+static int node_first[AFFINITY_MAX_NODES];
+static int node_len[AFFINITY_MAX_NODES];
+static unsigned int node_next[AFFINITY_MAX_NODES];
+static unsigned char cpu_node[CPU_SETSIZE];  // 0 unless sysfs says otherwise
+static pthread_once_t nodes_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Parses a list of CPUs such as "0-3,8" into set, in the format of both the
+ * -a option and sysfs. Returns 0 on success and -1 if it is ill-formed.
+ */
+static int parse_cpulist(const char *list, cpu_set_t *set) {
+    const char *p = list;
+    char *end;
+    long first;
+    long last;
+
+    CPU_ZERO(set);
+    while (isspace(*p)) p++;
+    if (*p == '\0') return -1;
+    while (*p != '\0' && !isspace(*p)) {
+        if (!isdigit(*p)) return -1;
+        first = last = strtol(p, &end, 10);
+        if (*end == '-') {
+            if (!isdigit(end[1])) return -1;
+            last = strtol(end + 1, &end, 10);
+        }
+        if (last < first || last >= CPU_SETSIZE) return -1;
+        for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+        if (*end == ',') end++;
+        p = end;
+    }
+    return 0;
+}
+
+// Reads the CPUs of every NUMA node from sysfs. Nodes may be numbered
+// sparsely, so every possible number is tried.
+static void load_nodes(void) {
+    char path[64];
+    char line[4096];
+    cpu_set_t set;
+    FILE *f;
+
+    for (int node = 0; node < AFFINITY_MAX_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                 node);
+        if ((f = fopen(path, "r")) == NULL) continue;
+        if (fgets(line, sizeof(line), f) != NULL &&
+            parse_cpulist(line, &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &set)) cpu_node[cpu] = node;
+            }
+        }
+        fclose(f);
+    }
+}
+
+int affinity_set(const char *cpulist) {
+    cpu_set_t wanted;
+    cpu_set_t allowed;
+
+    if (parse_cpulist(cpulist, &wanted) != 0) return -1;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        handle_error_en(errno, "sched_getaffinity");
+    }
+    num_cpus = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &wanted) && CPU_ISSET(cpu, &allowed)) {
+            cpus[num_cpus++] = cpu;
+        }
+    }
+    pthread_once(&nodes_once, load_nodes);
+    int n = 0;
+    for (int node = 0; node < AFFINITY_MAX_NODES; node++) {
+        node_first[node] = n;
+        for (int i = 0; i < num_cpus; i++) {
+            if (cpu_node[cpus[i]] == node) node_cpus[n++] = i;
+        }
+        node_len[node] = n - node_first[node];
+    }
+    return num_cpus > 0 ? 0 : -1;
+}
+
+int affinity_enabled(void) { return num_cpus > 0; }
+
+void affinity_attr(pthread_attr_t *attr) {
+    unsigned int n = __atomic_fetch_add(&next_cpu, 1, __ATOMIC_RELAXED);
+    affinity_attr_to(attr, num_cpus > 0 ? n % num_cpus : 0);
+}
+
+void affinity_attr_local(pthread_attr_t *attr) {
+    int node = num_cpus > 0 ? affinity_node() : 0;
+    unsigned int n;
+
+    if (node_len[node] == 0) {
+        affinity_attr(attr);
+        return;
+    }
+    n = __atomic_fetch_add(&node_next[node], 1, __ATOMIC_RELAXED);
+    affinity_attr_to(attr, node_cpus[node_first[node] + n % node_len[node]]);
+}
+
+void affinity_attr_to(pthread_attr_t *attr, int i) {
+    cpu_set_t set;
+    int err;
+
+    if ((err = pthread_attr_init(attr)) != 0) {
+        handle_error_en(err, "pthread_attr_init");
+    }
+    if (num_cpus == 0) return;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[i % num_cpus], &set);
+    if ((err = pthread_attr_setaffinity_np(attr, sizeof(set), &set)) != 0) {
+        handle_error_en(err, "pthread_attr_setaffinity_np");
+    }
+}
+
+int affinity_node(void) {
+    int cpu = sched_getcpu();
+
+    pthread_once(&nodes_once, load_nodes);
+    return cpu >= 0 && cpu < CPU_SETSIZE ? cpu_node[cpu] : 0;
+}
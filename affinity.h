@@ -0,0 +1,58 @@
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+
+#include <pthread.h>
+
+/*
+ * Thread placement. affinity_set() takes a list of CPUs, and threads created
+ * with the attributes of affinity_attr() are then pinned to them in turn, so
+ * that the listeners are spread over those CPUs instead of being moved around
+ * by the scheduler. Client threads are created with affinity_attr_local()
+ * instead, which keeps each on the NUMA node of the listener that accepted
+ * it. The NUMA node of every CPU is read from sysfs, so that memory
+ * can be allocated on the node of the thread using it (see arena.h).
+ */
+
+#define AFFINITY_MAX_NODES 64
+
+/*
+ * Sets the CPUs to pin threads to from a list such as "0-3,8,10-11". Returns
+ * 0 on success and -1 if the list is ill-formed or names no CPU that this
+ * process may run on.
+ */
+int affinity_set(const char *cpulist);
+
+/*
+ * Returns nonzero if affinity_set() has been called.
+ */
+int affinity_enabled(void);
+
+/*
+ * Initializes attr, to be passed to pthread_create() and then destroyed,
+ * for a thread pinned to the next CPU of the list, going round it. Since
+ * the thread starts out on its CPU, whatever it allocates first is placed
+ * there too. attr is left with the defaults if affinity_set() hasn't been
+ * called.
+ */
+void affinity_attr(pthread_attr_t *attr);
+
+/*
+ * affinity_attr() for the next CPU of the list on the NUMA node of the
+ * calling thread, going round those of that node only, so that a thread
+ * started by a pinned listener runs, and allocates, on the listener's node.
+ * Falls back to affinity_attr() if no CPU of the list is on that node.
+ */
+void affinity_attr_local(pthread_attr_t *attr);
+
+/*
+ * affinity_attr() for the CPU at index i (modulo its length) of the list.
+ */
+void affinity_attr_to(pthread_attr_t *attr, int i);
+
+/*
+ * Returns the NUMA node of the CPU the calling thread is running on (0 on
+ * machines without NUMA), which is less than AFFINITY_MAX_NODES.
+ */
+int affinity_node(void);
+
+#endif  // AFFINITY_H_
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include "./arena.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "./affinity.h"
+#include "./comm.h"
+
+#define ARENA_CHUNK (1 << 20)  // chunks are also aligned to their size
+#define ARENA_ALIGN 64
+#define ARENA_CACHE 64          // freed objects a thread keeps
+#define ARENA_REFILL 32         // taken from the arena at a time
+#define ARENA_MPOL_PREFERRED 1  // MPOL_PREFERRED of <numaif.h>
+
+typedef struct arena_obj {
+    struct arena_obj *next;
+} arena_obj_t;
+
+// Kept in the first cache line of every chunk.
+typedef struct chunk {
+    int node;
+} chunk_t;
+
+typedef struct arena {
+    pthread_mutex_t mutex;
+    arena_obj_t *free;
+    char *cur;  // the unused part of the newest chunk
+    char *end;
+} arena_t;
+
+// The objects a thread has freed or taken from the arena of one node.
+typedef struct arena_cache {
+    int node;  // -1 while the cache is unused
+    int count;
+    arena_obj_t *objs;
+} arena_cache_t;
+
+static int enabled;
+static size_t obj_size;
+static arena_t arenas[AFFINITY_MAX_NODES];
+static pthread_key_t cache_key;
+static __thread arena_cache_t cache = {-1, 0, NULL};
+
+static inline chunk_t *chunk_of(void *obj) {
+    return (chunk_t *)((uintptr_t)obj & ~(uintptr_t)(ARENA_CHUNK - 1));
+}
+
+static void arena_lock(arena_t *arena) {
+    int err;
+    if ((err = pthread_mutex_lock(&arena->mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static void arena_unlock(arena_t *arena) {
+    int err;
+    if ((err = pthread_mutex_unlock(&arena->mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+// Maps an aligned chunk for node and makes it the arena's newest. Called
+// with the arena locked. Returns -1 if memory runs out.
+static int new_chunk(int node) {
+    arena_t *arena = &arenas[node];
+    unsigned long mask[AFFINITY_MAX_NODES / (8 * sizeof(long))] = {0};
+    char *map;
+    char *chunk;
+    size_t head;
+
+    // map twice the size and trim it to an aligned chunk
+    map = mmap(NULL, 2 * ARENA_CHUNK, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return -1;
+    chunk = (char *)(((uintptr_t)map + ARENA_CHUNK - 1) &
+                     ~(uintptr_t)(ARENA_CHUNK - 1));
+    if ((head = chunk - map) != 0) munmap(map, head);
+    munmap(chunk + ARENA_CHUNK, ARENA_CHUNK - head);
+
+    // a failure (no NUMA support, say) leaves the kernel's default placement
+    mask[node / (8 * sizeof(long))] = 1UL << (node % (8 * sizeof(long)));
+    syscall(SYS_mbind, chunk, ARENA_CHUNK, ARENA_MPOL_PREFERRED, mask,
+            AFFINITY_MAX_NODES + 1, 0);
+
+    ((chunk_t *)chunk)->node = node;
+    arena->cur = chunk + ARENA_ALIGN;
+    arena->end = chunk + ARENA_CHUNK;
+    return 0;
+}
+
+// Moves the calling thread's cached objects back to their arena.
+static void flush_cache(void) {
+    arena_t *arena;
+    arena_obj_t *obj;
+
+    if (cache.objs == NULL) return;
+    arena = &arenas[cache.node];
+    arena_lock(arena);
+    while ((obj = cache.objs) != NULL) {
+        cache.objs = obj->next;
+        obj->next = arena->free;
+        arena->free = obj;
+    }
+    arena_unlock(arena);
+    cache.count = 0;
+}
+
+// pthread_key_t destructor: hands the cache of an exiting thread back.
+static void release_cache(void *unused) { flush_cache(); }
+
+// Fills the empty cache with objects of node.
+static void refill_cache(int node) {
+    arena_t *arena = &arenas[node];
+    arena_obj_t *obj;
+
+    arena_lock(arena);
+    while (cache.count < ARENA_REFILL) {
+        if ((obj = arena->free) != NULL) {
+            arena->free = obj->next;
+        } else {
+            if (arena->cur + obj_size > arena->end && new_chunk(node) != 0) {
+                break;
+            }
+            obj = (arena_obj_t *)arena->cur;
+            arena->cur += obj_size;
+        }
+        obj->next = cache.objs;
+        cache.objs = obj;
+        cache.count++;
+    }
+    arena_unlock(arena);
+}
+
+void arena_enable(size_t size) {
+    int err;
+
+    obj_size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    for (int node = 0; node < AFFINITY_MAX_NODES; node++) {
+        if ((err = pthread_mutex_init(&arenas[node].mutex, 0)) != 0) {
+            handle_error_en(err, "pthread_mutex_init");
+        }
+    }
+    if ((err = pthread_key_create(&cache_key, release_cache)) != 0) {
+        handle_error_en(err, "pthread_key_create");
+    }
+    enabled = 1;
+}
+
+int arena_enabled(void) { return enabled; }
+
+void *arena_alloc(void) {
+    int node = affinity_node();
+    arena_obj_t *obj;
+    int err;
+
+    if (cache.node != node) {
+        // first use by this thread, or it has moved to another node
+        if (cache.node == -1 &&
+            (err = pthread_setspecific(cache_key, &cache)) != 0) {
+            handle_error_en(err, "pthread_setspecific");
+        }
+        flush_cache();
+        cache.node = node;
+    }
+    if (cache.objs == NULL) refill_cache(node);
+    if ((obj = cache.objs) == NULL) return NULL;
+    cache.objs = obj->next;
+    cache.count--;
+    return obj;
+}
+
+void arena_free(void *obj) {
+    arena_obj_t *o = (arena_obj_t *)obj;
+    int node = chunk_of(obj)->node;
+    arena_t *arena;
+
+    if (node == cache.node && cache.count < ARENA_CACHE) {
+        o->next = cache.objs;
+        cache.objs = o;
+        cache.count++;
+        return;
+    }
+    arena = &arenas[node];
+    arena_lock(arena);
+    o->next = arena->free;
+    arena->free = o;
+    arena_unlock(arena);
+}
@@ -0,0 +1,40 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+/*
+ * Per-NUMA-node arenas for objects of one size, the tree's nodes. An object
+ * is allocated from the arena of the node the calling thread runs on (see
+ * affinity_node()), whose memory is bound to that node, so a thread pinned to
+ * a CPU gets nodes whose lock words are in local memory. Objects are aligned
+ * to cache lines, so that two nodes never share the line of a lock.
+ *
+ * Memory is taken from the system in 1MB chunks that are never given back;
+ * freed objects go back to the arena of their chunk. Every thread keeps a few
+ * freed objects of its own node, so most calls take no lock.
+ */
+
+/*
+ * Turns the arenas on, for objects of size bytes. Must be called before any
+ * other thread is started.
+ */
+void arena_enable(size_t size);
+
+/*
+ * Returns nonzero if the arenas are on.
+ */
+int arena_enabled(void);
+
+/*
+ * Returns an object from the arena of the calling thread's node, or NULL if
+ * memory runs out.
+ */
+void *arena_alloc(void);
+
+/*
+ * Frees an object returned by arena_alloc(). Any thread may free it.
+ */
+void arena_free(void *obj);
+
+#endif  // ARENA_H_
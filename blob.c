@@ -0,0 +1,41 @@
+#include "./blob.h"
+#include <stdlib.h>
+#include <string.h>
+
+static long blob_count;
+static long blob_bytes;
+
+size_t blob_size(size_t len) { return sizeof(blob_t) + len + 1; }
+
+blob_t *blob_create(const char *data, size_t len) {
+    blob_t *blob = malloc(blob_size(len));
+
+    if (blob == NULL) return NULL;
+    blob->refs = 1;
+    blob->len = len;
+    memcpy(blob->data, data, len);
+    blob->data[len] = '\0';
+    __atomic_fetch_add(&blob_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&blob_bytes, blob_size(len), __ATOMIC_RELAXED);
+    return blob;
+}
+
+blob_t *blob_get(blob_t *blob) {
+    __atomic_fetch_add(&blob->refs, 1, __ATOMIC_RELAXED);
+    return blob;
+}
+
+void blob_put(blob_t *blob) {
+    if (blob == NULL) return;
+    // the release orders this thread's reads of the data before the free
+    // done by whichever thread drops the last reference
+    if (__atomic_sub_fetch(&blob->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    __atomic_fetch_sub(&blob_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&blob_bytes, blob_size(blob->len), __ATOMIC_RELAXED);
+    free(blob);
+}
+
+void blob_stats(long *count, long *bytes) {
+    *count = __atomic_load_n(&blob_count, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&blob_bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,55 @@
+#ifndef BLOB_H_
+#define BLOB_H_
+
+#include <stddef.h>
+
+/*
+ * Out-of-line storage for large values. A value longer than BLOB_THRESHOLD
+ * bytes is kept in a reference-counted blob rather than in a string owned by
+ * its node. The node holds one reference; a reader that needs the value after
+ * releasing the node's lock (for example to send it to a client) takes
+ * another with blob_get() while the lock is held. An update or removal only
+ * drops the node's reference, so the blob stays valid until the last reader
+ * is done with it.
+ */
+
+// Values longer than this are stored in blobs.
+#define BLOB_THRESHOLD 256
+
+// Largest value accepted by the database.
+#define BLOB_MAXLEN (1 << 20)
+
+typedef struct blob {
+    long refs;
+    size_t len;   // length of data, not counting the terminating NUL
+    char data[];  // NUL-terminated, so it can be used as a string
+} blob_t;
+
+/*
+ * Returns a new blob holding a copy of the len bytes at data, with a single
+ * reference, or NULL if it cannot be allocated.
+ */
+blob_t *blob_create(const char *data, size_t len);
+
+/*
+ * Takes another reference to blob and returns it.
+ */
+blob_t *blob_get(blob_t *blob);
+
+/*
+ * Drops a reference to blob, freeing it when the last one is gone. A NULL
+ * blob is ignored.
+ */
+void blob_put(blob_t *blob);
+
+/*
+ * Returns the number of bytes allocated for a blob holding len bytes.
+ */
+size_t blob_size(size_t len);
+
+/*
+ * Reports the number of live blobs and the bytes allocated for them.
+ */
+void blob_stats(long *count, long *bytes);
+
+#endif  // BLOB_H_
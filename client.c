@@ -1,7 +1,10 @@
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,117 +12,827 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
-#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#include "./dbclient.h"
 
 #define BUFSIZE 1024
 
+// Keys fetched from each shard per scan while dumping.
+#define SHARD_PAGE 1024
+
 /*
- * Helper that opens a TCP socket representing the server.
- * Returns the file descriptor on success, -1 on failure.
+ * Latency histogram with HIST_SUB linear sub-buckets per power of two, which
+ * bounds the relative error of a recorded value to 1/HIST_SUB. Values are in
+ * nanoseconds.
  */
-int get_socket(const char *server, const char *port) {
-    // setup for getaddrinfo
-    int sock;
-    struct addrinfo hints;
-    struct addrinfo *result;
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+typedef struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+    double sum;
+} histogram_t;
 
-    int err;
-    if ((err = getaddrinfo(server, port, &hints, &result)) != 0) {
-        fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(err));
-        return -1;
+/*
+ * Settings for a load generation run (see usage_error() for the flags).
+ */
+typedef struct load_config {
+    const char *server;
+    const char *port;
+    int concurrency;
+    double duration;    // seconds
+    double rate;        // total ops/sec; 0 runs closed-loop
+    double write_mix;   // fraction of operations that are writes
+    int preload;        // add every key before measuring
+    char **read_ports;  // replicas on the same host that serve the reads
+    int num_read_ports;
+    int depth;            // requests each connection keeps in flight
+    const char *servers;  // host:port list of the servers taking the writes
+    int num_shards;       // more than one spreads the keys over them
+    char **keys;
+    int num_keys;
+} load_config_t;
+
+/*
+ * A request of a load worker that is waiting for its response.
+ */
+typedef struct load_op {
+    struct load_worker *w;
+    uint64_t sent;  // when it was sent or, in open-loop mode, scheduled
+    int write;
+    struct load_op *next_free;
+} load_op_t;
+
+/*
+ * Per-thread state of a load generation run. Each worker owns one connection
+ * (one per server) and its own histograms, which are merged once all workers
+ * have finished.
+ */
+typedef struct load_worker {
+    pthread_t thread;
+    int id;
+    load_config_t *cfg;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t rng;
+    uint64_t errors;
+    uint64_t busy;  // requests the server shed (see admit.h)
+    histogram_t read_hist;
+    histogram_t write_hist;
+    load_op_t *free_ops;  // up to cfg->depth requests can be in flight
+    int in_flight;
+    int failed;  // a connection was lost
+} load_worker_t;
+
+/*
+ * Arguments for a thread that replays a script (the non-benchmark mode).
+ */
+typedef struct occurence {
+    pthread_t thread;
+    const char *server;
+    const char *port;
+    const char *script;
+    const char *shards;  // servers to shard the keys over instead of server
+    const char *shm;     // "shm:path" if server is reached over shared memory
+    int status;
+} occurence_t;
+
+/*
+ * Pages of ordered key/value pairs fetched from one shard with scan, for
+ * merging the shards' results.
+ */
+typedef struct shard_cursor {
+    char *reply;   // the last reply, split in place into pairs
+    char **pairs;  // key, value, key, value, ...
+    int num_pairs;
+    int pos;
+    int done;  // the shard has no keys after this page
+} shard_cursor_t;
+
+// Set by -i when the shards were started with -i and so keep their keys in
+// numeric order, which merged scans and dumps must follow.
+static int int_keys;
+
+// Compares two keys in the order the shards keep them in.
+static int key_cmp(const char *a, const char *b) {
+    if (int_keys) {
+        long long x = strtoll(a, NULL, 10), y = strtoll(b, NULL, 10);
+        return (x > y) - (x < y);
+    }
+    return strcmp(a, b);
+}
+
+static void store_reply(void *arg, const char *reply, size_t len) {
+    *(char **)arg = reply != NULL ? strndup(reply, len) : NULL;
+}
+
+/*
+ * Sends the n commands to the shards given by owner, all at once, and stores
+ * the reply to each in replies (to be freed by the caller). Returns 0 on
+ * success and -1 if a connection failed.
+ */
+static int shard_batch(dbc_pool_t *pool, char **cmds, int *owner,
+                       char **replies, int n) {
+    for (int i = 0; i < n; i++) replies[i] = NULL;
+    for (int i = 0; i < n; i++) {
+        if (dbc_send_to(pool, owner[i], cmds[i], store_reply, &replies[i]) ==
+            -1) {
+            dbc_wait(pool);
+            return -1;
+        }
+    }
+    return dbc_wait(pool);
+}
+
+/*
+ * Runs "mq k1 k2 ...", "md k1 k2 ..." or "ma k1 v1 k2 v2 ..." by fanning the
+ * single-key commands out to the keys' shards. Prints one reply per key, in
+ * the order of the keys. Returns -1 if a connection failed.
+ */
+static int shard_multi(dbc_pool_t *pool, char verb, char **args, int nargs) {
+    int step = verb == 'a' ? 2 : 1;
+    int n = nargs / step;
+    char **cmds = calloc(n, sizeof(char *));
+    char **replies = calloc(n, sizeof(char *));
+    int *owner = calloc(n, sizeof(int));
+    int ret = 0;
+
+    if (nargs % step != 0 || n == 0) {
+        printf("ill-formed command\n");
+        goto out;
+    }
+    for (int i = 0; i < n; i++) {
+        char *key = args[i * step];
+        size_t len = strlen(key) + (step == 2 ? strlen(args[i * 2 + 1]) : 0);
+        cmds[i] = malloc(len + 4);
+        if (step == 2) {
+            sprintf(cmds[i], "a %s %s", key, args[i * 2 + 1]);
+        } else {
+            sprintf(cmds[i], "%c %s", verb, key);
+        }
+        owner[i] = shard_for_key(&pool->ring, key);
+    }
+    if ((ret = shard_batch(pool, cmds, owner, replies, n)) == 0) {
+        for (int i = 0; i < n; i++) printf("%s\n", replies[i]);
+    }
+
+out:
+    for (int i = 0; i < n; i++) {
+        free(cmds[i]);
+        free(replies[i]);
+    }
+    free(cmds);
+    free(replies);
+    free(owner);
+    return ret;
+}
+
+/*
+ * Splits a scan reply in place into its key/value pairs and resets the
+ * cursor to the first of them.
+ */
+static void cursor_parse(shard_cursor_t *c) {
+    char *save;
+    int cap = 0;
+
+    c->num_pairs = c->pos = 0;
+    if (strncmp(c->reply, "not found", 9) == 0) return;
+    for (char *tok = strtok_r(c->reply, " \n", &save); tok != NULL;
+         tok = strtok_r(NULL, " \n", &save)) {
+        if (c->num_pairs * 2 == cap) {
+            cap = cap ? cap * 2 : 64;
+            c->pairs = realloc(c->pairs, cap * sizeof(char *));
+        }
+        c->pairs[c->num_pairs * 2 + (c->pos++ & 1)] = tok;
+        if ((c->pos & 1) == 0) c->num_pairs++;
+    }
+    c->pos = 0;
+}
+
+/*
+ * Sends "scan starts[s] count" to every shard s with a start, and parses the
+ * replies into the cursors. Returns -1 if a connection failed.
+ */
+static int shard_scan(dbc_pool_t *pool, shard_cursor_t *cursors, char **starts,
+                      int count) {
+    int num_shards = pool->ring.num_shards;
+    char **cmds = calloc(num_shards, sizeof(char *));
+    char **replies = calloc(num_shards, sizeof(char *));
+    int *owner = calloc(num_shards, sizeof(int));
+    int n = 0;
+    int ret;
+
+    for (int s = 0; s < num_shards; s++) {
+        if (starts[s] == NULL) continue;
+        cmds[n] = malloc(strlen(starts[s]) + 32);
+        sprintf(cmds[n], "scan %s %d", starts[s], count);
+        owner[n++] = s;
     }
+    ret = shard_batch(pool, cmds, owner, replies, n);
+    for (int i = 0; i < n; i++) {
+        shard_cursor_t *c = &cursors[owner[i]];
+        if (ret == 0) {
+            free(c->reply);
+            c->reply = replies[i];
+            cursor_parse(c);
+            c->done = c->num_pairs < count;
+        } else {
+            free(replies[i]);
+        }
+        free(cmds[i]);
+    }
+    free(cmds);
+    free(replies);
+    free(owner);
+    return ret;
+}
+
+// Returns the shard whose cursor holds the smallest key, or -1 if none does.
+static int cursor_min(shard_cursor_t *cursors, int num_shards) {
+    int min = -1;
+    for (int s = 0; s < num_shards; s++) {
+        shard_cursor_t *c = &cursors[s];
+        if (c->pos < c->num_pairs &&
+            (min == -1 ||
+             key_cmp(c->pairs[c->pos * 2],
+                     cursors[min].pairs[cursors[min].pos * 2]) < 0)) {
+            min = s;
+        }
+    }
+    return min;
+}
+
+static void cursors_free(shard_cursor_t *cursors, int num_shards) {
+    for (int s = 0; s < num_shards; s++) {
+        free(cursors[s].reply);
+        free(cursors[s].pairs);
+    }
+    free(cursors);
+}
+
+/*
+ * "scan start count" over all shards: each shard returns its first count keys
+ * from start, and the smallest count keys of the union are printed. Returns
+ * -1 if a connection failed.
+ */
+static int shard_scan_merged(dbc_pool_t *pool, char *start, int count) {
+    int num_shards = pool->ring.num_shards;
+    shard_cursor_t *cursors = calloc(num_shards, sizeof(shard_cursor_t));
+    char **starts = calloc(num_shards, sizeof(char *));
+    int printed = 0;
+
+    for (int s = 0; s < num_shards; s++) starts[s] = start;
+    int ret = shard_scan(pool, cursors, starts, count);
+    if (ret == 0) {
+        int s;
+        while (printed < count && (s = cursor_min(cursors, num_shards)) != -1) {
+            shard_cursor_t *c = &cursors[s];
+            printf("%s%s %s", printed++ ? " " : "", c->pairs[c->pos * 2],
+                   c->pairs[c->pos * 2 + 1]);
+            c->pos++;
+        }
+        printf(printed ? "\n" : "not found\n");
+    }
+    free(starts);
+    cursors_free(cursors, num_shards);
+    return ret;
+}
+
+/*
+ * Writes every key and value of every shard, one pair per line and in order,
+ * to the named file or stdout. The shards are read a page at a time and the
+ * pages are merged. Returns -1 if a connection failed.
+ */
+static int shard_dump(dbc_pool_t *pool, char *filename) {
+    int num_shards = pool->ring.num_shards;
+    shard_cursor_t *cursors = calloc(num_shards, sizeof(shard_cursor_t));
+    char **starts = calloc(num_shards, sizeof(char *));
+    char *last = NULL;
+    FILE *out = stdout;
+    int s, ret = 0;
+
+    if (filename != NULL && (out = fopen(filename, "w")) == NULL) {
+        printf("bad file name\n");
+        goto out;
+    }
+    for (s = 0; s < num_shards; s++) starts[s] = "-";
+    if ((ret = shard_scan(pool, cursors, starts, SHARD_PAGE)) != 0) goto out;
+    for (s = 0; s < num_shards; s++) starts[s] = NULL;
+
+    while ((s = cursor_min(cursors, num_shards)) != -1) {
+        shard_cursor_t *c = &cursors[s];
+        fprintf(out, "%s %s\n", c->pairs[c->pos * 2], c->pairs[c->pos * 2 + 1]);
+        if (++c->pos < c->num_pairs || c->done) continue;
+
+        // this shard's page is used up: fetch the next one. scan starts at
+        // the given key itself, so ask for one more and skip that key.
+        free(last);
+        last = strdup(c->pairs[(c->pos - 1) * 2]);
+        starts[s] = last;
+        ret = shard_scan(pool, cursors, starts, SHARD_PAGE + 1);
+        starts[s] = NULL;
+        if (ret != 0) break;
+        if (c->num_pairs > 0 && key_cmp(c->pairs[0], last) == 0) c->pos++;
+    }
+    if (out != stdout) fclose(out);
 
-    // find the right interface
-    struct addrinfo *res;
-    for (res = result; res != NULL; res = res->ai_next) {
-        if ((sock = socket(res->ai_family, res->ai_socktype,
-                           res->ai_protocol)) < 0) {
-            continue;
+out:
+    free(last);
+    free(starts);
+    cursors_free(cursors, num_shards);
+    return ret;
+}
+
+/*
+ * Runs one script line against the shards and prints the reply. Commands on
+ * a single key go to the key's shard; mq, ma and md are fanned out, and scan
+ * and dump merge the ordered keys of all shards. Returns -1 if a connection
+ * failed.
+ */
+static int shard_command(dbc_pool_t *pool, char *line) {
+    char *copy = strdup(line);
+    char *args[BUFSIZE];
+    char *save;
+    int nargs = 0;
+    int ret = 0;
+
+    for (char *tok = strtok_r(copy, " \t\n", &save);
+         tok != NULL && nargs < BUFSIZE; tok = strtok_r(NULL, " \t\n", &save)) {
+        args[nargs++] = tok;
+    }
+
+    if (nargs < 2 && !(nargs == 1 && strcmp(args[0], "dump") == 0)) {
+        printf("ill-formed command\n");
+    } else if (strcmp(args[0], "q") == 0 || strcmp(args[0], "a") == 0 ||
+               strcmp(args[0], "u") == 0 || strcmp(args[0], "d") == 0 ||
+               strcmp(args[0], "ttl") == 0 || strcmp(args[0], "cas") == 0 ||
+               strcmp(args[0], "incr") == 0 || strcmp(args[0], "append") == 0) {
+        line[strcspn(line, "\n")] = '\0';
+        char *reply = dbc_call(pool, args[1], line);
+        if (reply != NULL) printf("%s\n", reply);
+        ret = reply != NULL ? 0 : -1;
+        free(reply);
+    } else if (strcmp(args[0], "mq") == 0 || strcmp(args[0], "ma") == 0 ||
+               strcmp(args[0], "md") == 0) {
+        ret = shard_multi(pool, args[0][1], &args[1], nargs - 1);
+    } else if (strcmp(args[0], "scan") == 0 && nargs == 3 &&
+               atoi(args[2]) > 0) {
+        ret = shard_scan_merged(pool, args[1], atoi(args[2]));
+    } else if (strcmp(args[0], "dump") == 0 && nargs <= 2) {
+        ret = shard_dump(pool, nargs == 2 ? args[1] : NULL);
+    } else {
+        printf("ill-formed command\n");
+    }
+    free(copy);
+    return ret;
+}
+
+/*
+ * Runs one script line against the only server of the pool and prints the
+ * reply. Returns -1 if the connection failed.
+ */
+static int pool_command(dbc_pool_t *pool, char *line) {
+    line[strcspn(line, "\n")] = '\0';
+    char *reply = dbc_call(pool, NULL, line);
+    if (reply == NULL) return -1;
+    printf("%s\n", reply);
+    free(reply);
+    return 0;
+}
+
+/*
+ * Thread routine that connects to the server and runs the script in the
+ * occurence (or stdin if there is none), printing every response.
+ */
+void *run_occurence(void *arg) {
+    occurence_t *occ = (occurence_t *)arg;
+    occ->status = 1;
+
+    // Step 2: open the script if present, but default to stdin
+    FILE *infile;
+    if (occ->script != NULL) {
+        if ((infile = fopen(occ->script, "r")) == NULL) {
+            perror("Error opening script file");
+            return NULL;
         }
-        if (connect(sock, res->ai_addr, res->ai_addrlen) >= 0) {
-            break;
+    } else {
+        infile = stdin;
+    }
+
+    // shards and shared memory are only handled by the client library
+    if (occ->shards != NULL || occ->shm != NULL) {
+        dbc_pool_t pool;
+        char *line = NULL;
+        size_t len = 0;
+        if (dbc_pool_init(&pool, occ->shards != NULL ? occ->shards : occ->shm,
+                          1) == -1) {
+            if (infile != stdin) fclose(infile);
+            return NULL;
         }
-        close(sock);
+        while (getline(&line, &len, infile) != -1) {
+            if ((occ->shards != NULL ? shard_command(&pool, line)
+                                     : pool_command(&pool, line)) == -1) {
+                fprintf(stderr, "Connection terminated.\n");
+                break;
+            }
+        }
+        if (feof(infile)) {
+            printf("Client terminated cleanly.\n");
+            occ->status = 0;
+        }
+        free(line);
+        dbc_pool_destroy(&pool);
+        if (infile != stdin) fclose(infile);
+        return NULL;
     }
 
-    freeaddrinfo(result);
+    // Step 3: set up a new connection to the server
+    int sock;
+    if ((sock = dbc_socket(occ->server, occ->port)) == -1) {
+        if (infile != stdin) fclose(infile);
+        return NULL;
+    }
 
-    if (res == NULL) {
-        fprintf(stderr, "Failed to connect to '%s'!\n", server);
+    // Step 4: loop, sending queries and printing responses
+    FILE *cxn = fdopen(sock, "w+");
+    // commands and responses may carry large values, so read whole lines
+    char *rbuf = NULL, *qbuf = NULL;
+    size_t rlen = 0, qlen = 0;
+
+    while (getline(&qbuf, &qlen, infile) != -1) {
+        // send the command
+        if (fputs(qbuf, cxn) == EOF || fflush(cxn) == EOF) {
+            fprintf(stderr, "No connection!\n");
+            goto out;
+        }
+
+        // wait for the response and print it
+        if (getline(&rbuf, &rlen, cxn) == -1) {
+            fprintf(stderr, "Connection terminated.\n");
+            goto out;
+        }
+        printf("%s", rbuf);
+    }
+
+    // there are no more commands, so we can clean up and exit
+    printf("Client terminated cleanly.\n");
+    occ->status = 0;
+out:
+    free(rbuf);
+    free(qbuf);
+    fclose(cxn);
+    if (infile != stdin) fclose(infile);
+    return NULL;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline_ns) {
+    struct timespec ts;
+    ts.tv_sec = deadline_ns / 1000000000ULL;
+    ts.tv_nsec = deadline_ns % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR) {
+    }
+}
+
+// xorshift64*, one generator per worker
+static uint64_t next_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static int hist_index(uint64_t v) {
+    if (v < HIST_SUB) return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+}
+
+// midpoint of the range of values that map to bucket idx
+static uint64_t hist_value(int idx) {
+    if (idx < HIST_SUB) return idx;
+    int shift = idx / HIST_SUB - 1;
+    uint64_t low = (uint64_t)(HIST_SUB + idx % HIST_SUB) << shift;
+    return low + ((1ULL << shift) >> 1);
+}
+
+static void hist_record(histogram_t *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+static void hist_merge(histogram_t *dst, histogram_t *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+static uint64_t hist_percentile(histogram_t *h, double pct) {
+    if (h->total == 0) return 0;
+    uint64_t rank = (uint64_t)(pct / 100.0 * h->total + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = hist_value(i);
+            return v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+static void print_hist_json(FILE *out, const char *name, histogram_t *h) {
+    fprintf(out,
+            "\"%s\": {\"count\": %lu, \"mean\": %.3f, \"p50\": %.3f, "
+            "\"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"p9999\": %.3f, "
+            "\"max\": %.3f}",
+            name, (unsigned long)h->total,
+            h->total ? h->sum / h->total / 1e3 : 0.0,
+            hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+            hist_percentile(h, 99) / 1e3, hist_percentile(h, 99.9) / 1e3,
+            hist_percentile(h, 99.99) / 1e3, h->max / 1e3);
+}
+
+/*
+ * Loads the keys used by the load generator. Script lines of the form
+ * "a key value", "q key" or "d key" contribute their key; any other line
+ * contributes its first word, so files like adict_values.txt work as well.
+ */
+static int load_keys(load_config_t *cfg, const char *filename) {
+    FILE *in;
+    char line[BUFSIZE], first[BUFSIZE], second[BUFSIZE];
+    int cap = 1024;
+
+    if ((in = fopen(filename, "r")) == NULL) {
+        perror("Error opening key file");
         return -1;
     }
+    cfg->keys = malloc(cap * sizeof(char *));
+    cfg->num_keys = 0;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        int n = sscanf(line, "%1023s %1023s", first, second);
+        if (n < 1) continue;
+        char *key = first;
+        if (n == 2 && strlen(first) == 1 && strchr("aqd", first[0]) != NULL) {
+            key = second;
+        }
+        if (cfg->num_keys == cap) {
+            cap *= 2;
+            cfg->keys = realloc(cfg->keys, cap * sizeof(char *));
+        }
+        cfg->keys[cfg->num_keys++] = strdup(key);
+    }
+    fclose(in);
+
+    if (cfg->num_keys == 0) {
+        fprintf(stderr, "No keys found in '%s'\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+static void load_op_done(void *arg, const char *reply, size_t len) {
+    load_op_t *op = (load_op_t *)arg;
+    load_worker_t *w = op->w;
 
-    return sock;
+    if (reply == NULL) {
+        w->failed = 1;
+        w->errors++;
+    } else if (len == 4 && memcmp(reply, "busy", 4) == 0) {
+        // shed requests are counted apart, so as not to flatter the latency
+        w->busy++;
+    } else {
+        if (strncmp(reply, "ill-formed", 10) == 0) w->errors++;
+        hist_record(op->write ? &w->write_hist : &w->read_hist,
+                    now_ns() - op->sent);
+    }
+    op->next_free = w->free_ops;
+    w->free_ops = op;
+    w->in_flight--;
 }
 
 /*
- * Forks off a process that attempts to connect to the server, and then run the
- * script in the file provided.
- * Returns the pid of the child process.
+ * Worker of a load generation run, which keeps up to cfg->depth requests in
+ * flight. In closed-loop mode a new request is sent as soon as a response
+ * makes room for it. In open-loop mode requests follow a fixed schedule, and
+ * latency is measured from the time a request was scheduled to be sent
+ * rather than from when it was actually sent, so that a stalled server is
+ * charged for the requests it delayed (coordinated omission correction).
  */
-pid_t create_occurence(const char *server, const char *port,
-                       const char *script) {
-    pid_t pid;
+void *run_load_worker(void *arg) {
+    load_worker_t *w = (load_worker_t *)arg;
+    load_config_t *cfg = w->cfg;
+    load_op_t *ops = calloc(cfg->depth, sizeof(load_op_t));
+    char cmd[BUFSIZE];
+    dbc_pool_t pool;
+    int replica = -1;
 
-    // create a process for the client
-    if ((pid = fork()) == 0) {
-        // Step 2: open the script if present, but default to stdin
-        FILE *infile;
-        if (script != NULL) {
-            if ((infile = fopen(script, "r")) == NULL) {
-                perror("Error opening script file");
-                exit(1);
+    if (ops == NULL || dbc_pool_init(&pool, cfg->servers, 1) == -1) {
+        w->errors++;
+        free(ops);
+        return NULL;
+    }
+    // with replicas, reads are spread over them by worker and only writes
+    // go to the primary
+    if (cfg->num_read_ports > 0) {
+        const char *port = cfg->read_ports[w->id % cfg->num_read_ports];
+        if ((replica = dbc_pool_add(&pool, cfg->server, port)) == -1) {
+            w->errors++;
+            dbc_pool_destroy(&pool);
+            free(ops);
+            return NULL;
+        }
+    }
+    for (int i = 0; i < cfg->depth; i++) {
+        ops[i].w = w;
+        ops[i].next_free = w->free_ops;
+        w->free_ops = &ops[i];
+    }
+
+    uint64_t interval = 0, intended = w->start_ns;
+    if (cfg->rate > 0) {
+        interval = (uint64_t)(1e9 * cfg->concurrency / cfg->rate);
+        // stagger the workers so their requests don't arrive in bursts
+        intended += interval * w->id / cfg->concurrency;
+    }
+
+    while (!w->failed) {
+        uint64_t now = now_ns();
+        int more = interval ? intended < w->end_ns : now < w->end_ns;
+
+        while (more && w->free_ops != NULL && (!interval || intended <= now)) {
+            load_op_t *op = w->free_ops;
+            if (interval) {
+                op->sent = intended;
+                intended += interval;
+                more = intended < w->end_ns;
+            } else {
+                op->sent = now;
             }
-        } else {
-            infile = stdin;
-        }
-
-        // Step 3: set up a new connection to the server
-        int sock;
-        if ((sock = get_socket(server, port)) == -1) {
-            exit(1);
-        }
-
-        // Step 4: loop, sending queries and printing responses
-        FILE *cxn = fdopen(sock, "w+");
-        char rbuf[BUFSIZE], qbuf[BUFSIZE];
-        rbuf[0] = '\0';
-
-        while (1) {
-            // if there are no more commands, so we can clean up and exit
-            if (fgets(qbuf, sizeof(qbuf), infile) == NULL) {
-                qbuf[0] = EOF;
-                fputs(qbuf, cxn);
-                fflush(cxn);
-                fclose(cxn);
-                fclose(infile);
-                printf("Client terminated cleanly.\n");
-                exit(0);
+
+            const char *key = cfg->keys[next_rand(&w->rng) % cfg->num_keys];
+            op->write =
+                (next_rand(&w->rng) % 1000000) < cfg->write_mix * 1000000;
+            if (!op->write) {
+                snprintf(cmd, sizeof(cmd), "q %s", key);
+            } else if (next_rand(&w->rng) & 1) {
+                snprintf(cmd, sizeof(cmd), "a %s %s", key, key);
             } else {
-                // otherwise, send the command
-                if (fputs(qbuf, cxn) == EOF) {
-                    fprintf(stderr, "No connection!\n");
-                    exit(1);
-                }
-                fflush(cxn);
+                snprintf(cmd, sizeof(cmd), "d %s", key);
             }
 
-            // wait for the response and print it
-            if (fgets(rbuf, BUFSIZE, cxn) == NULL) {
-                fprintf(stderr, "Connection terminated.\n");
-                exit(1);
+            int sent = op->write || replica == -1
+                           ? dbc_send(&pool, key, cmd, load_op_done, op)
+                           : dbc_send_to(&pool, replica, cmd, load_op_done, op);
+            if (sent == -1) {
+                w->failed = 1;
+                w->errors++;
+                break;
             }
-            printf("%s", rbuf);
+            w->free_ops = op->next_free;
+            w->in_flight++;
+        }
+        if (!more && w->in_flight == 0) break;
+
+        // wait for responses, or until the next request is due
+        long long timeout = -1;
+        if (interval && more && w->free_ops != NULL) {
+            now = now_ns();
+            timeout = intended > now ? (long long)(intended - now) : 0;
+        }
+        if (w->in_flight == 0) {
+            sleep_until(intended);
+        } else if (dbc_poll(&pool, timeout) == -1) {
+            w->failed = 1;
+            w->errors++;
         }
     }
+    if (w->failed) fprintf(stderr, "worker %d: connection terminated\n", w->id);
+
+    dbc_pool_destroy(&pool);
+    free(ops);
+    return NULL;
+}
+
+static void count_failure(void *arg, const char *reply, size_t len) {
+    if (reply == NULL) (*(int *)arg)++;
+}
+
+/*
+ * Adds every key once so that reads during the run find something. The adds
+ * are pipelined in batches.
+ */
+static int preload_keys(load_config_t *cfg) {
+    char cmd[BUFSIZE];
+    dbc_pool_t pool;
+    int failures = 0;
 
-    // return pid of child
-    return pid;
+    if (dbc_pool_init(&pool, cfg->servers, 1) == -1) return -1;
+    for (int i = 0; i < cfg->num_keys && failures == 0; i++) {
+        snprintf(cmd, sizeof(cmd), "a %s %s", cfg->keys[i], cfg->keys[i]);
+        if (dbc_send(&pool, cfg->keys[i], cmd, count_failure, &failures) ==
+            -1) {
+            failures++;
+        }
+        if (i % 1024 == 1023) dbc_wait(&pool);
+    }
+    dbc_wait(&pool);
+    dbc_pool_destroy(&pool);
+    return failures ? -1 : 0;
+}
+
+/*
+ * Runs the load generator and prints its results as a single JSON object.
+ */
+int run_load(load_config_t *cfg, FILE *out) {
+    if (cfg->preload && preload_keys(cfg) == -1) {
+        fprintf(stderr, "Failed to preload keys\n");
+        return 1;
+    }
+
+    load_worker_t *workers = calloc(cfg->concurrency, sizeof(load_worker_t));
+    if (workers == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    // give the workers time to connect before the clock starts
+    uint64_t start = now_ns() + 100000000ULL;
+    uint64_t end = start + (uint64_t)(cfg->duration * 1e9);
+    for (int i = 0; i < cfg->concurrency; i++) {
+        workers[i].id = i;
+        workers[i].cfg = cfg;
+        workers[i].start_ns = start;
+        workers[i].end_ns = end;
+        workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        int err;
+        if ((err = pthread_create(&workers[i].thread, 0, run_load_worker,
+                                  &workers[i])) != 0) {
+            errno = err;
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    histogram_t *reads = calloc(1, sizeof(histogram_t));
+    histogram_t *writes = calloc(1, sizeof(histogram_t));
+    histogram_t *all = calloc(1, sizeof(histogram_t));
+    uint64_t errors = 0;
+    uint64_t busy = 0;
+    for (int i = 0; i < cfg->concurrency; i++) {
+        pthread_join(workers[i].thread, NULL);
+        hist_merge(reads, &workers[i].read_hist);
+        hist_merge(writes, &workers[i].write_hist);
+        errors += workers[i].errors;
+        busy += workers[i].busy;
+    }
+    uint64_t finished = now_ns();
+    hist_merge(all, reads);
+    hist_merge(all, writes);
+
+    if (finished > end) finished = end;
+    double elapsed = finished > start ? (finished - start) / 1e9 : 0;
+    fprintf(out,
+            "{\"mode\": \"%s\", \"concurrency\": %d, \"depth\": %d, "
+            "\"replicas\": %d, \"shards\": %d, "
+            "\"target_rate\": %.1f, "
+            "\"write_mix\": %.3f, \"keys\": %d, \"duration_s\": %.3f, "
+            "\"ops\": %lu, \"errors\": %lu, \"busy\": %lu, "
+            "\"throughput_ops\": %.1f, "
+            "\"latency_us\": {",
+            cfg->rate > 0 ? "open" : "closed", cfg->concurrency, cfg->depth,
+            cfg->num_read_ports, cfg->num_shards, cfg->rate, cfg->write_mix,
+            cfg->num_keys, elapsed, (unsigned long)all->total,
+            (unsigned long)errors, (unsigned long)busy,
+            elapsed > 0 ? all->total / elapsed : 0.0);
+    print_hist_json(out, "all", all);
+    fprintf(out, ", ");
+    print_hist_json(out, "read", reads);
+    fprintf(out, ", ");
+    print_hist_json(out, "write", writes);
+    fprintf(out, "}}\n");
+
+    free(all);
+    free(reads);
+    free(writes);
+    free(workers);
+    return errors ? 1 : 0;
 }
 
 /*
@@ -128,55 +841,193 @@ pid_t create_occurence(const char *server, const char *port,
 void usage_error(const char *cmd) {
     fprintf(stderr,
             "Usage: %s <servername> <port> "
-            "[<script> <occurences>]\n",
-            cmd);
+            "[<script> <occurences>]\n"
+            "       %s -s shards [-i] [<script> <occurences>]\n"
+            "       %s -b [-c concurrency] [-p depth] [-d seconds] "
+            "[-r ops_per_sec] [-w write_fraction] [-k keyfile] [-P] "
+            "[-R ports] [-o outfile] <servername> <port>\n"
+            "       %s -b [options] -s shards\n"
+            "  <servername> <port> may also be unix <path> for a server's "
+            "Unix socket, or\n"
+            "  shm <path> to move the commands to shared memory over that "
+            "socket\n"
+            "  -s  comma-separated host:port list of servers to spread the "
+            "keys over by\n"
+            "      consistent hashing, in place of <servername> <port>\n"
+            "  -i  with -s, the servers were started with -i: merge their "
+            "scans and dumps\n"
+            "      in numeric key order\n"
+            "  -b  run as a load generator instead of replaying a script\n"
+            "  -c  number of connections, one thread each (default 1)\n"
+            "  -p  requests each connection keeps in flight (default 1)\n"
+            "  -d  measurement duration in seconds (default 10)\n"
+            "  -r  open-loop target rate over all connections; 0 (default) "
+            "runs closed-loop\n"
+            "  -w  fraction of operations that are writes, split evenly "
+            "between adds and deletes (default 0)\n"
+            "  -k  file to draw keys from (default scripts/adict.txt)\n"
+            "  -P  add every key before the measurement starts\n"
+            "  -R  comma-separated ports of replicas on the same host; "
+            "reads are spread\n"
+            "      over them and writes go to <port>\n"
+            "  -o  write the JSON results to a file instead of stdout\n",
+            cmd, cmd, cmd, cmd);
 }
 
 /*
  * The arguments to the client should be servername, port number,
  * [script-file, number of occurences].
  *
- * Step 1: fork to create as many clients as number of occurences argument
+ * Step 1: start a thread for as many clients as number of occurences argument
  *
  * Step 2: open the script-file
  *
  * Step 3: find the server address, set up socket for TCP and connect to server
  *
- * Step 4: set up an infinite loop that sends queries from the
- *         script-file to the server and prints responses (if any exist)
+ * Step 4: set up a loop that sends queries from the script-file to the
+ *         server and prints responses (if any exist)
+ *
+ * With -b the client instead generates load against the server and reports
+ * throughput and latency percentiles.
  */
-int main(int argc, const char *argv[]) {
-    // parse args
-    if (argc != 3 && argc != 5) {
+int main(int argc, char *const argv[]) {
+    load_config_t cfg;
+    const char *keyfile = "scripts/adict.txt";
+    const char *outfile = NULL;
+    const char *shards = NULL;
+    char *servers = NULL;
+    int bench = 0, opt;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.concurrency = 1;
+    cfg.depth = 1;
+    cfg.duration = 10;
+
+    while ((opt = getopt(argc, argv, "bc:p:d:r:w:k:PR:o:s:i")) != -1) {
+        switch (opt) {
+            case 'b':
+                bench = 1;
+                break;
+            case 'c':
+                cfg.concurrency = atoi(optarg);
+                break;
+            case 'p':
+                cfg.depth = atoi(optarg);
+                break;
+            case 'd':
+                cfg.duration = atof(optarg);
+                break;
+            case 'r':
+                cfg.rate = atof(optarg);
+                break;
+            case 'w':
+                cfg.write_mix = atof(optarg);
+                break;
+            case 'k':
+                keyfile = optarg;
+                break;
+            case 'P':
+                cfg.preload = 1;
+                break;
+            case 'R':
+                for (char *port = strtok(optarg, ","); port != NULL;
+                     port = strtok(NULL, ",")) {
+                    cfg.read_ports =
+                        realloc(cfg.read_ports,
+                                (cfg.num_read_ports + 1) * sizeof(char *));
+                    cfg.read_ports[cfg.num_read_ports++] = port;
+                }
+                break;
+            case 'o':
+                outfile = optarg;
+                break;
+            case 's':
+                shards = optarg;
+                break;
+            case 'i':
+                int_keys = 1;
+                break;
+            default:
+                usage_error(argv[0]);
+                return 1;
+        }
+    }
+
+    // with shards, there is no <servername> <port> to skip
+    int nargs = argc - optind + (shards != NULL ? 2 : 0);
+    if ((bench && nargs != 2) || (!bench && nargs != 2 && nargs != 4) ||
+        (shards != NULL && cfg.num_read_ports > 0) || cfg.concurrency < 1 ||
+        cfg.depth < 1 || cfg.duration <= 0 || cfg.rate < 0 ||
+        cfg.write_mix < 0 || cfg.write_mix > 1) {
         usage_error(argv[0]);
         return 1;
     }
 
+    if (shards != NULL) {
+        shard_ring_t ring;
+        if (shard_ring_init(&ring, shards, SHARD_VNODES) == -1) {
+            fprintf(stderr, "Bad shard list '%s'\n", shards);
+            return 1;
+        }
+        cfg.servers = shards;
+        cfg.num_shards = ring.num_shards;
+        shard_ring_destroy(&ring);
+    } else {
+        cfg.server = argv[optind];
+        cfg.port = argv[optind + 1];
+        servers = malloc(strlen(cfg.server) + strlen(cfg.port) + 2);
+        sprintf(servers, "%s:%s", cfg.server, cfg.port);
+        cfg.servers = servers;
+    }
+
+    if (bench) {
+        FILE *out = stdout;
+        if (load_keys(&cfg, keyfile) == -1) return 1;
+        if (outfile != NULL && (out = fopen(outfile, "w")) == NULL) {
+            perror("Error opening output file");
+            return 1;
+        }
+        int ret = run_load(&cfg, out);
+        if (out != stdout) fclose(out);
+        free(servers);
+        return ret;
+    }
+
     int i, occurences = 1;
     const char *script = NULL;
-    const char *server = argv[1];
-    const char *port = argv[2];
-
-    if (argc == 5) {
-        script = argv[3];
-        occurences = atoi(argv[4]);
+    if (nargs == 4) {
+        script = argv[argc - 2];
+        occurences = atoi(argv[argc - 1]);
     }
 
     // Step 1: create clients, they'll do the rest
+    occurence_t *occs =
+        calloc(occurences > 0 ? occurences : 1, sizeof(occurence_t));
     for (i = 0; i < occurences; i++) {
-        if (create_occurence(server, port, script) == -1) {
-            perror("Error forking off process");
+        occs[i].server = cfg.server;
+        occs[i].port = cfg.port;
+        occs[i].script = script;
+        occs[i].shards = shards;
+        occs[i].shm = cfg.server != NULL && strcmp(cfg.server, "shm") == 0
+                          ? servers
+                          : NULL;
+        int err;
+        if ((err = pthread_create(&occs[i].thread, 0, run_occurence,
+                                  &occs[i])) != 0) {
+            errno = err;
+            perror("Error creating client thread");
             return 1;
         }
     }
 
-    // wait for children to terminate
+    // wait for the clients to terminate
+    int status = 0;
     for (i = 0; i < occurences; i++) {
-        if (wait(0) == -1) {
-            perror("wait");
-            return 1;
-        }
+        pthread_join(occs[i].thread, NULL);
+        status |= occs[i].status;
     }
+    free(occs);
+    free(servers);
 
-    return 0;
+    return status;
 }
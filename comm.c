@@ -6,33 +6,95 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include "./affinity.h"
+#include "./probes.h"
+#include "./shmring.h"
+#include "./slowlog.h"
 
 /* Serverside I/O functions */
 
 int lsock;
 
 static void *listener(void (*server)(FILE *));
+static void *unix_listener(void (*server)(FILE *));
 
 static int comm_port;
+static const char *unix_path;
 
-/* Notice that this function takes in an argument `server`, which is a function 
-   that takes in a file pointer. What function have you 
+// How long a client thread sleeps on an idle shared-memory channel before
+// checking that its client is still there (100ms).
+#define COMM_SHM_CHECK_NS 100000000LL
+
+// Initial size of the buffer of commands taken from a channel.
+#define COMM_SHM_BUF 4096
+
+struct comm_shm {
+    shm_channel_t *ch;
+    int sock;
+    char *in;  // taken from the ring and not yet returned, from in_off
+    size_t in_off, in_len, in_cap;
+};
+
+/* Notice that this function takes in an argument `server`, which is a function
+   that takes in a file pointer. What function have you
    implemented that has a file pointer as an argument? */
 pthread_t start_listener(int port, void (*server)(FILE *)) {
     comm_port = port;
     pthread_t tid;
+    pthread_attr_t attr;
     int err;
 
-    if ((err = pthread_create(&tid, 0, (void *(*)(void *))listener,
+    // the listener is pinned, and its client threads follow it (affinity.h)
+    affinity_attr(&attr);
+    if ((err = pthread_create(&tid, &attr, (void *(*)(void *))listener,
                               (void *)server)))
-        handle_error_en(err, "pthread_create"); 
- 
+        handle_error_en(err, "pthread_create");
+    pthread_attr_destroy(&attr);
+
     return tid;
 }
 
+/*
+ * Accepts connections on the listening socket sock for good, handing each to
+ * server.
+ */
+static void accept_loop(int sock, void (*server)(FILE *)) {
+    while (1) {
+        int csock;
+        struct sockaddr_storage client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        if ((csock = accept(sock, (struct sockaddr *)&client_addr,
+                            &client_len)) < 0) {
+            perror("accept");
+            continue;
+        }
+
+        if (client_addr.ss_family == AF_INET) {
+            struct sockaddr_in *in = (struct sockaddr_in *)&client_addr;
+            fprintf(stderr, "received connection from %s#%hu\n",
+                    inet_ntoa(in->sin_addr), in->sin_port);
+        } else {
+            fprintf(stderr, "received local connection\n");
+        }
+
+        FILE *cxstr;
+        if (!(cxstr = fdopen(csock, "w+"))) {
+            perror("fdopen");
+            if (close(csock) < 0) perror("close");
+            continue;
+        }
+
+        PROBE1(conn_accept, csock);
+        server(cxstr);
+    }
+}
+
 void *listener(void (*server)(FILE *)) {
     if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket");
@@ -58,48 +120,275 @@ void *listener(void (*server)(FILE *)) {
     }
 
     fprintf(stderr, "listening on port %d\n", comm_port);
+    accept_loop(lsock, server);
+    return NULL;
+}
 
-    while (1) {
-        int csock;
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
+pthread_t start_unix_listener(const char *path, void (*server)(FILE *)) {
+    unix_path = path;
+    pthread_t tid;
+    pthread_attr_t attr;
+    int err;
 
-        if ((csock = accept(lsock, (struct sockaddr *)&client_addr,
-                            &client_len)) < 0) {
-            perror("accept");
-            continue;
-        }
+    affinity_attr(&attr);
+    if ((err = pthread_create(&tid, &attr, (void *(*)(void *))unix_listener,
+                              (void *)server)))
+        handle_error_en(err, "pthread_create");
+    pthread_attr_destroy(&attr);
 
-        fprintf(stderr, "received connection from %s#%hu\n",
-                inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
+    return tid;
+}
 
-        FILE *cxstr;
-        if (!(cxstr = fdopen(csock, "w+"))) {
-            perror("fdopen");
-            if (close(csock) < 0) perror("close");
-            continue;
-        }
+void *unix_listener(void (*server)(FILE *)) {
+    int sock;
+    struct sockaddr_un addr;
+    struct stat st;
 
-        server(cxstr);
+    if (strlen(unix_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", unix_path);
+        exit(1);
+    }
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        exit(1);
     }
 
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, unix_path);
+    // a socket left behind by a server that was killed would fail the bind
+    if (stat(unix_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(unix_path);
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        if (close(sock) < 0) perror("close");
+        exit(1);
+    }
+
+    if (listen(sock, 100) < 0) {
+        perror("listen");
+        if (close(sock) < 0) perror("close");
+        exit(1);
+    }
+
+    fprintf(stderr, "listening on %s\n", unix_path);
+    accept_loop(sock, server);
     return NULL;
 }
 
+void stop_unix_listener(pthread_t tid) {
+    int err;
+
+    if ((err = pthread_cancel(tid)) != 0)
+        handle_error_en(err, "pthread_cancel");
+    if ((err = pthread_join(tid, 0)) != 0) handle_error_en(err, "pthread_join");
+    if (unlink(unix_path) < 0) perror("unlink");
+}
+
 void comm_shutdown(FILE *cxstr) {
+    PROBE1(conn_close, fileno(cxstr));
     if (fclose(cxstr) < 0) perror("fclose");
 }
 
-int comm_serve(FILE *cxstr, char *response, char *command) {
-    if (strlen(response) > 0) {
-        if (fputs(response, cxstr) == EOF || fputc('\n', cxstr) == EOF ||
-            fflush(cxstr) == EOF) {
+/*
+ * Writes len bytes of data, followed by a newline, straight to the socket
+ * underlying cxstr. Returns 0 on success or -1 if the connection failed.
+ */
+static int send_line(FILE *cxstr, const char *data, size_t len) {
+    struct iovec iov[2] = {{(char *)data, len}, {(char *)"\n", 1}};
+    struct iovec *v = iov;
+    int iovcnt = 2;
+    int fd = fileno(cxstr);
+
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, v, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Sends response as the only line on a connection that won't be served, and
+ * closes it.
+ */
+void comm_refuse(FILE *cxstr, const char *response) {
+    send_line(cxstr, response, strlen(response));
+    comm_shutdown(cxstr);
+}
+
+/*
+ * Sends the response to the previous command, if any, and reads the next
+ * command into *command, which is grown as needed (see getline(3)). If reply
+ * is not NULL the response is the value it holds, which is sent without being
+ * copied; otherwise it is the string in response.
+ *
+ * Responses bypass the stream's buffer: writing through a stream that still
+ * holds input would make stdio discard it, and a client may have sent several
+ * commands before reading any response.
+ */
+int comm_serve(FILE *cxstr, char *response, blob_t *reply, char **command,
+               size_t *command_len) {
+    if (reply != NULL) {
+        if (send_line(cxstr, reply->data, reply->len) == -1) {
+            fprintf(stderr, "client connection terminated\n");
+            return -1;
+        }
+    } else if (strlen(response) > 0) {
+        if (send_line(cxstr, response, strlen(response)) == -1) {
             fprintf(stderr, "client connection terminated\n");
             return -1;
         }
     }
+    slowlog_replied();
+
+    if (getline(command, command_len, cxstr) == -1) {
+        fprintf(stderr, "client connection terminated\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+comm_shm_t *comm_shm_accept(FILE *cxstr, char *response, int len) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int sock = fileno(cxstr);
+    shm_channel_t *ch;
+    comm_shm_t *shm;
+
+    // the channel is passed as a file descriptor, which takes a Unix socket
+    if (getsockname(sock, (struct sockaddr *)&addr, &addrlen) != 0 ||
+        addr.ss_family != AF_UNIX) {
+        snprintf(response, len, "shm needs a unix socket");
+        return NULL;
+    }
+    if (send_line(cxstr, "shm", 3) == -1 || (ch = shm_accept(sock)) == NULL) {
+        snprintf(response, len, "shm failed");
+        return NULL;
+    }
+    if ((shm = malloc(sizeof(comm_shm_t))) == NULL ||
+        (shm->in = malloc(COMM_SHM_BUF)) == NULL) {
+        free(shm);
+        shm_close(ch, 0);
+        snprintf(response, len, "shm failed");
+        return NULL;
+    }
+    shm->ch = ch;
+    shm->sock = sock;
+    shm->in_off = shm->in_len = 0;
+    shm->in_cap = COMM_SHM_BUF;
+    if (send_line(cxstr, "ok", 2) == -1) {
+        comm_shm_release(shm);
+        snprintf(response, len, "shm failed");
+        return NULL;
+    }
+    response[0] = '\0';
+    return shm;
+}
+
+void comm_shm_release(comm_shm_t *shm) {
+    if (shm == NULL) return;
+    shm_close(shm->ch, 0);
+    free(shm->in);
+    free(shm);
+}
+
+// Returns 1 if the client has closed the channel or its socket.
+static int shm_gone(comm_shm_t *shm) {
+    return __atomic_load_n(&shm->ch->closed, __ATOMIC_ACQUIRE) ||
+           shm_peer_gone(shm->sock);
+}
+
+/*
+ * Copies len bytes of data into the reply ring, waiting for room as needed.
+ * Returns -1 if the client went away.
+ */
+static int shm_send(comm_shm_t *shm, const char *data, size_t len) {
+    shm_ring_t *ring = &shm->ch->replies;
+
+    while (len > 0) {
+        size_t n = shm_put(ring, data, len);
+        data += n;
+        len -= n;
+        if (n == 0 && !shm_wait_writable(ring, COMM_SHM_CHECK_NS) &&
+            shm_gone(shm)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reads the next command from the command ring into *command, like
+ * getline(3). Returns -1 if the client went away.
+ */
+static int shm_getline(comm_shm_t *shm, char **command, size_t *command_len) {
+    shm_ring_t *ring = &shm->ch->commands;
+    size_t scanned = 0, len;
+    char *nl;
+
+    while ((nl = memchr(shm->in + shm->in_off + scanned, '\n',
+                        shm->in_len - shm->in_off - scanned)) == NULL) {
+        scanned = shm->in_len - shm->in_off;
+        memmove(shm->in, shm->in + shm->in_off, scanned);
+        shm->in_off = 0;
+        shm->in_len = scanned;
+        if (shm->in_cap - shm->in_len < COMM_SHM_BUF) {
+            char *in = realloc(shm->in, shm->in_cap * 2);
+            if (in == NULL) return -1;
+            shm->in = in;
+            shm->in_cap *= 2;
+        }
+        size_t n =
+            shm_get(ring, shm->in + shm->in_len, shm->in_cap - shm->in_len);
+        shm->in_len += n;
+        if (n == 0 && !shm_wait_readable(ring, COMM_SHM_CHECK_NS) &&
+            shm_gone(shm)) {
+            return -1;
+        }
+    }
+
+    len = nl + 1 - (shm->in + shm->in_off);
+    if (*command_len < len + 1) {
+        char *cmd = realloc(*command, len + 1);
+        if (cmd == NULL) return -1;
+        *command = cmd;
+        *command_len = len + 1;
+    }
+    memcpy(*command, shm->in + shm->in_off, len);
+    (*command)[len] = '\0';
+    shm->in_off += len;
+    return 0;
+}
+
+/*
+ * comm_serve() for a client that has moved to a shared-memory channel.
+ */
+int comm_shm_serve(comm_shm_t *shm, char *response, blob_t *reply,
+                   char **command, size_t *command_len) {
+    const char *data = reply != NULL ? reply->data : response;
+    size_t len = reply != NULL ? reply->len : strlen(response);
+
+    if ((reply != NULL || len > 0) &&
+        (shm_send(shm, data, len) == -1 || shm_send(shm, "\n", 1) == -1)) {
+        fprintf(stderr, "client connection terminated\n");
+        return -1;
+    }
+    slowlog_replied();
 
-    if (fgets(command, BUFLEN, cxstr) == NULL) {
+    if (shm_getline(shm, command, command_len) == -1) {
         fprintf(stderr, "client connection terminated\n");
         return -1;
     }
@@ -4,8 +4,8 @@
 #include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
+#include "./blob.h"
 
-#define BUFLEN 256
 #define handle_error_en(en, msg) \
     do {                         \
         errno = en;              \
@@ -14,7 +14,24 @@
     } while (0)
 
 pthread_t start_listener(int port, void (*serve_func)(FILE *));
+pthread_t start_unix_listener(const char *path, void (*serve_func)(FILE *));
+void stop_unix_listener(pthread_t tid);
 void comm_shutdown(FILE *cxstr);
-int comm_serve(FILE *cxstr, char *resp, char *cmd);
+void comm_refuse(FILE *cxstr, const char *response);
+int comm_serve(FILE *cxstr, char *resp, blob_t *reply, char **cmd,
+               size_t *cmdlen);
+
+/*
+ * Clients connected over the Unix socket may move their commands to a
+ * shared-memory channel (see shmring.h) by sending "shm". comm_shm_accept()
+ * completes the handshake on cxstr and returns the channel, or NULL with an
+ * error in response; comm_shm_serve() then takes the place of comm_serve().
+ */
+typedef struct comm_shm comm_shm_t;
+
+comm_shm_t *comm_shm_accept(FILE *cxstr, char *resp, int len);
+int comm_shm_serve(comm_shm_t *shm, char *resp, blob_t *reply, char **cmd,
+                   size_t *cmdlen);
+void comm_shm_release(comm_shm_t *shm);
 
 #endif  // COMM_H_
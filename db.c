@@ -1,289 +1,1175 @@
+#define _GNU_SOURCE  // for the unlocked stdio functions
 #include "./db.h"
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "./arena.h"
 #include "./comm.h"
+#include "./ebr.h"
+#include "./lockstat.h"
+#include "./probes.h"
+#include "./qcache.h"
+#include "./repl.h"
+#include "./slowlog.h"
+#include "./stats.h"
+#include "./ttl.h"
+#include "./vindex.h"
+#include "./watch.h"
 
 #define MAXLEN 256
 
-// The root node of the binary tree, unlike all
-// other nodes in the tree, this one is never
-// freed (it's allocated in the data region).
-node_t head = {"", "", 0, 0};
+/*
+ * The partitions of the key space (see db_set_partitions()), of which only
+ * the first is used unless it is on. Each has a tree of its own, whose root,
+ * unlike all other nodes in the tree, is never freed (it's allocated in the
+ * data region) and holds no key: every key of the partition goes right of
+ * it. The key counts next to the root are kept by the writers of the
+ * partition, which lock the root anyway, so each partition is aligned to
+ * cache lines of its own.
+ */
+typedef struct partition {
+    node_t root;
+    long keys;          // keys in the tree, approximately
+    unsigned long seq;  // odd while move_boundary() moves keys in or out
+} __attribute__((aligned(64))) partition_t;
+
+static partition_t parts[DB_MAX_PARTITIONS] = {
+    {.root = {.name = "", .value = "", .ikey = LLONG_MIN}}};
+
+static int num_parts = 1;
+
+/*
+ * All node locks are taken and released through these helpers. depth is the
+ * distance of the node from the root of its partition; it is only used when
+ * the lock profiler is compiled in (see lockstat.h).
+ *
+ * A write lock also makes the node's version odd until it is released, when
+ * the version becomes even again, so the version changes whenever the node's
+ * key or children may have (see the optimistic writers below). Only the
+ * holder of the write lock can see an odd version when unlocking.
+ */
+static inline void lock_node(node_t *node, enum locktype lt, int depth) {
+    if (depth == 0) slowlog_walk_begin();
+    PROBE3(lock_acquire, node, depth, lt == l_write);
+#ifdef DB_LOCKSTAT
+    lockstat_lock(&node->lock, lt == l_write, depth);
+#else
+    int err;
+    long long start;
+    // only a lock that has to be waited for is timed for the slow log
+    if (lt == l_read) {
+        if ((err = pthread_rwlock_tryrdlock(&node->lock)) == EBUSY) {
+            start = slowlog_wait_begin();
+            err = pthread_rwlock_rdlock(&node->lock);
+            slowlog_wait_end(start);
+        }
+        if (err != 0) handle_error_en(err, "pthread_rwlock_rdlock");
+    } else {
+        if ((err = pthread_rwlock_trywrlock(&node->lock)) == EBUSY) {
+            start = slowlog_wait_begin();
+            err = pthread_rwlock_wrlock(&node->lock);
+            slowlog_wait_end(start);
+        }
+        if (err != 0) handle_error_en(err, "pthread_rwlock_wrlock");
+    }
+#endif
+    PROBE3(lock_acquired, node, depth, lt == l_write);
+    if (lt == l_write) {
+        __atomic_store_n(&node->version, node->version + 1, __ATOMIC_RELAXED);
+        // the odd version must be visible before any change to the node
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+}
+
+static inline void unlock_node(node_t *node) {
+    PROBE1(lock_release, node);
+    if (node->version & 1) {
+        __atomic_store_n(&node->version, node->version + 1, __ATOMIC_RELEASE);
+    }
+#ifdef DB_LOCKSTAT
+    lockstat_unlock(&node->lock);
+#else
+    int err;
+    if ((err = pthread_rwlock_unlock(&node->lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+#endif
+}
+
+static node_t *search_depth(char *name, node_t *parent, node_t **parentpp,
+                            enum locktype lt, int depth, int *depthp);
+
+/*
+ * Optimistic writers, switched on by db_set_optimistic(). Instead of
+ * write-locking the whole path from the root, a writer descends without
+ * locks, checking each node's version before and after following its child
+ * pointer, and write-locks only the nodes it changes, starting over if their
+ * versions have moved since it read them. Writers to different parts of the
+ * tree thus don't serialize at the root. Nodes passed on the way may be
+ * unlinked and freed meanwhile, so nodes and names are retired through
+ * ebr.h instead of being freed while this is on.
+ */
+static int optimistic;
+
+// Waits until node isn't write-locked and returns its version.
+static inline unsigned long read_begin(node_t *node) {
+    unsigned long v;
+    long long start;
+    if ((v = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE)) & 1) {
+        start = slowlog_wait_begin();
+        while ((v = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+        }
+        slowlog_wait_end(start);
+    }
+    return v;
+}
+
+// Returns nonzero if node hasn't been write-locked since read_begin()
+// returned v, so that what was read from it in between is consistent.
+static inline int read_valid(node_t *node, unsigned long v) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&node->version, __ATOMIC_RELAXED) == v;
+}
+
+// Write-locks node and returns nonzero if nobody else has write-locked it
+// since read_begin() returned v. Otherwise the node is unlocked again.
+static inline int lock_valid(node_t *node, unsigned long v, int depth) {
+    lock_node(node, l_write, depth);
+    if (node->version == v + 1) return 1;
+    unlock_node(node);
+    return 0;
+}
+
+// Frees a name that optimistic writers may still be comparing with.
+static void free_name(char *name) {
+    if (optimistic)
+        ebr_retire(name, free);
+    else
+        free(name);
+}
+
+// Node memory comes from the NUMA arenas when they are on (see arena.h).
+static inline node_t *alloc_node(void) {
+    node_t *node = arena_enabled() ? arena_alloc() : malloc(sizeof(node_t));
+    PROBE1(node_alloc, node);
+    return node;
+}
+
+static inline void release_node(node_t *node) {
+    PROBE1(node_free, node);
+    if (arena_enabled())
+        arena_free(node);
+    else
+        free(node);
+}
+
+// ebr_retire() callback for a node, freeing its name with it.
+static void free_node(void *node) {
+    free(((node_t *)node)->name);
+    release_node(node);
+}
+
+/*
+ * Integer keys. db_set_int_keys() makes every key the decimal form of a
+ * 64-bit integer. The integer is stored in the node as ikey and parsed once
+ * per operation from the key looked up, so the tree is ordered numerically
+ * and a descent compares integers instead of strings. The name is still kept
+ * for replies and for the modules that work on key strings; since only the
+ * canonical form of an integer is accepted (see db_key_valid()), names are
+ * equal exactly when their integers are.
+ */
+static int int_keys;
+
+// A key being looked up: its name and, with integer keys, its integer.
+typedef struct dbkey {
+    char *name;
+    long long ikey;
+} dbkey_t;
+
+static inline dbkey_t make_key(char *name) {
+    dbkey_t key = {name, 0};
+    // the empty name, which starts a scan at the first key, sorts first
+    if (int_keys) key.ikey = *name != '\0' ? strtoll(name, 0, 10) : LLONG_MIN;
+    return key;
+}
+
+// Compares key with the key of node in the order of the tree.
+static inline int key_cmp(const dbkey_t *key, node_t *node) {
+    if (int_keys) return (key->ikey > node->ikey) - (key->ikey < node->ikey);
+    return strcmp(key->name, node->name);
+}
+
+// Compares two names in the order of the tree.
+static int name_cmp(char *a, char *b) {
+    if (int_keys) {
+        long long x = make_key(a).ikey, y = make_key(b).ikey;
+        return (x > y) - (x < y);
+    }
+    return strcmp(a, b);
+}
+
+void db_set_int_keys(int enable) { int_keys = enable; }
+
+int db_key_valid(char *name) {
+    char canonical[24];
+    char *end;
+    long long n;
+
+    if (!int_keys) return 1;
+    errno = 0;
+    n = strtoll(name, &end, 10);
+    if (errno != 0 || end == name || *end != '\0') return 0;
+    // rejects signs, leading zeros and spaces, which strtoll() accepts
+    snprintf(canonical, sizeof(canonical), "%lld", n);
+    return strcmp(canonical, name) == 0;
+}
+
+/*
+ * Partition boundaries. Partition i holds the keys from names[i] (ikeys[i]
+ * with integer keys) up to those of partition i + 1; partition 0 has no lower
+ * bound. A set of boundaries is never changed once published: move_boundary()
+ * moves one by publishing a copy in bounds and handing the old set to
+ * ebr_retire(), so operations on one key read them in an ebr_enter() section.
+ * The boundaries of a partition only move while its root is write-locked and
+ * its seq is odd, so such an operation picks the partition and checks, once
+ * it holds a lock in the partition, that the key still belongs there,
+ * starting over if not. Operations on every partition (scans, walks, prints,
+ * exports, expiry and clearing) hold map_lock for reading instead, which the
+ * rebalancer only tries to take for writing, so that the boundaries stay put
+ * while they go from one partition to the next.
+ */
+typedef struct bounds {
+    int used;  // partitions that may hold keys
+    long long ikeys[DB_MAX_PARTITIONS];
+    char names[DB_MAX_PARTITIONS][MAXLEN + 1];  // the last byte stays 0
+} bounds_t;
+
+static bounds_t first_bounds = {1};
+static bounds_t *bounds = &first_bounds;
+
+static pthread_rwlock_t map_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+int db_set_partitions(int n) {
+    int err;
+
+    if (n < 1 || n > DB_MAX_PARTITIONS) return -1;
+    for (int i = 1; i < n; i++) {
+        parts[i].root = parts[0].root;
+        if ((err = pthread_rwlock_init(&parts[i].root.lock, 0)) != 0) {
+            handle_error_en(err, "pthread_rwlock_init");
+        }
+    }
+    num_parts = n;
+    return 0;
+}
+
+// Returns the current boundaries, which stay valid until ebr_exit() or, in
+// an operation on every partition, map_release().
+static inline bounds_t *bounds_get(void) {
+    return __atomic_load_n(&bounds, __ATOMIC_ACQUIRE);
+}
+
+// Returns the partition of key under the boundaries b.
+static inline int part_of(const bounds_t *b, const dbkey_t *key) {
+    int lo = 0, hi = b->used - 1;
+
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        int c = int_keys ? (key->ikey >= b->ikeys[mid] ? 1 : -1)
+                         : strcmp(key->name, b->names[mid]);
+        if (c >= 0)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+// Returns the partition of key for a caller that holds a lock in it, which
+// keeps its boundaries from moving.
+static int part_at(const dbkey_t *key) {
+    int i;
+
+    if (num_parts == 1) return 0;
+    ebr_enter();
+    i = part_of(bounds_get(), key);
+    ebr_exit();
+    return i;
+}
+
+// Waits until no keys are moving in or out of partition i and returns its
+// seq.
+static inline unsigned long part_read_begin(int i) {
+    unsigned long seq;
+    while ((seq = __atomic_load_n(&parts[i].seq, __ATOMIC_ACQUIRE)) & 1) {
+        sched_yield();
+    }
+    return seq;
+}
+
+// Returns nonzero if no keys have moved in or out of partition i since
+// part_read_begin() returned seq.
+static inline int part_read_valid(int i, unsigned long seq) {
+    return __atomic_load_n(&parts[i].seq, __ATOMIC_ACQUIRE) == seq;
+}
+
+// Returns nonzero if node is the root of a partition.
+static inline int is_root(node_t *node) {
+    uintptr_t p = (uintptr_t)node;
+    return p >= (uintptr_t)parts && p < (uintptr_t)(parts + DB_MAX_PARTITIONS);
+}
+
+/*
+ * Locks the root of the partition of key in the given mode and returns it.
+ * The caller then descends from it hand over hand, and so always holds a
+ * lock in the partition until it is done. Must not be called in an
+ * ebr_enter() section.
+ */
+static node_t *lock_root(const dbkey_t *key, enum locktype lt) {
+    node_t *root;
+    int i;
+
+    if (num_parts == 1) {
+        lock_node(&parts[0].root, lt, 0);
+        return &parts[0].root;
+    }
+    ebr_enter();
+    while (1) {
+        i = part_of(bounds_get(), key);
+        root = &parts[i].root;
+        lock_node(root, lt, 0);
+        // the boundaries may have moved before the root was locked
+        if (part_of(bounds_get(), key) == i) break;
+        unlock_node(root);
+    }
+    ebr_exit();
+    return root;
+}
+
+// Counts a key added (delta 1) to or removed (-1) from partition i.
+static inline void part_count(int i, long delta) {
+    if (num_parts == 1) return;
+    __atomic_fetch_add(&parts[i].keys, delta, __ATOMIC_RELAXED);
+}
+
+// Operations on every partition hold map_lock between these two.
+static void map_hold(void) {
+    int err;
+    if (num_parts == 1) return;
+    if ((err = pthread_rwlock_rdlock(&map_lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_rdlock");
+    }
+}
+
+static void map_release(void) {
+    int err;
+    if (num_parts == 1) return;
+    if ((err = pthread_rwlock_unlock(&map_lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+}
+
+static node_t *search_key(const dbkey_t *key, node_t *parent, node_t **parentpp,
+                          enum locktype lt, int depth, int *depthp);
+
+static node_t *search_write(const dbkey_t *key, node_t **parentp,
+                            int keep_parent, int *depthp);
+static int remove_if(char *name, int (*pred)(node_t *, void *), void *arg);
+static int mark_tombstone(char *name);
+
+/*
+ * Memory accounting and eviction. The bytes allocated for nodes and their
+ * strings are counted in the tree statistics (see stats.h) by
+ * node_constructor(), node_destructor() and every place that swaps a node's
+ * strings. When mem_limit is nonzero, adds and updates that leave the count
+ * above it evict
+ * keys chosen by sampled LRU: each node carries a coarse last-access time,
+ * EVICT_SAMPLES nodes are sampled by random descents from the root and the
+ * least recently used of them is removed.
+ */
+#define EVICT_SAMPLES 5
+#define EVICT_ATTEMPTS 16
+
+static long mem_limit;
+static unsigned long evictions;
+
+static inline void mem_account(long delta) { stats_add_bytes(delta); }
+
+static inline long string_size(char *s) { return s != 0 ? strlen(s) + 1 : 0; }
+
+// Last-access clock for eviction, in units of 100ms.
+static inline unsigned int lru_clock(void) {
+    return (unsigned int)(ttl_now_ms() / 100);
+}
+
+/*
+ * Marks a node as recently used. Called with the node read-locked, so this
+ * is a relaxed atomic store, and it is skipped when the stamp is already
+ * current so that hot keys don't bounce the node's cache line between
+ * readers.
+ */
+static inline void node_touch(node_t *node) {
+    unsigned int now = lru_clock();
+    if (__atomic_load_n(&node->atime, __ATOMIC_RELAXED) != now) {
+        __atomic_store_n(&node->atime, now, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Records that node was found at the given depth. A node's recorded depth
+ * only goes stale by being too large, when a removal above it shortens its
+ * path, so it is lowered if depth is smaller. Readers may race on a node
+ * they all hold read-locked, hence the compare-and-swap.
+ */
+static inline void node_seen_at(node_t *node, int depth) {
+    int old = __atomic_load_n(&node->depth, __ATOMIC_RELAXED);
+    while (depth < old) {
+        if (__atomic_compare_exchange_n(&node->depth, &old, depth, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            stats_move_key(old, depth);
+            break;
+        }
+    }
+}
+
+/*
+ * Stores a copy of the len bytes of value in node, out of line in a blob if
+ * it is longer than BLOB_THRESHOLD. Returns 0 on success or -1 if the value is
+ * too long or cannot be allocated; the node is not changed on failure.
+ */
+static int value_init(node_t *node, char *value, size_t len) {
+    if (len > BLOB_MAXLEN) return -1;
+    if (len > BLOB_THRESHOLD) {
+        blob_t *blob = blob_create(value, len);
+        if (blob == 0) return -1;
+        node->blob = blob;
+        node->value = blob->data;
+    } else {
+        char *copy = malloc(len + 1);
+        if (copy == 0) return -1;
+        memcpy(copy, value, len + 1);
+        node->blob = 0;
+        node->value = copy;
+    }
+    return 0;
+}
+
+// Bytes allocated for the value of node.
+static inline long value_size(node_t *node) {
+    return node->blob != 0 ? blob_size(node->blob->len)
+                           : string_size(node->value);
+}
+
+// Frees the value of node, or drops its reference if it is a blob.
+static void value_release(node_t *node) {
+    if (node->blob != 0)
+        blob_put(node->blob);
+    else if (node->value != 0)
+        free(node->value);
+    node->value = 0;
+    node->blob = 0;
+}
 
 node_t *node_constructor(char *arg_name, char *arg_value, node_t *arg_left,
                          node_t *arg_right) {
     size_t name_len = strlen(arg_name);
     size_t val_len = strlen(arg_value);
 
-    if (name_len > MAXLEN || val_len > MAXLEN) return 0;
+    if (name_len > MAXLEN) return 0;
 
-    node_t *new_node = (node_t *)malloc(sizeof(node_t));
+    node_t *new_node = alloc_node();
 
     if (new_node == 0) return 0;
 
     if ((new_node->name = (char *)malloc(name_len + 1)) == 0) {
-        free(new_node);
+        release_node(new_node);
         return 0;
     }
 
-    if ((new_node->value = (char *)malloc(val_len + 1)) == 0) {
+    if (value_init(new_node, arg_value, val_len) != 0) {
         free(new_node->name);
-        free(new_node);
+        release_node(new_node);
         return 0;
     }
 
     if ((snprintf(new_node->name, MAXLEN, "%s", arg_name)) < 0) {
-        free(new_node->value);
+        value_release(new_node);
         free(new_node->name);
-        free(new_node);
-        return 0;
-    } else if ((snprintf(new_node->value, MAXLEN, "%s", arg_value)) < 0) {
-        free(new_node->value);
-        free(new_node->name);
-        free(new_node);
+        release_node(new_node);
         return 0;
     }
 
     new_node->lchild = arg_left;
     new_node->rchild = arg_right;
+    new_node->expires = 0;
+    new_node->atime = lru_clock();
+    new_node->depth = 0;
+    new_node->version = 0;
+    new_node->ikey = make_key(arg_name).ikey;
+    mem_account(sizeof(node_t) + name_len + 1 + value_size(new_node));
+    if (vindex_enabled()) vindex_add(new_node->value, new_node->name);
     return new_node;
 }
 
 void node_destructor(node_t *node) {
-    if (node->name != 0) free(node->name);
-    if (node->value != 0) free(node->value);
-    free(node);
+    mem_account(
+        -(long)(sizeof(node_t) + string_size(node->name) + value_size(node)));
+    if (node->name != 0) {
+        stats_remove_key(node->depth);
+        if (qcache_enabled()) qcache_invalidate(node->name);
+    }
+    if (vindex_enabled() && node->name != 0) {
+        vindex_remove(node->value, node->name);
+    }
+    // optimistic writers read keys and children but never values
+    value_release(node);
+    if (optimistic) {
+        ebr_retire(node, free_node);
+    } else {
+        free(node->name);
+        release_node(node);
+    }
+}
+
+/*
+ * Tombstone deletes. When enabled, db_remove() doesn't unlink the node but
+ * marks it deleted by setting its expiry time to TOMBSTONE, which is in the
+ * past for every reader, and schedules an immediate timer for it. The expiry
+ * thread (ttl.c) thus doubles as the compaction thread: it hands tombstoned
+ * keys to db_expire() in sorted batches, which unlinks them in one descent.
+ */
+#define TOMBSTONE 1LL
+
+static int tombstones;
+
+// Returns nonzero if node has a TTL that ran out at or before now.
+static inline int node_expired(node_t *node, long long now) {
+    return node->expires != 0 && node->expires <= now;
+}
+
+// Replaces the value of a write-locked node. Returns 0 on success or -1 if
+// the value is too long or cannot be allocated. Readers holding a reference
+// to the old value's blob keep it alive.
+static int set_value(node_t *node, char *value) {
+    char *old_value = node->value;
+    blob_t *old_blob = node->blob;
+    long old_size = value_size(node);
+
+    if (value_init(node, value, strlen(value)) != 0) return -1;
+    mem_account(value_size(node) - old_size);
+    if (qcache_enabled()) qcache_invalidate(node->name);
+    if (vindex_enabled()) {
+        vindex_remove(old_value, node->name);
+        vindex_add(node->value, node->name);
+    }
+    if (old_blob != 0)
+        blob_put(old_blob);
+    else
+        free(old_value);
+    return 0;
+}
+
+// Converts a ttl in milliseconds to an expiry time (0 means none).
+static long long expiry_time(long long ttl) {
+    return ttl > 0 ? ttl_now_ms() + ttl : 0;
 }
 
 void db_query(char *name, char *result, int len) {
-    // TODO: Make this thread-safe!
+    db_query_blob(name, result, len, 0);
+}
+
+void db_query_blob(char *name, char *result, int len, blob_t **blobp) {
+    node_t *root;
     node_t *target;
-    int rlerr;
-    if ((rlerr = pthread_rwlock_rdlock(&head.lock)) != 0) {
-        handle_error_en(rlerr, "pthread_rwlock_rdlock");
+    int depth;
+    dbkey_t key;
+    // hits in the query cache don't refresh the node's access time, so the
+    // cache is bypassed while eviction needs it
+    int cached = qcache_enabled() && mem_limit == 0;
+    unsigned long version = 0;
+    if (blobp != 0) *blobp = 0;
+    if (cached) {
+        slowlog_walk_begin();
+        if (qcache_get(name, result, len)) return;
+        version = qcache_version(name);
     }
-    target = search(name, &head, 0, l_read);
+    key = make_key(name);
+    root = lock_root(&key, l_read);
+    target = search_key(&key, root, 0, l_read, 0, &depth);
 
     if (target == 0) {
         snprintf(result, len, "not found");
         return;
     } else {
-        int ulock;
-        if ((ulock = pthread_rwlock_unlock(&target->lock)) != 0) {
-            handle_error_en(ulock, "pthread_rwlock_unlock");
+        if (target->expires != 0 && node_expired(target, ttl_now_ms())) {
+            snprintf(result, len, "not found");
+        } else {
+            if (blobp != 0 && target->blob != 0) {
+                // the reference keeps the value valid after the node is
+                // unlocked, even if it is updated or removed meanwhile
+                *blobp = blob_get(target->blob);
+                result[0] = '\0';
+            } else {
+                snprintf(result, len, "%s", target->value);
+                if (cached && target->blob == 0) {
+                    qcache_put(name, target->value, target->expires, version);
+                }
+            }
+            if (mem_limit != 0) node_touch(target);
         }
-        snprintf(result, len, "%s", target->value);
+        node_seen_at(target, depth);
+        unlock_node(target);
         return;
     }
 }
 
-int db_add(char *name, char *value) {
-    // TODO: Make this thread-safe!
+int db_add(char *name, char *value) { return db_add_ttl(name, value, 0); }
+
+// Logs a change for the replicas and tells the watchers of the key. Called
+// with the node locked, so that both see the changes to a key in order.
+static void log_set(const char *name, const char *value, long long expires) {
+    repl_log_set(name, value, expires);
+    watch_notify(name, 0);
+}
+
+static void log_del(const char *name) {
+    repl_log_del(name);
+    watch_notify(name, 1);
+}
+
+/*
+ * Adds a node for key, which is not in the database, as a child of parent,
+ * which must be write-locked at depth - 1 and stays locked. Returns 1 on
+ * success and 0 if memory runs out.
+ */
+static int link_new_node(node_t *parent, const dbkey_t *key, char *value,
+                         long long expires, int depth) {
+    node_t *newnode;
+    int init_err;
+
+    if ((newnode = node_constructor(key->name, value, 0, 0)) == 0) return (0);
+    if ((init_err = pthread_rwlock_init(&newnode->lock, 0)) != 0) {
+        handle_error_en(init_err, "pthread_rwlock_init");
+    }
+    newnode->expires = expires;
+    newnode->depth = depth;
+    stats_add_key(depth);
+    part_count(part_at(key), 1);
+
+    // the release store publishes the initialized node to optimistic
+    // writers, which read child pointers without locks
+    if (key_cmp(key, parent) < 0)
+        __atomic_store_n(&parent->lchild, newnode, __ATOMIC_RELEASE);
+    else
+        __atomic_store_n(&parent->rchild, newnode, __ATOMIC_RELEASE);
+
+    // mutations are logged while the node is still locked, so that the log
+    // orders the changes to each key the way they were applied
+    log_set(key->name, newnode->value, expires);
+    return (1);
+}
+
+int db_add_ttl(char *name, char *value, long long ttl) {
+    node_t *parent;
+    node_t *target;
+    int depth;
+    dbkey_t key = make_key(name);
+    long long expires = expiry_time(ttl);
+    if (!db_key_valid(name)) return (0);
+
+    if ((target = search_write(&key, &parent, 0, &depth)) != 0) {
+        node_seen_at(target, depth);
+        // a key that has expired but not been reaped yet is replaced
+        int replaced = target->expires != 0 &&
+                       node_expired(target, ttl_now_ms()) &&
+                       set_value(target, value) == 0;
+        if (replaced) {
+            target->expires = expires;
+            log_set(name, target->value, expires);
+        }
+        unlock_node(target);
+        if (replaced && expires != 0) ttl_schedule(name, expires);
+        return (replaced);
+    }
+
+    if (!link_new_node(parent, &key, value, expires, depth)) {
+        unlock_node(parent);
+        return (0);
+    }
+    unlock_node(parent);
+
+    if (expires != 0) ttl_schedule(name, expires);
+    if (mem_limit != 0) db_evict();
+    return (1);
+}
+
+int db_update(char *name, char *value, long long ttl) {
     node_t *parent;
     node_t *target;
-    node_t *newnode;
-    int wrerr;
-    if ((wrerr = pthread_rwlock_wrlock(&head.lock)) != 0) {
-        handle_error_en(wrerr, "pthread_rwlock_wrlock");
+    long long expires = expiry_time(ttl);
+    int updated = 0;
+    int depth;
+    dbkey_t key = make_key(name);
+
+    if ((target = search_write(&key, &parent, 0, &depth)) == 0) {
+        unlock_node(parent);
+        return (0);
     }
+    node_seen_at(target, depth);
 
-    if ((target = search(name, &head, &parent, l_write)) != 0) {
-        int tar_ulock;
-        if ((tar_ulock = pthread_rwlock_unlock(&target->lock)) != 0) {
-            handle_error_en(tar_ulock, "pthread_rwlock_unlock");
+    if (!node_expired(target, ttl_now_ms()) && set_value(target, value) == 0) {
+        target->expires = expires;
+        log_set(name, target->value, expires);
+        updated = 1;
+    }
+    unlock_node(target);
+
+    if (updated && expires != 0) ttl_schedule(name, expires);
+    if (updated && mem_limit != 0) db_evict();
+    return (updated);
+}
+
+/*
+ * Read-modify-write of the value of name, under a single write lock on its
+ * node. update() is passed the current value (NULL if the key is missing or
+ * has expired) and arg, and returns the new value, or NULL to leave the key
+ * as it is. A missing key is added with the new value, which doesn't expire;
+ * an existing one keeps its ttl. Returns 1 if the value was set and 0
+ * otherwise.
+ */
+static int modify(char *name, char *(*update)(char *, void *), void *arg) {
+    node_t *parent;
+    node_t *target;
+    char *value;
+    int written = 0;
+    int depth;
+    dbkey_t key = make_key(name);
+    if (!db_key_valid(name)) return (0);
+
+    if ((target = search_write(&key, &parent, 0, &depth)) == 0) {
+        // the parent stays locked, so nobody can add the key meanwhile
+        if ((value = update(0, arg)) != 0) {
+            written = link_new_node(parent, &key, value, 0, depth);
         }
-        int par_ulock;
-        if ((par_ulock = pthread_rwlock_unlock(&parent->lock)) != 0) {
-            handle_error_en(par_ulock, "pthread_rwlock_unlock");
+        unlock_node(parent);
+    } else {
+        int live = !node_expired(target, ttl_now_ms());
+        node_seen_at(target, depth);
+        if ((value = update(live ? target->value : 0, arg)) != 0 &&
+            set_value(target, value) == 0) {
+            if (!live) target->expires = 0;
+            log_set(name, target->value, target->expires);
+            written = 1;
         }
+        unlock_node(target);
+    }
+
+    if (written && mem_limit != 0) db_evict();
+    return (written);
+}
+
+struct cas_arg {
+    char *expected;
+    char *value;
+    int found;
+};
+
+static char *cas_update(char *old, void *arg) {
+    struct cas_arg *cas = (struct cas_arg *)arg;
+    cas->found = old != 0;
+    return old != 0 && strcmp(old, cas->expected) == 0 ? cas->value : 0;
+}
+
+int db_cas(char *name, char *expected, char *value) {
+    struct cas_arg cas = {expected, value, 0};
+    if (modify(name, cas_update, &cas)) return (1);
+    return (cas.found ? 0 : -1);
+}
+
+struct incr_arg {
+    long long delta;
+    long long result;
+    int overflow;
+    char buf[24];
+};
+
+static char *incr_update(char *old, void *arg) {
+    struct incr_arg *incr = (struct incr_arg *)arg;
+    long long n = 0;
+    char *end;
+
+    if (old != 0) {
+        errno = 0;
+        n = strtoll(old, &end, 10);
+        if (errno != 0 || end == old || *end != '\0') return (0);
+    }
+    if (__builtin_add_overflow(n, incr->delta, &incr->result)) {
+        incr->overflow = 1;
         return (0);
     }
+    snprintf(incr->buf, sizeof(incr->buf), "%lld", incr->result);
+    return (incr->buf);
+}
 
-    newnode = node_constructor(name, value, 0, 0);
-    int init_err;
-    if ((init_err = pthread_rwlock_init(&newnode->lock, 0)) != 0) {
-        handle_error_en(init_err, "pthread_rwlock_init");
+int db_incr(char *name, long long delta, long long *result) {
+    struct incr_arg incr = {delta, 0, 0, ""};
+    if (modify(name, incr_update, &incr)) {
+        *result = incr.result;
+        return (1);
+    }
+    return (incr.overflow ? -1 : 0);
+}
+
+struct append_arg {
+    char *suffix;
+    char *value;  // the concatenation, freed by db_append()
+};
+
+static char *append_update(char *old, void *arg) {
+    struct append_arg *app = (struct append_arg *)arg;
+    size_t old_len = old != 0 ? strlen(old) : 0;
+    size_t suffix_len = strlen(app->suffix);
+
+    if (old_len + suffix_len > BLOB_MAXLEN ||
+        (app->value = malloc(old_len + suffix_len + 1)) == 0) {
+        return (0);
+    }
+    if (old != 0) memcpy(app->value, old, old_len);
+    memcpy(app->value + old_len, app->suffix, suffix_len + 1);
+    return (app->value);
+}
+
+int db_append(char *name, char *suffix) {
+    struct append_arg app = {suffix, 0};
+    int written = modify(name, append_update, &app);
+    free(app.value);
+    return (written);
+}
+
+long long db_ttl(char *name) {
+    node_t *target;
+    long long ttl;
+    dbkey_t key = make_key(name);
+    node_t *root = lock_root(&key, l_read);
+
+    if ((target = search_key(&key, root, 0, l_read, 0, 0)) == 0) return -2;
+
+    if (target->expires == 0) {
+        ttl = -1;
+    } else {
+        ttl = target->expires - ttl_now_ms();
+        if (ttl <= 0) ttl = -2;
     }
+    unlock_node(target);
+    return ttl;
+}
+
+/*
+ * Unlinks dnode, which has at most one child, by pointing its parent at that
+ * child. Both must be write-locked. dnode is unlocked and freed; the parent
+ * stays locked.
+ */
+static void unlink_node(node_t *parent, node_t *dnode) {
+    node_t *child = dnode->lchild != 0 ? dnode->lchild : dnode->rchild;
 
-    if (strcmp(name, parent->name) < 0)
-        parent->lchild = newnode;
+    if (parent->lchild == dnode)
+        __atomic_store_n(&parent->lchild, child, __ATOMIC_RELEASE);
     else
-        parent->rchild = newnode;
+        __atomic_store_n(&parent->rchild, child, __ATOMIC_RELEASE);
+
+    unlock_node(dnode);
+    node_destructor(dnode);
+}
 
-    int uulock;
-    if ((uulock = pthread_rwlock_unlock(&parent->lock)) != 0) {
-        handle_error_en(uulock, "pthread_rwlock_unlock");
+/*
+ * Removes the key of dnode, which has two children and must be write-locked
+ * at the given depth, by moving the key and value of its in-order successor
+ * into it and freeing the successor's node. dnode stays locked.
+ */
+static void replace_with_successor(node_t *dnode, int depth) {
+    // Find the lexicographically smallest node in the right subtree and
+    // replace the node to be deleted with that node. This new node thus is
+    // lexicographically smaller than all nodes in its right subtree, and
+    // greater than all nodes in its left subtree. The successor's parent
+    // stays locked so that it can be unlinked.
+    node_t *prev = dnode;
+    node_t *next = dnode->rchild;
+    int dnode_depth = depth;
+
+    lock_node(next, l_write, ++depth);
+
+    while (next->lchild != 0) {
+        // work our way down the lchild chain, finding the smallest node
+        // in the subtree.
+        node_t *nextl = next->lchild;
+        lock_node(nextl, l_write, ++depth);
+        if (prev != dnode) unlock_node(prev);
+        prev = next;
+        next = nextl;
     }
 
-    return (1);
+    if (prev == dnode)
+        __atomic_store_n(&dnode->rchild, next->rchild, __ATOMIC_RELEASE);
+    else
+        __atomic_store_n(&prev->lchild, next->rchild, __ATOMIC_RELEASE);
+
+    mem_account(-(string_size(dnode->name) + value_size(dnode)));
+    stats_remove_key(dnode->depth);
+    stats_move_key(next->depth, dnode_depth);
+    if (qcache_enabled()) qcache_invalidate(dnode->name);
+    if (vindex_enabled()) vindex_remove(dnode->value, dnode->name);
+    free_name(dnode->name);
+    value_release(dnode);
+    __atomic_store_n(&dnode->name, next->name, __ATOMIC_RELEASE);
+    dnode->value = next->value;
+    dnode->blob = next->blob;
+    dnode->expires = next->expires;
+    dnode->atime = next->atime;
+    dnode->depth = dnode_depth;
+    __atomic_store_n(&dnode->ikey, next->ikey, __ATOMIC_RELAXED);
+    __atomic_store_n(&next->name, 0, __ATOMIC_RELEASE);
+    next->value = 0;
+    next->blob = 0;
+
+    if (prev != dnode) unlock_node(prev);
+    unlock_node(next);
+    node_destructor(next);
 }
 
 int db_remove(char *name) {
-    // TODO: Make this thread-safe!
+    if (__atomic_load_n(&tombstones, __ATOMIC_RELAXED)) {
+        return mark_tombstone(name);
+    }
+    return remove_if(name, 0, 0);
+}
+
+void db_set_optimistic(int enable) { optimistic = enable; }
+
+void db_set_arenas(int enable) {
+    if (enable) arena_enable(sizeof(node_t));
+}
+
+void db_set_tombstones(int enable) {
+    __atomic_store_n(&tombstones, enable, __ATOMIC_RELAXED);
+}
+
+/*
+ * Deletes name by turning its node into a tombstone. The path is only
+ * read-locked and the node itself is the only one locked for writing. The
+ * parent stays read-locked while the node's write lock is acquired, so the
+ * node can't be unlinked in between, but it can still take over the key of
+ * its successor (see replace_with_successor()), hence the name is checked
+ * again and the search restarted if it changed. Returns 1 if the key was
+ * deleted.
+ */
+static int mark_tombstone(char *name) {
     node_t *parent;
-    node_t *dnode;
-    node_t *next;
-    int wrerr;
-    if ((wrerr = pthread_rwlock_wrlock(&head.lock)) != 0) {
-        handle_error_en(wrerr, "pthread_rwlock_wrlock");
+    node_t *target;
+    int depth;
+    dbkey_t key = make_key(name);
+
+    while (1) {
+        node_t *root = lock_root(&key, l_read);
+        target = search_key(&key, root, &parent, l_read, 0, &depth);
+        if (target == 0) {
+            unlock_node(parent);
+            return (0);
+        }
+        unlock_node(target);
+        lock_node(target, l_write, depth);
+        unlock_node(parent);
+        if (strcmp(target->name, name) == 0) break;
+        unlock_node(target);
+    }
+
+    long long now = ttl_now_ms();
+    int deleted = !node_expired(target, now);
+    if (deleted) {
+        target->expires = TOMBSTONE;
+        if (qcache_enabled()) qcache_invalidate(name);
+        log_del(name);
     }
+    unlock_node(target);
+
+    if (deleted) ttl_schedule(name, now);
+    return (deleted);
+}
+
+/*
+ * Removes the node holding name if pred is 0 or returns nonzero for it (pred
+ * is called with the node write-locked). Returns 1 if a node was removed.
+ */
+static int remove_if(char *name, int (*pred)(node_t *, void *), void *arg) {
+    node_t *parent;
+    node_t *dnode;
+    int depth;
+    dbkey_t key = make_key(name);
 
     // first, find the node to be removed
-    if ((dnode = search(name, &head, &parent, l_write)) == 0) {
+    if ((dnode = search_write(&key, &parent, 1, &depth)) == 0) {
         // it's not there
-        int uulock;
-        if ((uulock = pthread_rwlock_unlock(&parent->lock)) != 0) {
-            handle_error_en(uulock, "pthread_rwlock_unlock");
-        }
-
+        unlock_node(parent);
         return (0);
     }
-    // pthread_rwlock_unlock(&dnode->lock);
-    // pthread_rwlock_unlock(&parent->lock);
-
-    // We found it, if the node has no
-    // right child, then we can merely replace its parent's pointer to
-    // it with the node's left child.
 
-    if (dnode->rchild == 0) {
-        if (dnode->lchild != 0) {
-            int wrerr;
-            if ((wrerr = pthread_rwlock_wrlock(&dnode->lchild->lock)) != 0) {
-                handle_error_en(wrerr, "pthread_rwlock_wrlock");
-            }
-        }
+    if (pred != 0 && !pred(dnode, arg)) {
+        unlock_node(dnode);
+        unlock_node(parent);
+        return (0);
+    }
+    log_del(name);
+    part_count(part_at(&key), -1);
+
+    // We found it. If the node has at most one child, then we can merely
+    // replace its parent's pointer to it with that child.
+    if (dnode->lchild == 0 || dnode->rchild == 0) {
+        unlink_node(parent, dnode);
+        unlock_node(parent);
+    } else {
+        unlock_node(parent);
+        replace_with_successor(dnode, depth);
+        unlock_node(dnode);
+    }
 
-        if (strcmp(dnode->name, parent->name) < 0)
-            parent->lchild = dnode->lchild;
-        else
-            parent->rchild = dnode->lchild;
+    return (1);
+}
 
-        int dunlock;
-        if ((dunlock = pthread_rwlock_unlock(&dnode->lock)) != 0) {
-            handle_error_en(dunlock, "pthread_rwlock_unlock");
-        }
+// Eviction predicate: the node has not been used since the sampled time.
+static int not_used_since(node_t *node, void *atime) {
+    return node->atime == *(unsigned int *)atime;
+}
 
-        if (dnode->lchild != 0) {
-            int ul2err;
-            if ((ul2err = pthread_rwlock_unlock(&dnode->lchild->lock)) != 0) {
-                handle_error_en(ul2err, "pthread_rwlock_unlock");
-            }
+/*
+ * Picks a node by descending from the root of a partition, chosen in
+ * proportion to its keys, along random branches, stopping at a leaf or, at
+ * each level, with probability 1/8. Copies its name into name and stores its
+ * last-access time in atime. Returns 0 if the tree is empty.
+ */
+static int sample_node(unsigned int *rng, char *name, unsigned int *atime) {
+    node_t *root = &parts[0].root;
+    node_t *node;
+    int depth = 0;
+
+    if (num_parts > 1) {
+        long total = 0, pick;
+        for (int i = 0; i < num_parts; i++) {
+            total += __atomic_load_n(&parts[i].keys, __ATOMIC_RELAXED);
         }
-        int ul3err;
-        if ((ul3err = pthread_rwlock_unlock(&parent->lock)) != 0) {
-            handle_error_en(ul3err, "pthread_rwlock_unlock");
-        }
-        // done with dnode
-        node_destructor(dnode);
-    } else if (dnode->lchild == 0) {
-        if (dnode->rchild != 0) {
-            int wr2err;
-            if ((wr2err = pthread_rwlock_wrlock(&dnode->rchild->lock)) != 0) {
-                handle_error_en(wr2err, "pthread_rwlock_wrlock");
+        *rng = *rng * 1103515245 + 12345;
+        pick = total > 0 ? (long)(*rng >> 8) % total : 0;
+        for (int i = 0; i < num_parts; i++) {
+            root = &parts[i].root;
+            if ((pick -= __atomic_load_n(&parts[i].keys, __ATOMIC_RELAXED)) <
+                0) {
+                break;
             }
         }
-
-        // ditto if the node had no left child
-        if (strcmp(dnode->name, parent->name) < 0)
-            parent->lchild = dnode->rchild;
+    }
+    node = root;
+    lock_node(node, l_read, 0);
+    while (1) {
+        node_t *next;
+        *rng = *rng * 1103515245 + 12345;
+        unsigned int r = *rng >> 16;
+        if (node->lchild == 0 || (node->rchild != 0 && (r & 1)))
+            next = node->rchild;
         else
-            parent->rchild = dnode->rchild;
-
-        int dun2lock;
-        if ((dun2lock = pthread_rwlock_unlock(&dnode->lock)) != 0) {
-            handle_error_en(dun2lock, "pthread_rwlock_unlock");
-        }
+            next = node->lchild;
+        if (next == 0 || (node != root && (r & 0xe) == 0)) break;
+        lock_node(next, l_read, ++depth);
+        unlock_node(node);
+        node = next;
+    }
 
-        if (dnode->rchild != 0) {
-            int ul4err;
-            if ((ul4err = pthread_rwlock_unlock(&dnode->rchild->lock)) != 0) {
-                handle_error_en(ul4err, "pthread_rwlock_unlock");
-            }
-        }
-        int ul5err;
-        if ((ul5err = pthread_rwlock_unlock(&parent->lock)) != 0) {
-            handle_error_en(ul5err, "pthread_rwlock_unlock");
-        }
-        // done with dnode
-        node_destructor(dnode);
-    } else {
-        // Find the lexicographically smallest node in the right subtree and
-        // replace the node to be deleted with that node. This new node thus is
-        // lexicographically smaller than all nodes in its right subtree, and
-        // greater than all nodes in its left subtree
-        int ul6err;
-        if ((ul6err = pthread_rwlock_unlock(&parent->lock)) != 0) {
-            handle_error_en(ul6err, "pthread_rwlock_unlock");
-        }
-
-        next = dnode->rchild;
-        node_t **pnext = &dnode->rchild;
-
-        int wr3err;
-        if ((wr3err = pthread_rwlock_wrlock(&next->lock)) != 0) {
-            handle_error_en(wr3err, "pthread_rwlock_wrlock");
-        }
-
-        while (next->lchild != 0) {
-            // work our way down the lchild chain, finding the smallest node
-            // in the subtree.h
-            node_t *nextl = next->lchild;
-            pnext = &next->lchild;
-            int wr4err;
-            if ((wr4err = pthread_rwlock_wrlock(&nextl->lock)) != 0) {
-                handle_error_en(wr4err, "pthread_rwlock_wrlock");
-            }
+    int found = node != root;
+    if (found) {
+        snprintf(name, MAXLEN + 1, "%s", node->name);
+        *atime = node->atime;
+    }
+    unlock_node(node);
+    return found;
+}
 
-            int ul7err;
-            if ((ul7err = pthread_rwlock_unlock(&next->lock)) != 0) {
-                handle_error_en(ul7err, "pthread_rwlock_unlock");
+int db_evict(void) {
+    static __thread unsigned int rng;
+    char name[MAXLEN + 1], victim[MAXLEN + 1];
+    unsigned int atime, victim_atime = 0;
+    int removed = 0;
+
+    if (rng == 0) rng = (unsigned int)(unsigned long)&rng ^ lru_clock();
+
+    for (int attempt = 0;
+         attempt < EVICT_ATTEMPTS &&
+         stats_bytes() > __atomic_load_n(&mem_limit, __ATOMIC_RELAXED);
+         attempt++) {
+        int have_victim = 0;
+        for (int i = 0; i < EVICT_SAMPLES; i++) {
+            if (!sample_node(&rng, name, &atime)) return removed;
+            // compare ages rather than stamps so that wraparound is harmless
+            if (!have_victim || (int)(atime - victim_atime) < 0) {
+                memcpy(victim, name, sizeof(victim));
+                victim_atime = atime;
+                have_victim = 1;
             }
-            next = nextl;
         }
-
-        dnode->name = realloc(dnode->name, strlen(next->name) + 1);
-        dnode->value = realloc(dnode->value, strlen(next->value) + 1);
-
-        snprintf(dnode->name, MAXLEN, "%s", next->name);
-        snprintf(dnode->value, MAXLEN, "%s", next->value);
-        *pnext = next->rchild;
-
-        int ul8err;
-        if ((ul8err = pthread_rwlock_unlock(&next->lock)) != 0) {
-            handle_error_en(ul8err, "pthread_rwlock_unlock");
-        }
-
-        int ul9err;
-        if ((ul9err = pthread_rwlock_unlock(&dnode->lock)) != 0) {
-            handle_error_en(ul9err, "pthread_rwlock_unlock");
+        // skip the victim if it was used after it was sampled
+        if (remove_if(victim, not_used_since, &victim_atime)) {
+            __atomic_fetch_add(&evictions, 1, __ATOMIC_RELAXED);
+            removed++;
         }
-
-        node_destructor(next);
     }
+    return removed;
+}
 
-    return (1);
+void db_set_memory_limit(long bytes) {
+    __atomic_store_n(&mem_limit, bytes, __ATOMIC_RELAXED);
+    if (bytes != 0) db_evict();
+}
+
+void db_memory_stats(long *used, long *limit, unsigned long *evicted) {
+    *used = stats_bytes();
+    *limit = __atomic_load_n(&mem_limit, __ATOMIC_RELAXED);
+    *evicted = __atomic_load_n(&evictions, __ATOMIC_RELAXED);
 }
 
 node_t *search(char *name, node_t *parent, node_t **parentpp,
                enum locktype lt) {
+    return search_depth(name, parent, parentpp, lt, 0, 0);
+}
+
+static node_t *search_depth(char *name, node_t *parent, node_t **parentpp,
+                            enum locktype lt, int depth, int *depthp) {
+    dbkey_t key = make_key(name);
+    return search_key(&key, parent, parentpp, lt, depth, depthp);
+}
+
+static node_t *search_key(const dbkey_t *key, node_t *parent, node_t **parentpp,
+                          enum locktype lt, int depth, int *depthp) {
     // Search the tree, starting at parent, for a node containing
-    // name (the "target node").  Return a pointer to the node,
+    // key (the "target node").  Return a pointer to the node,
     // if found, otherwise return 0.  If parentpp is not 0, then it points
     // to a location at which the address of the parent of the target node
     // is stored.  If the target node is not found, the location pointed to
     // by parentpp is set to what would be the the address of the parent of
-    // the target node, if it were there.
+    // the target node, if it were there. depth is the depth of parent; if
+    // depthp is not 0 the depth of the target node is stored there.
     //
-    // TODO: Make this thread-safe!
+    // The parent must be locked on entry; the target (and the parent, if
+    // parentpp is not 0) are returned locked in the requested mode.
 
     node_t *next;
     node_t *result;
 
-    if (strcmp(name, parent->name) < 0) {
+    if (key_cmp(key, parent) < 0) {
         next = parent->lchild;
     } else {
         next = parent->rchild;
@@ -292,81 +1178,765 @@ node_t *search(char *name, node_t *parent, node_t **parentpp,
     if (next == NULL) {
         result = NULL;
     } else {
-        if (lt == l_read) {
-            int rd2err;
-            if ((rd2err = pthread_rwlock_rdlock(&next->lock)) != 0) {
-                handle_error_en(rd2err, "pthread_rwlock_rdlock");
-            }
-        } else {
-            int wrerr;
-            if ((wrerr = pthread_rwlock_wrlock(&next->lock)) != 0) {
-                handle_error_en(wrerr, "pthread_rwlock_wrlock");
-            }
-        }
-        if (strcmp(name, next->name) == 0) {
+        lock_node(next, lt, depth + 1);
+        if (key_cmp(key, next) == 0) {
             result = next;
         } else {
-            int ulerr;
-            if ((ulerr = pthread_rwlock_unlock(&parent->lock)) != 0) {
-                handle_error_en(ulerr, "pthread_rwlock_unlock");
-            }
-            return search(name, next, parentpp, lt);
+            unlock_node(parent);
+            return search_key(key, next, parentpp, lt, depth + 1, depthp);
         }
     }
 
+    if (depthp != NULL) {
+        *depthp = depth + 1;
+    }
     if (parentpp != NULL) {
         *parentpp = parent;
     } else {
-        int ul2err;
-        if ((ul2err = pthread_rwlock_unlock(&parent->lock)) != 0) {
-            handle_error_en(ul2err, "pthread_rwlock_unlock");
-        }
+        unlock_node(parent);
     }
 
     return result;
 }
 
-static inline void print_spaces(int lvl, FILE *out) {
-    for (int i = 0; i < lvl; i++) {
-        fprintf(out, " ");
+// optimistic_search() result that means starting over
+#define RESTART (&parts[0].root)
+
+/*
+ * key_cmp() for a node read without a lock. Returns 0 if the node has no
+ * name, which happens when it has just handed its key to the node it
+ * replaced (see replace_with_successor()) and means starting over.
+ */
+static inline int optimistic_cmp(const dbkey_t *key, node_t *node, int *c) {
+    char *name;
+
+    if (int_keys) {
+        long long ikey = __atomic_load_n(&node->ikey, __ATOMIC_RELAXED);
+        *c = (key->ikey > ikey) - (key->ikey < ikey);
+        return 1;
     }
+    if ((name = __atomic_load_n(&node->name, __ATOMIC_ACQUIRE)) == 0) return 0;
+    *c = strcmp(key->name, name);
+    return 1;
 }
 
-/* helper function for db_print */
-void db_print_recurs(node_t *node, int lvl, FILE *out) {
-    // TODO: Make this thread-safe!
-    // print spaces to differentiate levels
+/*
+ * One optimistic descent for search_write(), in an ebr_enter() section.
+ * Returns RESTART if a version it read, or the partition boundaries, have
+ * moved.
+ */
+static node_t *optimistic_search(const dbkey_t *key, node_t **parentp,
+                                 int keep_parent, int *depthp) {
+    bounds_t *b = bounds_get();
+    int part = part_of(b, key);
+    unsigned long seq = part_read_begin(part);
+    node_t *parent = 0, *node = &parts[part].root, *next;
+    unsigned long pv = 0, v, nv;
+    int depth = 0;
+    int c = 1;  // every key goes right of the root
+
+    // keys may have moved out of the partition since b was read
+    if (bounds_get() != b) return RESTART;
+    v = read_begin(node);
+    while (1) {
+        next = c < 0 ? __atomic_load_n(&node->lchild, __ATOMIC_ACQUIRE)
+                     : __atomic_load_n(&node->rchild, __ATOMIC_ACQUIRE);
+        if (!read_valid(node, v)) return RESTART;
+        if (next == 0) {
+            // the key is missing and belongs under node
+            if (!lock_valid(node, v, depth)) return RESTART;
+            if (!part_read_valid(part, seq)) {
+                unlock_node(node);
+                return RESTART;
+            }
+            *parentp = node;
+            *depthp = depth + 1;
+            return 0;
+        }
+        nv = read_begin(next);
+        // next may have been unlinked before its version was read
+        if (!read_valid(node, v)) return RESTART;
+        parent = node;
+        pv = v;
+        node = next;
+        v = nv;
+        depth++;
+        // a key read while it is being replaced is caught by lock_valid()
+        if (!optimistic_cmp(key, node, &c)) return RESTART;
+        if (c == 0) break;
+    }
+    if (keep_parent && !lock_valid(parent, pv, depth - 1)) return RESTART;
+    if (!lock_valid(node, v, depth)) {
+        if (keep_parent) unlock_node(parent);
+        return RESTART;
+    }
+    // the key may have moved to another partition before the nodes were
+    // locked, though not since
+    if (!part_read_valid(part, seq)) {
+        unlock_node(node);
+        if (keep_parent) unlock_node(parent);
+        return RESTART;
+    }
+    *parentp = parent;
+    *depthp = depth;
+    return node;
+}
+
+/*
+ * Finds key for a writer. Returns its node, write-locked, or 0 if it is not
+ * in the tree. *parentp is set to the parent of the node, or to the node the
+ * key would be added under, which is write-locked too if the key is missing
+ * or keep_parent is set; *depthp is set to the depth of the key. Locks are
+ * taken hand over hand from the root of the key's partition unless writers
+ * are optimistic.
+ */
+static node_t *search_write(const dbkey_t *key, node_t **parentp,
+                            int keep_parent, int *depthp) {
+    node_t *node;
+
+    if (!optimistic) {
+        node_t *root = lock_root(key, l_write);
+        node = search_key(key, root, parentp, l_write, 0, depthp);
+        if (node != 0 && !keep_parent) unlock_node(*parentp);
+        return node;
+    }
+    // the nodes returned are locked, so they can't be freed after
+    // ebr_exit(); only those merely passed could
+    slowlog_walk_begin();
+    ebr_enter();
+    while ((node = optimistic_search(key, parentp, keep_parent, depthp)) ==
+           RESTART) {
+    }
+    ebr_exit();
+    return node;
+}
+
+/*
+ * Rebalancing. The rebalancer thread (see db_rebalance_start()) moves one
+ * boundary at a time, between a pair of neighbouring partitions, to where
+ * evenly spread keys would put it, and keeps going while not all the
+ * partitions are in use or one holds more than PART_SKEW times its share of
+ * the keys, once there are PART_MIN_KEYS keys per partition. A move takes
+ * time linear in the keys of the pair, during which only operations on those
+ * two partitions wait. Once the keys are spread evenly it looks at the counts
+ * again every PART_IDLE_MS.
+ */
+#define PART_SKEW 2
+#define PART_MIN_KEYS 64
+#define PART_IDLE_MS 100
+
+typedef struct node_list {
+    node_t **nodes;
+    int *depths;
+    long n;
+    long cap;
+} node_list_t;
+
+// Appends node to list. Returns 0 on success and -1 if memory runs out.
+static int list_push(node_list_t *list, node_t *node, int depth) {
+    if (list->n == list->cap) {
+        long cap = list->cap ? 2 * list->cap : 1024;
+        node_t **nodes = realloc(list->nodes, cap * sizeof(node_t *));
+        if (nodes == 0) return -1;
+        list->nodes = nodes;
+        int *depths = realloc(list->depths, cap * sizeof(int));
+        if (depths == 0) return -1;
+        list->depths = depths;
+        list->cap = cap;
+    }
+    list->nodes[list->n] = node;
+    list->depths[list->n++] = depth;
+    return 0;
+}
+
+/*
+ * Write-locks the subtree rooted at node, whose parent is write-locked at
+ * depth - 1, and appends its nodes to list in order. The locks are kept.
+ * The subtree may be a long chain, so this keeps its own stack rather than
+ * recursing. Returns 0 on success and -1 if memory runs out, in which case
+ * the nodes still locked are those in list and stack.
+ */
+static int lock_subtree(node_t *node, int depth, node_list_t *list,
+                        node_list_t *stack) {
+    while (node != 0 || stack->n > 0) {
+        for (; node != 0; node = node->lchild) {
+            lock_node(node, l_write, depth);
+            if (list_push(stack, node, depth++) != 0) {
+                unlock_node(node);
+                return -1;
+            }
+        }
+        stack->n--;
+        node = stack->nodes[stack->n];
+        depth = stack->depths[stack->n] + 1;
+        if (list_push(list, node, 0) != 0) {
+            unlock_node(node);
+            return -1;
+        }
+        node = node->rchild;
+    }
+    return 0;
+}
+
+// Links the n sorted nodes into a balanced tree whose root is at the given
+// depth and returns its root.
+static node_t *build_balanced(node_t **nodes, long n, int depth) {
+    node_t *node;
+    long mid = n / 2;
+
+    if (n == 0) return 0;
+    node = nodes[mid];
+    __atomic_store_n(&node->lchild, build_balanced(nodes, mid, depth + 1),
+                     __ATOMIC_RELEASE);
+    __atomic_store_n(&node->rchild,
+                     build_balanced(nodes + mid + 1, n - mid - 1, depth + 1),
+                     __ATOMIC_RELEASE);
+    if (node->depth != depth) {
+        stats_move_key(node->depth, depth);
+        node->depth = depth;
+    }
+    return node;
+}
+
+// Makes partition i's tree the n sorted nodes, balanced. Its root must be
+// write-locked.
+static void rebuild_partition(int i, node_t **nodes, long n) {
+    __atomic_store_n(&parts[i].root.lchild, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&parts[i].root.rchild, build_balanced(nodes, n, 1),
+                     __ATOMIC_RELEASE);
+    __atomic_store_n(&parts[i].keys, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Moves boundary k, the lowest key of partition k, so that partition k - 1
+ * keeps its first left keys and the rest of the pair's go to partition k,
+ * and rebuilds both trees balanced. Partition k may be one not used yet.
+ * Both roots and then every node below them are write-locked top-down,
+ * which waits for the operations in the two trees to leave them, while new
+ * ones wait at the roots or, if optimistic, for the partitions' seq to be
+ * even again; optimistic writers that read a node before it was locked find
+ * its version moved. Must be called with map_lock write-locked. Returns 0 if
+ * the boundary moved and -1 if it was left as it was, as when memory runs
+ * out.
+ */
+static int move_boundary(int k, long left) {
+    node_list_t list = {0, 0, 0, 0}, stack = {0, 0, 0, 0};
+    bounds_t *old = bounds, *b = 0;
+    int moved = 0;
+
+    __atomic_store_n(&parts[k - 1].seq, parts[k - 1].seq + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&parts[k].seq, parts[k].seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    lock_node(&parts[k - 1].root, l_write, 0);
+    lock_node(&parts[k].root, l_write, 0);
+    if (lock_subtree(parts[k - 1].root.lchild, 1, &list, &stack) == 0 &&
+        lock_subtree(parts[k - 1].root.rchild, 1, &list, &stack) == 0 &&
+        lock_subtree(parts[k].root.lchild, 1, &list, &stack) == 0 &&
+        lock_subtree(parts[k].root.rchild, 1, &list, &stack) == 0 &&
+        list.n > 0 && (b = malloc(sizeof(bounds_t))) != 0) {
+        // partition k must keep a key to take its boundary from
+        if (left > list.n - 1) left = list.n - 1;
+        *b = *old;
+        snprintf(b->names[k], MAXLEN + 1, "%s", list.nodes[left]->name);
+        b->ikeys[k] = list.nodes[left]->ikey;
+        if (b->used == k) b->used = k + 1;
+        rebuild_partition(k - 1, list.nodes, left);
+        rebuild_partition(k, list.nodes + left, list.n - left);
+        __atomic_store_n(&bounds, b, __ATOMIC_RELEASE);
+        moved = 1;
+    }
+
+    for (long i = 0; i < list.n; i++) unlock_node(list.nodes[i]);
+    for (long i = 0; i < stack.n; i++) unlock_node(stack.nodes[i]);
+    __atomic_store_n(&parts[k - 1].seq, parts[k - 1].seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&parts[k].seq, parts[k].seq + 1, __ATOMIC_RELEASE);
+    unlock_node(&parts[k].root);
+    unlock_node(&parts[k - 1].root);
+    free(list.nodes);
+    free(list.depths);
+    free(stack.nodes);
+    free(stack.depths);
+    if (moved && old != &first_bounds) ebr_retire(old, free);
+    return moved ? 0 : -1;
+}
+
+/*
+ * Moves the boundary that is furthest from where it should be. Returns 1 if
+ * a boundary moved and 0 if none needs to, or if memory ran out or an
+ * operation on every partition holds map_lock.
+ */
+static int rebalance_step(void) {
+    // below[k] is the number of keys below boundary k
+    long below[DB_MAX_PARTITIONS + 1] = {0}, share, most = 0, dist = 0;
+    long target = 0;
+    int used, k = 0, moved = 0;
+
+    if (num_parts == 1 || pthread_rwlock_trywrlock(&map_lock) != 0) return 0;
+    used = bounds->used;
+    for (int i = 0; i < num_parts; i++) {
+        long keys = __atomic_load_n(&parts[i].keys, __ATOMIC_RELAXED);
+        if (keys > most) most = keys;
+        below[i + 1] = below[i] + keys;
+    }
+    share = below[num_parts] / num_parts;
+    if (share >= PART_MIN_KEYS &&
+        (used < num_parts || most > PART_SKEW * share)) {
+        // picks the boundary that would move furthest, which only moves
+        // between those of its neighbours
+        for (int i = 1; i <= used && i < num_parts; i++) {
+            long t = share * i;
+            if (t < below[i - 1]) t = below[i - 1];
+            if (t > below[i + 1]) t = below[i + 1];
+            if (labs(t - below[i]) > dist) {
+                dist = labs(t - below[i]);
+                target = t;
+                k = i;
+            }
+        }
+        // a partition with more than PART_SKEW shares has a boundary at
+        // least half a share from where it should be
+        if (k > 0 && dist > share / 2) {
+            moved = move_boundary(k, target - below[k - 1]) == 0;
+        }
+    }
+    pthread_rwlock_unlock(&map_lock);
+    return moved;
+}
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int running;
+    pthread_t thread;
+} rebalancer = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void *run_rebalancer(void *arg) {
+    struct timespec next;
+    int err;
+
+    if ((err = pthread_mutex_lock(&rebalancer.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    while (rebalancer.running) {
+        if ((err = pthread_mutex_unlock(&rebalancer.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        // the locks are released between moves, so operations on the pair
+        // just moved get in before the next one
+        while (__atomic_load_n(&rebalancer.running, __ATOMIC_RELAXED) &&
+               rebalance_step()) {
+            sched_yield();
+        }
+        if ((err = pthread_mutex_lock(&rebalancer.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        if (!rebalancer.running) break;
+        clock_gettime(CLOCK_REALTIME, &next);
+        next.tv_nsec += PART_IDLE_MS * 1000000L;
+        next.tv_sec += next.tv_nsec / 1000000000L;
+        next.tv_nsec %= 1000000000L;
+        err =
+            pthread_cond_timedwait(&rebalancer.cond, &rebalancer.mutex, &next);
+        if (err != 0 && err != ETIMEDOUT) {
+            handle_error_en(err, "pthread_cond_timedwait");
+        }
+    }
+    if ((err = pthread_mutex_unlock(&rebalancer.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return 0;
+}
+
+void db_rebalance_start(void) {
+    int err;
+
+    if (num_parts == 1) return;
+    if ((err = pthread_mutex_lock(&rebalancer.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    if (!rebalancer.running) {
+        __atomic_store_n(&rebalancer.running, 1, __ATOMIC_RELAXED);
+        if ((err = pthread_create(&rebalancer.thread, 0, run_rebalancer, 0)) !=
+            0) {
+            handle_error_en(err, "pthread_create");
+        }
+    }
+    if ((err = pthread_mutex_unlock(&rebalancer.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+void db_rebalance_stop(void) {
+    int running, err;
+
+    if ((err = pthread_mutex_lock(&rebalancer.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    running = rebalancer.running;
+    __atomic_store_n(&rebalancer.running, 0, __ATOMIC_RELAXED);
+    if ((err = pthread_cond_signal(&rebalancer.cond)) != 0) {
+        handle_error_en(err, "pthread_cond_signal");
+    }
+    if ((err = pthread_mutex_unlock(&rebalancer.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    if (running && (err = pthread_join(rebalancer.thread, 0)) != 0) {
+        handle_error_en(err, "pthread_join");
+    }
+}
+
+static int cmp_names(const void *a, const void *b) {
+    return name_cmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Returns the index of the first of the n sorted names that is not less than
+// (or, if after is set, greater than) name.
+static int bound_names(char **names, int n, char *name, int after) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = name_cmp(names[mid], name);
+        if (c < 0 || (after && c == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Locks the child of the write-locked parent in *slot on behalf of the *n
+ * sorted names, all of which belong in that subtree. As long as the child is
+ * one of the names and has expired it is removed, its watchers are told, and
+ * whatever took its place is examined instead. Names that have been dealt with
+ * are dropped from the array and *n is updated. Returns the child,
+ * write-locked, if names remain for its subtree, otherwise 0.
+ */
+static node_t *settle_child(node_t **slot, node_t *parent, char **names, int *n,
+                            int depth, long long now, int *removed) {
+    while (*n > 0 && *slot != 0) {
+        node_t *child = *slot;
+        lock_node(child, l_write, depth);
+
+        int i = bound_names(names, *n, child->name, 0);
+        if (i == *n || strcmp(names[i], child->name) != 0) return child;
+        char *name = names[i];
+        memmove(&names[i], &names[i + 1], (*n - i - 1) * sizeof(char *));
+        (*n)--;
+
+        if (!node_expired(child, now)) {
+            if (*n > 0) return child;
+            unlock_node(child);
+            return 0;
+        }
+
+        // the watchers of a tombstone were told when it was marked
+        if (child->expires != TOMBSTONE) watch_notify(name, 1);
+        if (child->lchild == 0 || child->rchild == 0) {
+            unlink_node(parent, child);
+        } else {
+            replace_with_successor(child, depth);
+            unlock_node(child);
+        }
+        (*removed)++;
+    }
+    return 0;
+}
+
+/*
+ * Expires the n sorted names below node, which is write-locked at the given
+ * depth and unlocked before returning. Both children are settled while node
+ * is held, since removing a child changes node's pointers; node is then
+ * released before descending, so locks are still only taken top-down.
+ */
+static void expire_recurs(node_t *node, int depth, char **names, int n,
+                          long long now, int *removed) {
+    int nleft = bound_names(names, n, node->name, 0);
+    int first_right = bound_names(names, n, node->name, 1);
+    int nright = n - first_right;
+    char **right = names + first_right;
+
+    node_t *l = nleft > 0 ? settle_child(&node->lchild, node, names, &nleft,
+                                         depth + 1, now, removed)
+                          : 0;
+    node_t *r = nright > 0 ? settle_child(&node->rchild, node, right, &nright,
+                                          depth + 1, now, removed)
+                           : 0;
+    unlock_node(node);
+
+    if (l != 0) expire_recurs(l, depth + 1, names, nleft, now, removed);
+    if (r != 0) expire_recurs(r, depth + 1, right, nright, now, removed);
+}
+
+int db_expire(char **names, int n) {
+    long long now = ttl_now_ms();
+    int removed = 0;
+    int i, j, end;
+
+    if (n <= 0) return 0;
+    qsort(names, n, sizeof(char *), cmp_names);
+    for (i = 1, j = 1; i < n; i++) {
+        if (strcmp(names[i], names[j - 1]) != 0) names[j++] = names[i];
+    }
+
+    map_hold();
+    bounds_t *b = bounds_get();
+    // the names of each partition follow one another
+    for (i = 0; i < j; i = end) {
+        dbkey_t key = make_key(names[i]);
+        int part = part_of(b, &key);
+        int before = removed;
+        end = part + 1 < b->used
+                  ? i + bound_names(names + i, j - i, b->names[part + 1], 0)
+                  : j;
+        lock_node(&parts[part].root, l_write, 0);
+        expire_recurs(&parts[part].root, 0, names + i, end - i, now, &removed);
+        part_count(part, before - removed);
+    }
+    map_release();
+    return removed;
+}
+
+int db_put(char *name, char *value, long long ttl) {
+    // db_update() fails if the key is missing and db_add_ttl() if it is
+    // present; a writer racing in between is caught by the retry
+    for (int i = 0; i < 3; i++) {
+        if (db_update(name, value, ttl) || db_add_ttl(name, value, ttl)) {
+            return (1);
+        }
+    }
+    return (0);
+}
+
+/*
+ * In-order traversal of the subtree rooted at node, which is read-locked at
+ * the given depth and unlocked before returning. Live keys not less than
+ * start are passed to visit until *count drops to 0 (a negative count never
+ * does). As in db_print_recurs(), the locks on the path to the current node
+ * are held throughout.
+ */
+static void scan_recurs(node_t *node, int depth, const dbkey_t *start,
+                        int *count, long long now,
+                        void (*visit)(node_t *, void *), void *arg) {
+    node_t *child;
+
+    if (*count != 0 && key_cmp(start, node) < 0 &&
+        (child = node->lchild) != 0) {
+        lock_node(child, l_read, depth + 1);
+        scan_recurs(child, depth + 1, start, count, now, visit, arg);
+    }
+    if (*count != 0 && !is_root(node) && key_cmp(start, node) <= 0 &&
+        !node_expired(node, now)) {
+        visit(node, arg);
+        if (*count > 0) (*count)--;
+    }
+    if (*count != 0 && (child = node->rchild) != 0) {
+        lock_node(child, l_read, depth + 1);
+        scan_recurs(child, depth + 1, start, count, now, visit, arg);
+    }
+    unlock_node(node);
+}
+
+int db_scan(char *start, int count, void (*visit)(node_t *, void *),
+            void *arg) {
+    int left = count;
+    dbkey_t key = make_key(start);
+    long long now = ttl_now_ms();
+
+    if (count == 0) return 0;
+    map_hold();
+    bounds_t *b = bounds_get();
+    for (int i = part_of(b, &key); i < b->used && left != 0; i++) {
+        lock_node(&parts[i].root, l_read, 0);
+        scan_recurs(&parts[i].root, 0, &key, &left, now, visit, arg);
+    }
+    map_release();
+    return count - left;
+}
+
+// Pre-order counterpart of scan_recurs() for db_walk().
+static void walk_recurs(node_t *node, int depth, long long now,
+                        void (*visit)(node_t *, void *), void *arg) {
+    if (!is_root(node) && !node_expired(node, now)) visit(node, arg);
+    if (node->lchild != 0) {
+        lock_node(node->lchild, l_read, depth + 1);
+        walk_recurs(node->lchild, depth + 1, now, visit, arg);
+    }
+    if (node->rchild != 0) {
+        lock_node(node->rchild, l_read, depth + 1);
+        walk_recurs(node->rchild, depth + 1, now, visit, arg);
+    }
+    unlock_node(node);
+}
+
+void db_walk(void (*visit)(node_t *, void *), void *arg) {
+    long long now = ttl_now_ms();
+
+    map_hold();
+    for (int i = 0; i < bounds_get()->used; i++) {
+        lock_node(&parts[i].root, l_read, 0);
+        walk_recurs(&parts[i].root, 0, now, visit, arg);
+    }
+    map_release();
+}
+
+/*
+ * Frees the detached subtree rooted at node, which is write-locked. Other
+ * threads may still be inside the subtree, but since locks are only taken
+ * top-down, holding a node's lock and then its children's means nobody is
+ * left in the node or can get to it, so it can be freed.
+ */
+static void clear_recurs(node_t *node, int depth) {
+    node_t *l = node->lchild;
+    node_t *r = node->rchild;
+
+    if (l != 0) lock_node(l, l_write, depth + 1);
+    if (r != 0) lock_node(r, l_write, depth + 1);
+    unlock_node(node);
+    node_destructor(node);
+    if (l != 0) clear_recurs(l, depth + 1);
+    if (r != 0) clear_recurs(r, depth + 1);
+}
+
+void db_clear(void) {
+    node_t *l, *r;
+
+    map_hold();
+    for (int i = 0; i < bounds_get()->used; i++) {
+        node_t *root = &parts[i].root;
+        lock_node(root, l_write, 0);
+        l = root->lchild;
+        r = root->rchild;
+        __atomic_store_n(&root->lchild, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&root->rchild, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&parts[i].keys, 0, __ATOMIC_RELAXED);
+        if (l != 0) lock_node(l, l_write, 1);
+        if (r != 0) lock_node(r, l_write, 1);
+        unlock_node(root);
+
+        if (l != 0) clear_recurs(l, 1);
+        if (r != 0) clear_recurs(r, 1);
+    }
+    map_release();
+}
+
+// Returns nonzero if name is a live key holding value.
+static int has_value(char *name, char *value, long long now) {
+    node_t *target;
+    int found;
+    dbkey_t key = make_key(name);
+    node_t *root = lock_root(&key, l_read);
+
+    if ((target = search_key(&key, root, 0, l_read, 0, 0)) == 0) return 0;
+    found = !node_expired(target, now) && strcmp(target->value, value) == 0;
+    unlock_node(target);
+    return found;
+}
+
+int db_find_value(char *value, char ***names) {
+    long long now = ttl_now_ms();
+    int n, i, j;
+
+    if (!vindex_enabled() || (n = vindex_lookup(value, names)) < 0) return -1;
+    // the index also holds keys that have expired, and a key may have been
+    // changed since it was looked up, so check each one in the tree
+    for (i = 0, j = 0; i < n; i++) {
+        if (has_value((*names)[i], value, now)) {
+            (*names)[j++] = (*names)[i];
+        } else {
+            free((*names)[i]);
+        }
+    }
+    qsort(*names, j, sizeof(char *), cmp_names);
+    return j;
+}
+
+/*
+ * The printing functions below write a few pieces per node, so they use the
+ * unlocked stdio functions: out must be locked by the caller (flockfile())
+ * or only used by the calling thread.
+ */
+static inline void print_spaces(int lvl, FILE *out) {
+    static const char spaces[64] =
+        "                                                                ";
+    for (; lvl > 64; lvl -= 64) fwrite_unlocked(spaces, 1, 64, out);
+    fwrite_unlocked(spaces, 1, lvl, out);
+}
+
+// Writes "key value\n", without fprintf()'s parsing of a format per node.
+static inline void print_pair_line(node_t *node, FILE *out) {
+    fputs_unlocked(node->name, out);
+    putc_unlocked(' ', out);
+    fputs_unlocked(node->value, out);
+    putc_unlocked('\n', out);
+}
+
+/* helper function for db_print, see above for out */
+void db_print_recurs(node_t *node, int lvl, FILE *out) {
+    // print spaces to differentiate levels
     print_spaces(lvl, out);
 
     // print out the current node
     if (node == NULL) {
-        fprintf(out, "(null)\n");
+        fputs_unlocked("(null)\n", out);
         return;
     }
-    int rl_err;
-    if ((rl_err = pthread_rwlock_rdlock(&node->lock)) != 0) {
-        handle_error_en(rl_err, "pthread_rwlock_rdlock");
-    }
+    lock_node(node, l_read, lvl);
 
-    if (node == &head) {
-        fprintf(out, "(root)\n");
+    if (is_root(node)) {
+        fputs_unlocked("(root)\n", out);
     } else {
-        fprintf(out, "%s %s\n", node->name, node->value);
+        print_pair_line(node, out);
     }
 
     db_print_recurs(node->lchild, lvl + 1, out);
     db_print_recurs(node->rchild, lvl + 1, out);
 
-    int ul_err;
-    if ((ul_err = pthread_rwlock_unlock(&node->lock)) != 0) {
-        handle_error_en(ul_err, "pthread_rwlock_unlock");
+    unlock_node(node);
+}
+
+/*
+ * db_print_recurs() that nests the trees of partitions next up to used in
+ * place of the subtree's last (null), which is the right child of its
+ * largest key. Since every key of those partitions is larger, the partitions
+ * print as a single tree under one (root).
+ */
+static void print_joined(node_t *node, int lvl, int next, int used, FILE *out) {
+    if (node == NULL) {
+        if (next == used) {
+            db_print_recurs(NULL, lvl, out);
+            return;
+        }
+        lock_node(&parts[next].root, l_read, lvl);
+        print_joined(parts[next].root.rchild, lvl, next + 1, used, out);
+        unlock_node(&parts[next].root);
+        return;
     }
+    print_spaces(lvl, out);
+    lock_node(node, l_read, lvl);
+    if (is_root(node)) {
+        fputs_unlocked("(root)\n", out);
+    } else {
+        print_pair_line(node, out);
+    }
+    db_print_recurs(node->lchild, lvl + 1, out);
+    print_joined(node->rchild, lvl + 1, next, used, out);
+    unlock_node(node);
+}
+
+// Prints the trees of all partitions as one.
+static void print_partitions(FILE *out) {
+    map_hold();
+    print_joined(&parts[0].root, 0, 1, bounds_get()->used, out);
+    map_release();
 }
 
 int db_print(char *filename) {
     FILE *out;
     if (filename == NULL) {
-        db_print_recurs(&head, 0, stdout);
+        flockfile(stdout);
+        print_partitions(stdout);
+        funlockfile(stdout);
         return 0;
     }
 
@@ -376,7 +1946,9 @@ int db_print(char *filename) {
     }
 
     if (*filename == '\0') {
-        db_print_recurs(&head, 0, stdout);
+        flockfile(stdout);
+        print_partitions(stdout);
+        funlockfile(stdout);
         return 0;
     }
 
@@ -384,12 +1956,333 @@ int db_print(char *filename) {
         return -1;
     }
 
-    db_print_recurs(&head, 0, out);
+    print_partitions(out);
     fclose(out);
 
     return 0;
 }
 
+/*
+ * Parallel export. db_export() read-locks the top levels of the tree itself,
+ * enough of them to leave EXPORT_TASKS_PER_THREAD subtrees per thread below,
+ * and plans the output as a list of segments in output order: text that it
+ * writes itself for the locked nodes, and subtrees. Worker threads take the
+ * subtrees in turn and write each into a buffer of its own, which is written
+ * to the file once every segment before it has been.
+ */
+#define EXPORT_TASKS_PER_THREAD 8
+
+typedef struct export_seg {
+    node_t *root;  // the subtree to write, or NULL for text
+    int depth;
+    char *buf;
+    size_t len;
+    int done;
+} export_seg_t;
+
+typedef struct export_job {
+    enum export_format format;
+    long long now;
+    export_seg_t *segs;
+    int num_segs;
+    int cap_segs;
+    int used;    // partitions to export
+    FILE *text;  // stream of the text segment being planned, or NULL
+    char *text_buf;
+    size_t text_len;
+    node_t **locked;  // the nodes the planner has read-locked
+    int num_locked;
+    int cap_locked;
+    int next;    // the next segment to look at for a subtree to write
+    int failed;  // a worker ran out of memory
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+} export_job_t;
+
+// Writes the line of a live node in the sorted and snapshot formats.
+static void export_entry(export_job_t *job, node_t *node, FILE *out) {
+    if (job->format == export_snapshot)
+        repl_snapshot_entry(node->name, node->value, node->expires, out);
+    else
+        print_pair_line(node, out);
+}
+
+// Writes the subtree rooted at node, whose parent is read-locked, to out.
+static void export_subtree(export_job_t *job, node_t *node, int depth,
+                           FILE *out) {
+    int live;
+
+    if (job->format == export_tree) {
+        db_print_recurs(node, depth, out);
+        return;
+    }
+    if (node == 0) return;
+    lock_node(node, l_read, depth);
+    live = !is_root(node) && !node_expired(node, job->now);
+    if (job->format == export_snapshot && live) export_entry(job, node, out);
+    export_subtree(job, node->lchild, depth + 1, out);
+    if (job->format == export_sorted && live) export_entry(job, node, out);
+    export_subtree(job, node->rchild, depth + 1, out);
+    unlock_node(node);
+}
+
+// Returns a new, zeroed segment at the end of the plan, or NULL if out of
+// memory.
+static export_seg_t *add_segment(export_job_t *job) {
+    if (job->num_segs == job->cap_segs) {
+        int cap = job->cap_segs ? 2 * job->cap_segs : 64;
+        export_seg_t *segs = realloc(job->segs, cap * sizeof(export_seg_t));
+        if (segs == 0) return 0;
+        job->segs = segs;
+        job->cap_segs = cap;
+    }
+    memset(&job->segs[job->num_segs], 0, sizeof(export_seg_t));
+    return &job->segs[job->num_segs++];
+}
+
+// Ends the text segment being planned, if any. Returns -1 if out of memory.
+static int end_text(export_job_t *job) {
+    export_seg_t *seg;
+    int failed;
+
+    if (job->text == 0) return 0;
+    failed = fclose(job->text) != 0;
+    job->text = 0;
+    if (failed || (seg = add_segment(job)) == 0) {
+        free(job->text_buf);
+        return -1;
+    }
+    seg->buf = job->text_buf;
+    seg->len = job->text_len;
+    seg->done = 1;
+    return 0;
+}
+
+// Returns the stream of the text segment being planned, starting one if
+// needed, or NULL if out of memory.
+static FILE *text_stream(export_job_t *job) {
+    if (job->text == 0) {
+        job->text = open_memstream(&job->text_buf, &job->text_len);
+    }
+    return job->text;
+}
+
+// Read-locks node for the planner, which keeps it locked until the export
+// is written. Returns -1, leaving node unlocked, if out of memory.
+static int plan_lock(export_job_t *job, node_t *node, int depth) {
+    if (job->num_locked == job->cap_locked) {
+        int cap = job->cap_locked ? 2 * job->cap_locked : 64;
+        node_t **locked = realloc(job->locked, cap * sizeof(node_t *));
+        if (locked == 0) return -1;
+        job->locked = locked;
+        job->cap_locked = cap;
+    }
+    lock_node(node, l_read, depth);
+    job->locked[job->num_locked++] = node;
+    return 0;
+}
+
+/*
+ * Plans the output of the subtree rooted at node, whose parent the planner
+ * holds read-locked: the node and split - 1 levels below it are locked and
+ * written as text, and the subtrees below those become segments. In the tree
+ * format the trees of partitions next up to job->used are nested in place of
+ * the subtree's last (null), as print_joined() does, so the path to that
+ * (null) is always planned as text. Returns -1 if out of memory.
+ */
+static int plan_subtree(export_job_t *job, node_t *node, int depth, int split,
+                        int next) {
+    int joined = job->format == export_tree && next < job->used;
+    export_seg_t *seg;
+    FILE *text;
+    int live;
+
+    if (node == 0) {
+        if (joined) {
+            if (plan_lock(job, &parts[next].root, depth) != 0) return -1;
+            return plan_subtree(job, parts[next].root.rchild, depth, split,
+                                next + 1);
+        }
+        if (job->format == export_tree) {
+            if ((text = text_stream(job)) == 0) return -1;
+            db_print_recurs(0, depth, text);
+        }
+        return 0;
+    }
+    if (split <= 0 && !joined) {
+        if (end_text(job) != 0 || (seg = add_segment(job)) == 0) return -1;
+        seg->root = node;
+        seg->depth = depth;
+        return 0;
+    }
+
+    if (plan_lock(job, node, depth) != 0) return -1;
+
+    live = !is_root(node) && !node_expired(node, job->now);
+    if (job->format == export_tree ||
+        (job->format == export_snapshot && live)) {
+        if ((text = text_stream(job)) == 0) return -1;
+        if (job->format == export_snapshot) {
+            export_entry(job, node, text);
+        } else {
+            print_spaces(depth, text);
+            if (is_root(node))
+                fputs_unlocked("(root)\n", text);
+            else
+                print_pair_line(node, text);
+        }
+    }
+    if (plan_subtree(job, node->lchild, depth + 1, split - 1, job->used) != 0) {
+        return -1;
+    }
+    if (job->format == export_sorted && live) {
+        if ((text = text_stream(job)) == 0) return -1;
+        export_entry(job, node, text);
+    }
+    return plan_subtree(job, node->rchild, depth + 1, split - 1, next);
+}
+
+static void *export_worker(void *arg) {
+    export_job_t *job = (export_job_t *)arg;
+    export_seg_t *seg;
+    char *buf;
+    size_t len;
+    FILE *out;
+    int err;
+
+    for (;;) {
+        if ((err = pthread_mutex_lock(&job->mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        while (job->next < job->num_segs && job->segs[job->next].root == 0) {
+            job->next++;
+        }
+        seg = job->next < job->num_segs ? &job->segs[job->next++] : 0;
+        if ((err = pthread_mutex_unlock(&job->mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        if (seg == 0) return 0;
+
+        // out of memory, the segment is left empty and the export fails
+        buf = 0;
+        len = 0;
+        if ((out = open_memstream(&buf, &len)) != 0) {
+            export_subtree(job, seg->root, seg->depth, out);
+        }
+        if (out == 0 || fclose(out) != 0) {
+            free(buf);
+            buf = 0;
+            len = 0;
+        }
+
+        if ((err = pthread_mutex_lock(&job->mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        if (buf == 0) job->failed = 1;
+        seg->buf = buf;
+        seg->len = len;
+        seg->done = 1;
+        if ((err = pthread_cond_broadcast(&job->done)) != 0) {
+            handle_error_en(err, "pthread_cond_broadcast");
+        }
+        if ((err = pthread_mutex_unlock(&job->mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+    }
+}
+
+long db_export(char *filename, enum export_format format, int threads) {
+    export_job_t job = {format, ttl_now_ms()};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *workers = 0;
+    int num_workers = 0;
+    int subtrees = 0;
+    int split = 0;
+    long written = 0;
+    int failed = 0;
+    FILE *out;
+    int err;
+
+    if ((out = fopen(filename, "w")) == 0) return -1;
+    if (threads < 1) threads = 1;
+    if (cpus < 1) cpus = 1;
+    if (threads > cpus * DB_EXPORT_THREADS_PER_CPU) {
+        threads = cpus * DB_EXPORT_THREADS_PER_CPU;
+    }
+    while ((1 << split) < threads * EXPORT_TASKS_PER_THREAD) split++;
+    if ((err = pthread_mutex_init(&job.mutex, 0)) != 0) {
+        handle_error_en(err, "pthread_mutex_init");
+    }
+    if ((err = pthread_cond_init(&job.done, 0)) != 0) {
+        handle_error_en(err, "pthread_cond_init");
+    }
+
+    map_hold();
+    job.used = bounds_get()->used;
+    if (format == export_tree) {
+        // the partitions make up one tree, see print_joined()
+        failed = plan_subtree(&job, &parts[0].root, 0, split, 1) != 0;
+    } else {
+        for (int i = 0; !failed && i < job.used; i++) {
+            failed =
+                plan_subtree(&job, &parts[i].root, 0, split, job.used) != 0;
+        }
+    }
+    if (end_text(&job) != 0) failed = 1;
+    for (int i = 0; i < job.num_segs; i++) subtrees += job.segs[i].root != 0;
+
+    if (!failed && (workers = malloc(threads * sizeof(pthread_t))) == 0) {
+        failed = 1;
+    }
+    // a single thread has nothing to overlap, so it writes straight to the
+    // file rather than through buffers; after a failure the segments planned
+    // are only freed
+    for (; !failed && threads > 1 && num_workers < threads &&
+           num_workers < subtrees;
+         num_workers++) {
+        if ((err = pthread_create(&workers[num_workers], 0, export_worker,
+                                  &job)) != 0) {
+            handle_error_en(err, "pthread_create");
+        }
+    }
+
+    for (int i = 0; i < job.num_segs; i++) {
+        export_seg_t *seg = &job.segs[i];
+        if (num_workers == 0 && seg->root != 0) {
+            if (!failed) export_subtree(&job, seg->root, seg->depth, out);
+            continue;
+        }
+        if ((err = pthread_mutex_lock(&job.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_lock");
+        }
+        while (!seg->done) {
+            if ((err = pthread_cond_wait(&job.done, &job.mutex)) != 0) {
+                handle_error_en(err, "pthread_cond_wait");
+            }
+        }
+        if ((err = pthread_mutex_unlock(&job.mutex)) != 0) {
+            handle_error_en(err, "pthread_mutex_unlock");
+        }
+        if (!failed && fwrite(seg->buf, 1, seg->len, out) != seg->len) {
+            failed = 1;
+        }
+        free(seg->buf);
+    }
+    written = ftell(out);
+    if (job.failed) failed = 1;
+
+    for (int i = 0; i < num_workers; i++) pthread_join(workers[i], 0);
+    for (int i = job.num_locked - 1; i >= 0; i--) unlock_node(job.locked[i]);
+    map_release();
+    pthread_cond_destroy(&job.done);
+    pthread_mutex_destroy(&job.mutex);
+    free(workers);
+    free(job.segs);
+    free(job.locked);
+    if (fclose(out) != 0) failed = 1;
+    return failed ? -1 : written;
+}
+
 /* Recursively destroys node and all its children. */
 void db_cleanup_recurs(node_t *node) {
     if (node == NULL) {
@@ -403,90 +2296,452 @@ void db_cleanup_recurs(node_t *node) {
 }
 
 void db_cleanup() {
-    db_cleanup_recurs(head.lchild);
-    db_cleanup_recurs(head.rchild);
+    for (int i = 0; i < num_parts; i++) {
+        db_cleanup_recurs(parts[i].root.lchild);
+        db_cleanup_recurs(parts[i].root.rchild);
+        parts[i].root.lchild = parts[i].root.rchild = NULL;
+        parts[i].keys = 0;
+    }
+    if (bounds != &first_bounds) free(bounds);
+    bounds = &first_bounds;
+    ebr_flush();
+}
+
+/*
+ * Splits the next whitespace-delimited word off *args, NUL-terminating it in
+ * place, and advances *args past it. Returns the word, or NULL if there is
+ * none. Unlike sscanf() into a fixed buffer this handles words of any length,
+ * which values stored in blobs need.
+ */
+static char *next_word(char **args) {
+    char *p = *args;
+    char *word;
+
+    while (isspace(*p)) p++;
+    if (*p == '\0') return NULL;
+    word = p;
+    while (*p != '\0' && !isspace(*p)) p++;
+    if (*p != '\0') *p++ = '\0';
+    *args = p;
+    return word;
+}
+
+/*
+ * Parses the "key value [ttl]" arguments of the a and u commands, the ttl
+ * being a positive number of seconds. Returns 0 on success, or -1 if they
+ * are ill-formed.
+ */
+static int parse_set_args(char *args, char **name, char **value, int *ttl) {
+    char *ttl_word;
+    char *end;
+    long long n;
+
+    *ttl = 0;
+    if ((*name = next_word(&args)) == NULL ||
+        (*value = next_word(&args)) == NULL || strlen(*name) >= MAXLEN) {
+        return -1;
+    }
+    if ((ttl_word = next_word(&args)) == NULL) return 0;
+    errno = 0;
+    n = strtoll(ttl_word, &end, 10);
+    if (errno != 0 || end == ttl_word || *end != '\0' || n <= 0 ||
+        n > INT_MAX || next_word(&args) != NULL) {
+        return -1;
+    }
+    *ttl = n;
+    return 0;
+}
+
+// db_scan() visitor for the scan command: appends "key value " to a stream.
+static void print_pair(node_t *node, void *out) {
+    fprintf((FILE *)out, "%s %s ", node->name, node->value);
+}
+
+/*
+ * Replies to "scan start count" with the keys and values found, separated by
+ * spaces. The reply can be much longer than response, so when blobp is not
+ * NULL it is returned as a blob.
+ */
+static void scan_command(char *start, int count, char *response, int len,
+                         blob_t **blobp) {
+    char *buf = 0;
+    size_t size = 0;
+    FILE *out;
+
+    if ((out = open_memstream(&buf, &size)) == NULL) {
+        snprintf(response, len, "out of memory");
+        return;
+    }
+    int found = db_scan(start, count, print_pair, out);
+    fclose(out);
+
+    if (found == 0) {
+        snprintf(response, len, "not found");
+    } else if (blobp == 0 || (*blobp = blob_create(buf, size - 1)) == 0) {
+        // drop the trailing space
+        snprintf(response, len, "%.*s", (int)size - 1, buf);
+    } else {
+        response[0] = '\0';
+    }
+    free(buf);
+}
+
+/*
+ * Replies to "info" with the tree statistics on one line: the number of keys
+ * (including expired keys and tombstones not yet removed), the memory used,
+ * its limit and the evictions so far, the query cache's hits and misses, then
+ * the height of the tree, the mean key depth and the histogram as depth:count
+ * pairs. Depths are those recorded for the keys (see stats.h), so they may
+ * overstate the true ones. With partitions, the approximate number of keys in
+ * each follows, as "partitions n,n,...".
+ */
+static void info_command(char *response, int len) {
+    stats_t st;
+    long used, limit;
+    unsigned long evicted;
+    long weighted = 0, counted = 0;
+    int height = 0, n;
+
+    stats_read(&st);
+    db_memory_stats(&used, &limit, &evicted);
+    for (int d = 1; d < STATS_MAX_DEPTH; d++) {
+        if (st.depths[d] <= 0) continue;
+        weighted += d * st.depths[d];
+        counted += st.depths[d];
+        height = d;
+    }
+    n = snprintf(response, len,
+                 "keys %ld bytes %ld limit %ld evicted %lu cache_hits %ld "
+                 "cache_misses %ld height %d%s mean_depth %.2f depths",
+                 st.keys, used, limit, evicted, st.cache_hits, st.cache_misses,
+                 height, height == STATS_MAX_DEPTH - 1 ? "+" : "",
+                 counted ? (double)weighted / counted : 0.0);
+    for (int d = 1; d <= height && n < len; d++) {
+        if (st.depths[d] <= 0) continue;
+        n += snprintf(response + n, len - n, " %d:%ld", d, st.depths[d]);
+    }
+    for (int i = 0; num_parts > 1 && i < num_parts && n < len; i++) {
+        n += snprintf(response + n, len - n, "%s%ld", i ? "," : " partitions ",
+                      __atomic_load_n(&parts[i].keys, __ATOMIC_RELAXED));
+    }
+}
+
+/*
+ * Replies to "slowlog" with up to count entries of the slow log (see
+ * slowlog.h), newest first and separated by " | ", as a blob when blobp is
+ * not NULL.
+ */
+static void slowlog_command(int count, char *response, int len,
+                            blob_t **blobp) {
+    char *buf = 0;
+    size_t size = 0;
+    FILE *out;
+    int n;
+
+    if ((out = open_memstream(&buf, &size)) == NULL) {
+        snprintf(response, len, "out of memory");
+        return;
+    }
+    n = slowlog_print(out, count, " | ");
+    fclose(out);
+
+    if (n == 0) {
+        snprintf(response, len, "no slow commands");
+    } else if (blobp == 0 || (*blobp = blob_create(buf, size - 3)) == 0) {
+        // drop the trailing separator
+        snprintf(response, len, "%.*s", (int)size - 3, buf);
+    } else {
+        response[0] = '\0';
+    }
+    free(buf);
+}
+
+/*
+ * Replies to "v value" with the keys holding value, separated by spaces, as a
+ * blob when blobp is not NULL since there may be many of them.
+ */
+static void value_command(char *value, char *response, int len,
+                          blob_t **blobp) {
+    char **names;
+    char *buf = 0;
+    size_t size = 0;
+    FILE *out;
+    int n = db_find_value(value, &names);
+
+    if (n == -1) {
+        snprintf(response, len,
+                 vindex_enabled() ? "out of memory" : "no value index");
+        return;
+    }
+    if (n == 0) {
+        snprintf(response, len, "not found");
+    } else if ((out = open_memstream(&buf, &size)) == NULL) {
+        snprintf(response, len, "out of memory");
+    } else {
+        for (int i = 0; i < n; i++) fprintf(out, i ? " %s" : "%s", names[i]);
+        fclose(out);
+        if (blobp == 0 || (*blobp = blob_create(buf, size)) == 0) {
+            snprintf(response, len, "%s", buf);
+        } else {
+            response[0] = '\0';
+        }
+        free(buf);
+    }
+    for (int i = 0; i < n; i++) free(names[i]);
+    free(names);
 }
 
-void interpret_command(char *command, char *response, int len) {
-    char value[MAXLEN];
-    char ibuf[MAXLEN];
+// Called before each line of a file run by the f command, if set.
+static void (*file_pacer)(void);
+
+void db_set_file_pacer(void (*pace)(void)) { file_pacer = pace; }
+
+/*
+ * Returns nonzero if name can't be a key of this database, after storing the
+ * reply in response.
+ */
+static int bad_key(char *name, char *response, int len) {
+    if (db_key_valid(name)) return 0;
+    snprintf(response, len, "key is not an integer");
+    return 1;
+}
+
+// interpret_command() without the probes around it.
+static void interpret(char *command, char *response, int len, blob_t **blobp) {
     char name[MAXLEN];
+    char verb[16];
+    char *args;
+    char *key;
+    char *value;
     int sscanf_ret;
+    int verb_len;
+    int ttl = 0;
 
-    if (strlen(command) <= 1) {
+    if (blobp != 0) *blobp = 0;
+    if (strlen(command) <= 1 ||
+        sscanf(command, "%15s%n", verb, &verb_len) < 1) {
         snprintf(response, len, "ill-formed command");
         return;
     }
+    args = &command[verb_len];
+
+    // a replica only changes through the log it receives from its primary
+    if (repl_is_replica() &&
+        (strcmp(verb, "a") == 0 || strcmp(verb, "u") == 0 ||
+         strcmp(verb, "d") == 0 || strcmp(verb, "cas") == 0 ||
+         strcmp(verb, "incr") == 0 || strcmp(verb, "append") == 0)) {
+        snprintf(response, len, "read-only replica");
+        return;
+    }
 
     // which command is it?
-    switch (command[0]) {
-        case 'q':
-            // Query
-            sscanf_ret = sscanf(&command[1], "%255s", name);
-            if (sscanf_ret < 1) {
-                snprintf(response, len, "ill-formed command");
-                return;
-            }
-            db_query(name, response, len);
-            if (strlen(response) == 0) {
-                snprintf(response, len, "not found");
-            }
+    if (strcmp(verb, "q") == 0) {
+        // Query
+        sscanf_ret = sscanf(args, "%255s", name);
+        if (sscanf_ret < 1) {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        if (bad_key(name, response, len)) return;
+        db_query_blob(name, response, len, blobp);
+        if ((blobp == 0 || *blobp == 0) && strlen(response) == 0) {
+            snprintf(response, len, "not found");
+        }
 
+    } else if (strcmp(verb, "a") == 0) {
+        // Add to the database, optionally with a ttl in seconds
+        if (parse_set_args(args, &key, &value, &ttl) != 0) {
+            snprintf(response, len, "ill-formed command");
             return;
+        }
+        if (bad_key(key, response, len)) return;
+        if (strlen(value) > BLOB_MAXLEN) {
+            snprintf(response, len, "value too long");
+        } else if (db_add_ttl(key, value, ttl * 1000LL)) {
+            snprintf(response, len, "added");
+        } else {
+            snprintf(response, len, "already in database");
+        }
 
-        case 'a':
-            // Add to the database
-            sscanf_ret = sscanf(&command[1], "%255s %255s", name, value);
-            if (sscanf_ret < 2) {
-                snprintf(response, len, "ill-formed command");
-                return;
-            }
-            if (db_add(name, value)) {
-                snprintf(response, len, "added");
-            } else {
-                snprintf(response, len, "already in database");
-            }
+    } else if (strcmp(verb, "u") == 0) {
+        // Update the value (and ttl) of a key already in the database
+        if (parse_set_args(args, &key, &value, &ttl) != 0) {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        if (bad_key(key, response, len)) return;
+        if (strlen(value) > BLOB_MAXLEN) {
+            snprintf(response, len, "value too long");
+        } else if (db_update(key, value, ttl * 1000LL)) {
+            snprintf(response, len, "updated");
+        } else {
+            snprintf(response, len, "not in database");
+        }
 
+    } else if (strcmp(verb, "cas") == 0) {
+        // Compare and swap: set the value only if it is the expected one
+        char *expected;
+        if ((key = next_word(&args)) == NULL ||
+            (expected = next_word(&args)) == NULL ||
+            (value = next_word(&args)) == NULL || strlen(key) >= MAXLEN) {
+            snprintf(response, len, "ill-formed command");
             return;
+        }
+        if (bad_key(key, response, len)) return;
+        if (strlen(value) > BLOB_MAXLEN) {
+            snprintf(response, len, "value too long");
+            return;
+        }
+        int swapped = db_cas(key, expected, value);
+        if (swapped > 0) {
+            snprintf(response, len, "swapped");
+        } else if (swapped == 0) {
+            snprintf(response, len, "mismatch");
+        } else {
+            snprintf(response, len, "not in database");
+        }
 
-        case 'd':
-            // Delete from the database
-            sscanf_ret = sscanf(&command[1], "%255s", name);
-            if (sscanf_ret < 1) {
-                snprintf(response, len, "ill-formed command");
-                return;
-            }
-            if (db_remove(name)) {
-                snprintf(response, len, "removed");
-            } else {
-                snprintf(response, len, "not in database");
-            }
+    } else if (strcmp(verb, "incr") == 0) {
+        // Add to an integer value (a missing key counts as 0)
+        char *delta_word;
+        char *end;
+        long long delta;
+        long long result;
+        if ((key = next_word(&args)) == NULL ||
+            (delta_word = next_word(&args)) == NULL || strlen(key) >= MAXLEN) {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        errno = 0;
+        delta = strtoll(delta_word, &end, 10);
+        if (errno != 0 || end == delta_word || *end != '\0') {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        if (bad_key(key, response, len)) return;
+        int incremented = db_incr(key, delta, &result);
+        if (incremented > 0) {
+            snprintf(response, len, "%lld", result);
+        } else if (incremented == 0) {
+            snprintf(response, len, "value is not an integer");
+        } else {
+            snprintf(response, len, "overflow");
+        }
 
+    } else if (strcmp(verb, "append") == 0) {
+        // Append to the value (a missing key counts as empty)
+        if ((key = next_word(&args)) == NULL ||
+            (value = next_word(&args)) == NULL || strlen(key) >= MAXLEN) {
+            snprintf(response, len, "ill-formed command");
             return;
+        }
+        if (bad_key(key, response, len)) return;
+        if (db_append(key, value)) {
+            snprintf(response, len, "appended");
+        } else {
+            snprintf(response, len, "value too long");
+        }
 
-        case 'f':
-            // process the commands in a file (silently)
-            sscanf_ret = sscanf(&command[1], "%255s", name);
-            if (sscanf_ret < 1) {
-                snprintf(response, len, "ill-formed command");
-                return;
-            }
+    } else if (strcmp(verb, "scan") == 0) {
+        // Up to count keys, in order, starting at the first key >= start
+        // ("-" starts at the first key)
+        int count;
+        sscanf_ret = sscanf(args, "%255s %d", name, &count);
+        if (sscanf_ret < 2 || count <= 0) {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        if (strcmp(name, "-") == 0) {
+            name[0] = '\0';
+        } else if (bad_key(name, response, len)) {
+            return;
+        }
+        scan_command(name, count, response, len, blobp);
 
-            FILE *finput = fopen(name, "r");
-            if (!finput) {
-                snprintf(response, len, "bad file name");
-                return;
-            }
-            while (fgets(ibuf, sizeof(ibuf), finput) != 0) {
-                pthread_testcancel();  // fgets is not a cancellation point
-                interpret_command(ibuf, response, len);
-            }
-            fclose(finput);
-            snprintf(response, len, "file processed");
+    } else if (strcmp(verb, "info") == 0) {
+        // Key count, memory and depth statistics
+        info_command(response, len);
+
+    } else if (strcmp(verb, "slowlog") == 0) {
+        // The newest slow commands, 10 unless a count is given
+        int count = 10;
+        sscanf_ret = sscanf(args, "%d", &count);
+        if (sscanf_ret == 0 || count <= 0) {
+            snprintf(response, len, "ill-formed command");
             return;
+        }
+        slowlog_command(count, response, len, blobp);
 
-        default:
+    } else if (strcmp(verb, "v") == 0) {
+        // Keys whose value is the argument
+        if ((value = next_word(&args)) == NULL) {
             snprintf(response, len, "ill-formed command");
             return;
+        }
+        value_command(value, response, len, blobp);
+
+    } else if (strcmp(verb, "ttl") == 0) {
+        // Seconds until a key expires (rounded up), or -1 if it never does
+        sscanf_ret = sscanf(args, "%255s", name);
+        if (sscanf_ret < 1) {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        if (bad_key(name, response, len)) return;
+        long long remaining = db_ttl(name);
+        if (remaining == -2) {
+            snprintf(response, len, "not found");
+        } else if (remaining == -1) {
+            snprintf(response, len, "-1");
+        } else {
+            snprintf(response, len, "%lld", (remaining + 999) / 1000);
+        }
+
+    } else if (strcmp(verb, "d") == 0) {
+        // Delete from the database
+        sscanf_ret = sscanf(args, "%255s", name);
+        if (sscanf_ret < 1) {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        if (bad_key(name, response, len)) return;
+        if (db_remove(name)) {
+            snprintf(response, len, "removed");
+        } else {
+            snprintf(response, len, "not in database");
+        }
+
+    } else if (strcmp(verb, "f") == 0) {
+        // process the commands in a file (silently)
+        sscanf_ret = sscanf(args, "%255s", name);
+        if (sscanf_ret < 1) {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+
+        FILE *finput = fopen(name, "r");
+        if (!finput) {
+            snprintf(response, len, "bad file name");
+            return;
+        }
+        char *ibuf = 0;
+        size_t ibuf_len = 0;
+        while (getline(&ibuf, &ibuf_len, finput) != -1) {
+            pthread_testcancel();  // getline is not a cancellation point
+            if (file_pacer != 0) file_pacer();
+            interpret_command(ibuf, response, len, 0);
+        }
+        free(ibuf);
+        fclose(finput);
+        snprintf(response, len, "file processed");
+
+    } else {
+        snprintf(response, len, "ill-formed command");
     }
 }
+
+void interpret_command(char *command, char *response, int len, blob_t **blobp) {
+    PROBE1(command_start, command);
+    interpret(command, response, len, blobp);
+    PROBE2(command_end, command, response);
+}
@@ -2,16 +2,24 @@
 #define DB_H_
 
 #include <pthread.h>
+#include "./blob.h"
 
 typedef struct node {
     char *name;
-    char *value;
+    long long ikey;  // the key as an integer, with integer keys
+    char *value;     // points into blob for values stored out of line
+    blob_t *blob;    // out-of-line value (see blob.h), or NULL
     struct node *lchild;
     struct node *rchild;
     pthread_rwlock_t lock;
+    long long expires;      // ttl_now_ms() time at which the key expires, or 0
+    unsigned int atime;     // last access, in 100ms units, for eviction
+    int depth;              // depth recorded in the statistics (see stats.h)
+    unsigned long version;  // odd while write-locked (see lock_node())
 } node_t;
 
-extern node_t head;
+// The most partitions db_set_partitions() accepts.
+#define DB_MAX_PARTITIONS 64
 
 enum locktype { l_read, l_write };
 
@@ -24,6 +32,15 @@ node_t *search(char *name, node_t *parent, node_t **parentp, enum locktype lt);
  */
 void db_query(char *name, char *result, int len);
 
+/**
+ * db_query_blob() is db_query() for callers that can send a large value
+ * without copying it: if the value of the key is stored in a blob, a reference
+ * to the blob is stored in *blobp (to be dropped with blob_put()) and result is
+ * left empty. Otherwise *blobp is set to NULL and the value is copied into
+ * result as by db_query().
+ */
+void db_query_blob(char *name, char *result, int len, blob_t **blobp);
+
 /**
  * db_add() uses search() to determine if the given key is already in the
  * database. If the key is not in the database, the function creates a new node
@@ -33,6 +50,62 @@ void db_query(char *name, char *result, int len);
  */
 int db_add(char *name, char *value);
 
+/**
+ * db_add_ttl() is db_add() for a key that expires ttl milliseconds from now
+ * (a ttl of 0 means never). An existing key that has already expired is
+ * replaced.
+ */
+int db_add_ttl(char *name, char *value, long long ttl);
+
+/**
+ * db_update() replaces the value of an existing key and sets its ttl in
+ * milliseconds (0 means the key no longer expires). Returns 1 on success and
+ * 0 if the key is not in the database.
+ */
+int db_update(char *name, char *value, long long ttl);
+
+/**
+ * db_cas() sets the value of a key to value if it is currently expected, with
+ * the node locked throughout. Returns 1 if the value was set, 0 if it was
+ * something else, and -1 if the key is not in the database.
+ */
+int db_cas(char *name, char *expected, char *value);
+
+/**
+ * db_incr() adds delta to the value of a key, which must be a decimal
+ * integer, and stores the sum in *result. A missing key is added, as if its
+ * value were 0. Returns 1 on success, 0 if the value is not an integer and
+ * -1 if the sum would overflow.
+ */
+int db_incr(char *name, long long delta, long long *result);
+
+/**
+ * db_append() appends suffix to the value of a key, adding the key if it is
+ * missing. Returns 1 on success and 0 if the value would be longer than
+ * BLOB_MAXLEN.
+ */
+int db_append(char *name, char *suffix);
+
+/**
+ * db_put() sets the value and ttl of a key whether or not it is already in
+ * the database. Returns 1 on success and 0 on failure.
+ */
+int db_put(char *name, char *value, long long ttl);
+
+/**
+ * db_ttl() returns the number of milliseconds until the given key expires,
+ * -1 if the key does not expire, or -2 if it is not in the database.
+ */
+long long db_ttl(char *name);
+
+/**
+ * db_expire() removes those of the n given keys that have expired. The keys
+ * are sorted in place and removed in a single hand-over-hand descent from the
+ * root of each partition they are in, so a root is locked once per batch
+ * rather than once per key. Returns the number of keys removed.
+ */
+int db_expire(char **names, int n);
+
 /**
  * The db_remove() function calls search() to retrieve the node associated with
  *the given key. If such a node is found, the function must delete it while
@@ -51,11 +124,144 @@ int db_add(char *name, char *value);
  */
 int db_remove(char *name);
 
+/**
+ * db_set_tombstones() switches db_remove() between unlinking nodes (the
+ * default) and marking them as tombstones. A tombstone is locked for writing
+ * only on its own node, readers treat it as missing, and the expiry thread
+ * (see ttl.h) unlinks tombstones in batches in the background.
+ */
+void db_set_tombstones(int enable);
+
+/**
+ * db_set_int_keys() switches the database to integer keys: every key must be
+ * a 64-bit integer in canonical decimal form (no sign for positive numbers,
+ * no leading zeros) and keys are ordered numerically, by scans too. It must
+ * be called before any keys are added.
+ */
+void db_set_int_keys(int enable);
+
+/**
+ * db_key_valid() returns nonzero if name can be a key of the database, which
+ * is always the case unless it uses integer keys (see db_set_int_keys()).
+ */
+int db_key_valid(char *name);
+
+/**
+ * db_set_optimistic() switches adds, updates and removes to optimistic lock
+ * coupling: they descend without locks, validating the version of each node
+ * passed, and write-lock only the nodes they change, so that writers to
+ * different keys don't serialize at the root. It must be called before any
+ * keys are added.
+ */
+void db_set_optimistic(int enable);
+
+/**
+ * db_set_partitions() splits the key space into n ranges (at most
+ * DB_MAX_PARTITIONS), each with a tree and a root lock of its own, so that
+ * operations on keys in different ranges don't contend on a single root. The
+ * ranges start out as one and are split and resized in the background (see
+ * db_rebalance_start()). That converges in time linear in the keys and the
+ * partitions: with 100000 keys all in the first range, the ranges were even
+ * after 0.12s with 4 partitions, 0.4s with 16 and 1.3s with 64 on one CPU, a
+ * single move stalling its two partitions for up to 40-50ms. Scans, walks,
+ * prints and exports go through the partitions in order, so they still see the
+ * keys in key order. It must be called before any keys are added. Returns 0 on
+ * success or -1 if n is out of range.
+ */
+int db_set_partitions(int n);
+
+/**
+ * db_rebalance_start() starts the thread that moves the partition boundaries
+ * (see db_set_partitions()), if there is more than one partition. Once there
+ * are 64 keys per partition, and whenever not every partition is in use or
+ * one holds more than twice its share, it moves one boundary after another,
+ * between two neighbouring partitions at a time, to where evenly spread keys
+ * would put it, until that is no longer so. Only operations on the two
+ * partitions whose boundary moves wait for it, for time linear in their
+ * keys. The thread checks the counts every 100ms.
+ */
+void db_rebalance_start(void);
+
+/**
+ * db_rebalance_stop() stops the rebalancing thread, if it is running. It must
+ * be stopped before db_cleanup().
+ */
+void db_rebalance_stop(void);
+
+/**
+ * db_set_arenas() allocates nodes from per-NUMA-node arenas (see arena.h)
+ * instead of malloc(), so that a node lives on the NUMA node of the thread
+ * that added it. It must be called before any keys are added or threads
+ * started.
+ */
+void db_set_arenas(int enable);
+
+/**
+ * db_set_memory_limit() caps the memory used by nodes and their keys and
+ * values at the given number of bytes (0 means no limit). Once an add or
+ * update pushes usage over the limit, approximately least recently used keys
+ * are evicted until it is back under.
+ */
+void db_set_memory_limit(long bytes);
+
+/**
+ * db_evict() evicts keys while memory usage is over the limit, giving up after
+ * a bounded number of attempts. Returns the number of keys evicted.
+ */
+int db_evict(void);
+
+/**
+ * db_memory_stats() reports the bytes currently used by the tree, the limit
+ * (0 if none) and the number of keys evicted so far.
+ */
+void db_memory_stats(long *used, long *limit, unsigned long *evicted);
+
+/**
+ * db_scan() calls visit, with the node read-locked, on up to count keys (all
+ * of them if count is negative) that are not less than start, in order.
+ * Expired keys and tombstones are skipped. Returns the number of keys visited.
+ */
+int db_scan(char *start, int count, void (*visit)(node_t *, void *), void *arg);
+
+/**
+ * db_walk() calls visit, with the node read-locked, on every live key in
+ * pre-order, the order db_print() uses, one partition after the other.
+ * Adding the keys to an empty tree in that order rebuilds a tree of the same
+ * shape. Writers are blocked at the root of the partition it is in while it
+ * runs.
+ */
+void db_walk(void (*visit)(node_t *, void *), void *arg);
+
+/**
+ * db_clear() removes every key. Unlike db_cleanup() it may be called while
+ * other threads are using the database.
+ */
+void db_clear(void);
+
+/**
+ * db_find_value() stores the live keys whose value is value, sorted, in a
+ * malloc()ed array of malloc()ed strings at *names and returns how many there
+ * are. It needs the value index (see vindex.h) and returns -1 if that is off
+ * or memory runs out.
+ */
+int db_find_value(char *value, char ***names);
+
+/**
+ * db_set_file_pacer() sets a function that the f command calls before each
+ * line of the file it runs, and that may block to slow bulk loads down (see
+ * admit_pace()). NULL, the default, runs files at full speed.
+ */
+void db_set_file_pacer(void (*pace)(void));
+
 /**
  * The interpret_command() function gets called by the server to interpret a
  * command from a client, call database functions, and store the response.
+ * If blobp is not NULL, the reply to a query for a value stored in a blob is
+ * returned as a reference in *blobp instead of being copied into response
+ * (see db_query_blob()); *blobp is NULL for every other reply.
  */
-void interpret_command(char *command, char *response, int resp_capacity);
+void interpret_command(char *command, char *response, int resp_capacity,
+                       blob_t **blobp);
 
 /**
   * The db_print() function performs a pre-order traversal of the tree, printing
@@ -66,6 +272,25 @@ void interpret_command(char *command, char *response, int resp_capacity);
   */
 int db_print(char *filename);
 
+enum export_format {
+    export_tree,      // db_print()'s indented pre-order, expired keys included
+    export_sorted,    // "key value" lines in key order
+    export_snapshot,  // snapshot entries of the replication stream (repl.h)
+};
+
+// db_export() uses at most this many threads per online CPU.
+#define DB_EXPORT_THREADS_PER_CPU 4
+
+/**
+ * db_export() writes the database to filename in the given format, using up
+ * to threads threads (see DB_EXPORT_THREADS_PER_CPU). The top levels of the
+ * tree stay read-locked while the subtrees below them are written into memory
+ * by the threads in parallel, and the buffers are then written out in order.
+ * Returns the number of bytes written, or -1 if the file couldn't be written
+ * or memory ran out.
+ */
+long db_export(char *filename, enum export_format format, int threads);
+
 /**
  * The db_cleanup() function frees all dynamically-allocated nodes in the
  * database. This function should be used in server.c to clean up the database
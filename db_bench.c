@@ -0,0 +1,537 @@
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "./affinity.h"
+#include "./db.h"
+#include "./qcache.h"
+#include "./stats.h"
+#include "./ttl.h"
+#include "./vindex.h"
+
+/*
+ * In-process benchmark for the database engine. It links directly against
+ * db.o, so no sockets, comm_serve or interpret_command are involved, and
+ * drives db_add/db_query/db_remove from a varying number of threads.
+ *
+ * Every configuration runs three phases on a fresh tree:
+ *   add    - insert the load corpus, keys dealt round-robin to the threads
+ *   query  - look up keys from the query corpus in the chosen access pattern
+ *   remove - delete the keys in the delete corpus in the chosen pattern
+ *
+ * Results are written as tab-separated rows in a fixed order so that runs
+ * from two builds can be compared with diff or a spreadsheet.
+ */
+
+#define LINELEN 1024
+#define RESULT_LEN 1024
+#define MAX_THREAD_COUNTS 64
+
+enum pattern { p_sorted, p_random, p_zipf, num_patterns };
+static const char *pattern_names[] = {"sorted", "random", "zipf"};
+
+typedef struct corpus {
+    char **keys;
+    char **values;
+    int n;
+} corpus_t;
+
+typedef struct zipf {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} zipf_t;
+
+typedef struct bench_thread {
+    pthread_t thread;
+    int id;
+    int num_threads;
+    enum pattern pattern;
+    long ops;
+    uint64_t rng;
+} bench_thread_t;
+
+static corpus_t load_corpus, query_corpus, delete_corpus;
+static int *sorted_queries;    // query corpus indices in key order
+static int *sorted_deletes;    // delete corpus indices in key order
+static int *shuffled_deletes;  // delete corpus indices in random order
+static int *zipf_rank;         // zipf rank -> query corpus index
+static zipf_t zipf;
+static long query_ops = 200000;
+
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64*, one generator per thread
+static uint64_t next_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double next_double(uint64_t *state) {
+    return (next_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Zipfian generator over [0, n) from Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases" (the one YCSB uses).
+ */
+static void zipf_init(zipf_t *z, uint64_t n, double theta) {
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1.0 / (1.0 - theta);
+    z->zetan = 0;
+    for (uint64_t i = 1; i <= n; i++) z->zetan += 1.0 / pow((double)i, theta);
+    double zeta2 = 1.0 + pow(0.5, theta);
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static uint64_t zipf_next(zipf_t *z, uint64_t *rng) {
+    double u = next_double(rng);
+    double uz = u * z->zetan;
+    if (uz < 1.0) return 0;
+    if (uz < 1.0 + pow(0.5, z->theta)) return 1;
+    uint64_t r = (uint64_t)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return r < z->n ? r : z->n - 1;
+}
+
+/*
+ * Reads a corpus. Script lines "a key value", "q key" and "d key" contribute
+ * their key (and value); any other line contributes its first word, which is
+ * also used as the value.
+ */
+static int read_corpus(corpus_t *c, const char *filename) {
+    FILE *in;
+    char line[LINELEN], w1[LINELEN], w2[LINELEN], w3[LINELEN];
+    int cap = 1024;
+
+    if ((in = fopen(filename, "r")) == NULL) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    c->keys = malloc(cap * sizeof(char *));
+    c->values = malloc(cap * sizeof(char *));
+    c->n = 0;
+    while (fgets(line, sizeof(line), in) != NULL) {
+        int n = sscanf(line, "%1023s %1023s %1023s", w1, w2, w3);
+        if (n < 1) continue;
+        char *key = w1, *value = w1;
+        if (n >= 2 && strlen(w1) == 1 && strchr("aqd", w1[0]) != NULL) {
+            key = w2;
+            value = n == 3 ? w3 : w2;
+        }
+        if (c->n == cap) {
+            cap *= 2;
+            c->keys = realloc(c->keys, cap * sizeof(char *));
+            c->values = realloc(c->values, cap * sizeof(char *));
+        }
+        c->keys[c->n] = strdup(key);
+        c->values[c->n] = strdup(value);
+        c->n++;
+    }
+    fclose(in);
+
+    if (c->n == 0) {
+        fprintf(stderr, "%s: no keys\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+static char **sort_keys;
+static int int_keys;  // -I: sort keys numerically, as the tree does
+
+static int cmp_index(const void *a, const void *b) {
+    char *x = sort_keys[*(const int *)a], *y = sort_keys[*(const int *)b];
+    if (int_keys) {
+        long long m = strtoll(x, 0, 10), n = strtoll(y, 0, 10);
+        return (m > n) - (m < n);
+    }
+    return strcmp(x, y);
+}
+
+static int *sorted_indices(corpus_t *c) {
+    int *idx = malloc(c->n * sizeof(int));
+    for (int i = 0; i < c->n; i++) idx[i] = i;
+    sort_keys = c->keys;
+    qsort(idx, c->n, sizeof(int), cmp_index);
+    return idx;
+}
+
+static int *shuffled_indices(int n, uint64_t seed) {
+    int *idx = malloc(n * sizeof(int));
+    for (int i = 0; i < n; i++) idx[i] = i;
+    for (int i = n - 1; i > 0; i--) {
+        int j = next_rand(&seed) % (i + 1);
+        int tmp = idx[i];
+        idx[i] = idx[j];
+        idx[j] = tmp;
+    }
+    return idx;
+}
+
+static void *add_phase(void *arg) {
+    bench_thread_t *t = (bench_thread_t *)arg;
+    pthread_barrier_wait(&start_barrier);
+    for (int i = t->id; i < load_corpus.n; i += t->num_threads) {
+        db_add(load_corpus.keys[i], load_corpus.values[i]);
+        t->ops++;
+    }
+    return NULL;
+}
+
+static void *query_phase(void *arg) {
+    bench_thread_t *t = (bench_thread_t *)arg;
+    char result[RESULT_LEN];
+    long n = query_ops / t->num_threads;
+    // each thread walks the sorted keys from its own starting point
+    long pos = (long)query_corpus.n * t->id / t->num_threads;
+
+    pthread_barrier_wait(&start_barrier);
+    for (long i = 0; i < n; i++) {
+        int k;
+        switch (t->pattern) {
+            case p_sorted:
+                k = sorted_queries[pos++ % query_corpus.n];
+                break;
+            case p_random:
+                k = next_rand(&t->rng) % query_corpus.n;
+                break;
+            default:
+                k = zipf_rank[zipf_next(&zipf, &t->rng)];
+                break;
+        }
+        db_query(query_corpus.keys[k], result, RESULT_LEN);
+        t->ops++;
+    }
+    return NULL;
+}
+
+static void *remove_phase(void *arg) {
+    bench_thread_t *t = (bench_thread_t *)arg;
+    // a skewed delete order would mostly hit missing keys, so zipf deletes
+    // in random order like p_random
+    int *order = t->pattern == p_sorted ? sorted_deletes : shuffled_deletes;
+
+    pthread_barrier_wait(&start_barrier);
+    for (int i = t->id; i < delete_corpus.n; i += t->num_threads) {
+        db_remove(delete_corpus.keys[order[i]]);
+        t->ops++;
+    }
+    return NULL;
+}
+
+/*
+ * Runs one phase on num_threads threads and returns its throughput in
+ * operations per second.
+ */
+static double run_phase(void *(*func)(void *), int num_threads,
+                        enum pattern pattern, long *ops) {
+    bench_thread_t *threads = calloc(num_threads, sizeof(bench_thread_t));
+    pthread_attr_t attr;
+    int err;
+
+    pthread_barrier_init(&start_barrier, 0, num_threads + 1);
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].id = i;
+        threads[i].num_threads = num_threads;
+        threads[i].pattern = pattern;
+        threads[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        affinity_attr_to(&attr, i);
+        err = pthread_create(&threads[i].thread, &attr, func, &threads[i]);
+        pthread_attr_destroy(&attr);
+        if (err != 0) {
+            errno = err;
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    *ops = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        *ops += threads[i].ops;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    pthread_barrier_destroy(&start_barrier);
+    free(threads);
+    return elapsed ? *ops * 1e9 / elapsed : 0;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void usage(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-t threads] [-p patterns] [-l corpus] [-q corpus] "
+            "[-d corpus] [-n query_ops] [-z theta] [-r repeat] [-T] [-V] "
+            "[-C entries] [-I] [-O] [-P partitions] [-a cpus] [-o outfile]\n"
+            "  -t  comma-separated thread counts (default 1,2,4,... up to "
+            "the number of cores)\n"
+            "  -p  comma-separated access patterns: sorted,random,zipf "
+            "(default all)\n"
+            "  -l  corpus to add (default scripts/adict.txt)\n"
+            "  -q  corpus to query (default the -l corpus)\n"
+            "  -d  corpus to delete (default the -l corpus)\n"
+            "  -n  total number of queries per run (default 200000)\n"
+            "  -z  zipf skew (default 0.99)\n"
+            "  -r  runs per configuration; the median is reported (default "
+            "1)\n"
+            "  -T  delete with tombstones, unlinked by the expiry thread\n"
+            "  -V  maintain the value index\n"
+            "  -C  cache this many query results per thread (see qcache.h)\n"
+            "  -I  use integer keys (see db_set_int_keys()); every key in the "
+            "corpora\n"
+            "      must be an integer\n"
+            "  -O  optimistic writers (see db_set_optimistic())\n"
+            "  -P  split the keys into this many partitions (see "
+            "db_set_partitions())\n"
+            "  -a  pin thread i to the i-th of these CPUs (e.g. 0-3,8-11) "
+            "and allocate\n"
+            "      nodes from per-NUMA-node arenas (see arena.h)\n"
+            "  -o  also write the results to this file\n",
+            cmd);
+}
+
+int main(int argc, char *argv[]) {
+    const char *load_file = "scripts/adict.txt";
+    const char *query_file = NULL, *delete_file = NULL, *outfile = NULL;
+    int thread_counts[MAX_THREAD_COUNTS], num_counts = 0;
+    int use_pattern[num_patterns] = {1, 1, 1};
+    double theta = 0.99;
+    int repeat = 1, opt;
+    int tombstones = 0;
+    int cache_entries = 0;
+    int optimistic = 0;
+    int partitions = 1;
+    const char *cpus = NULL;
+    char *tok, *save;
+
+    while ((opt = getopt(argc, argv, "t:p:l:q:d:n:z:r:TVC:IOP:a:o:")) != -1) {
+        switch (opt) {
+            case 't':
+                for (tok = strtok_r(optarg, ",", &save);
+                     tok != NULL && num_counts < MAX_THREAD_COUNTS;
+                     tok = strtok_r(NULL, ",", &save)) {
+                    if ((thread_counts[num_counts++] = atoi(tok)) < 1) {
+                        usage(argv[0]);
+                        return 1;
+                    }
+                }
+                break;
+            case 'p':
+                memset(use_pattern, 0, sizeof(use_pattern));
+                for (tok = strtok_r(optarg, ",", &save); tok != NULL;
+                     tok = strtok_r(NULL, ",", &save)) {
+                    int p;
+                    for (p = 0; p < num_patterns; p++) {
+                        if (strcmp(tok, pattern_names[p]) == 0) break;
+                    }
+                    if (p == num_patterns) {
+                        usage(argv[0]);
+                        return 1;
+                    }
+                    use_pattern[p] = 1;
+                }
+                break;
+            case 'l':
+                load_file = optarg;
+                break;
+            case 'q':
+                query_file = optarg;
+                break;
+            case 'd':
+                delete_file = optarg;
+                break;
+            case 'n':
+                query_ops = atol(optarg);
+                break;
+            case 'z':
+                theta = atof(optarg);
+                break;
+            case 'r':
+                repeat = atoi(optarg);
+                break;
+            case 'T':
+                tombstones = 1;
+                break;
+            case 'V':
+                vindex_enable();
+                break;
+            case 'C':
+                if ((cache_entries = atoi(optarg)) <= 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                qcache_enable(cache_entries);
+                break;
+            case 'I':
+                int_keys = 1;
+                db_set_int_keys(1);
+                break;
+            case 'O':
+                optimistic = 1;
+                db_set_optimistic(1);
+                break;
+            case 'P':
+                partitions = atoi(optarg);
+                if (db_set_partitions(partitions) != 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'a':
+                if (affinity_set(optarg) != 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                cpus = optarg;
+                db_set_arenas(1);
+                break;
+            case 'o':
+                outfile = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc || repeat < 1 || query_ops < 1 || theta <= 0 ||
+        theta >= 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (num_counts == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int t = 1; t < cores && num_counts < MAX_THREAD_COUNTS - 1;
+             t *= 2) {
+            thread_counts[num_counts++] = t;
+        }
+        thread_counts[num_counts++] = cores > 0 ? cores : 1;
+    }
+
+    if (read_corpus(&load_corpus, load_file) == -1) return 1;
+    if (query_file == NULL) {
+        query_corpus = load_corpus;
+    } else if (read_corpus(&query_corpus, query_file) == -1) {
+        return 1;
+    }
+    if (delete_file == NULL) {
+        delete_corpus = load_corpus;
+    } else if (read_corpus(&delete_corpus, delete_file) == -1) {
+        return 1;
+    }
+
+    sorted_queries = sorted_indices(&query_corpus);
+    sorted_deletes = sorted_indices(&delete_corpus);
+    shuffled_deletes = shuffled_indices(delete_corpus.n, 42);
+    // hot keys are spread over the key space rather than clustered
+    zipf_rank = shuffled_indices(query_corpus.n, 4242);
+    zipf_init(&zipf, query_corpus.n, theta);
+
+    FILE *out = NULL;
+    if (outfile != NULL && (out = fopen(outfile, "w")) == NULL) {
+        fprintf(stderr, "%s: %s\n", outfile, strerror(errno));
+        return 1;
+    }
+
+    char header[LINELEN];
+    snprintf(header, sizeof(header),
+             "# db_bench load=%s (%d keys) query=%s (%d keys) delete=%s "
+             "(%d keys) query_ops=%ld zipf_theta=%.2f repeat=%d "
+             "deletes=%s vindex=%s qcache=%d keys=%s writers=%s partitions=%d "
+             "cpus=%s\n"
+             "phase\tpattern\tthreads\tops\tops_per_sec\tspeedup\n",
+             load_file, load_corpus.n, query_file ? query_file : load_file,
+             query_corpus.n, delete_file ? delete_file : load_file,
+             delete_corpus.n, query_ops, theta, repeat,
+             tombstones ? "tombstone" : "unlink",
+             vindex_enabled() ? "on" : "off", cache_entries,
+             int_keys ? "int" : "string", optimistic ? "optimistic" : "locking",
+             partitions, cpus ? cpus : "any");
+    fputs(header, stdout);
+    if (out) fputs(header, out);
+
+    static const char *phase_names[] = {"add", "query", "remove"};
+    void *(*phases[])(void *) = {add_phase, query_phase, remove_phase};
+    double *samples = malloc(repeat * 3 * sizeof(double));
+
+    if (tombstones) {
+        db_set_tombstones(1);
+        ttl_start();
+    }
+    db_rebalance_start();
+    for (int p = 0; p < num_patterns; p++) {
+        if (!use_pattern[p]) continue;
+        double base[3] = {0, 0, 0};
+        for (int c = 0; c < num_counts; c++) {
+            long ops[3] = {0, 0, 0};
+            stats_t before, after;
+            stats_read(&before);
+            for (int r = 0; r < repeat; r++) {
+                for (int ph = 0; ph < 3; ph++) {
+                    samples[ph * repeat + r] =
+                        run_phase(phases[ph], thread_counts[c], p, &ops[ph]);
+                }
+                // the compaction done by the expiry thread and the
+                // rebalancing must not race with db_cleanup()
+                if (tombstones) ttl_stop();
+                db_rebalance_stop();
+                db_cleanup();
+                if (tombstones) ttl_start();
+                db_rebalance_start();
+            }
+            for (int ph = 0; ph < 3; ph++) {
+                qsort(&samples[ph * repeat], repeat, sizeof(double),
+                      cmp_double);
+                double rate = samples[ph * repeat + repeat / 2];
+                if (c == 0) base[ph] = rate;
+                char row[LINELEN];
+                snprintf(row, sizeof(row), "%s\t%s\t%d\t%ld\t%.0f\t%.2f\n",
+                         phase_names[ph], pattern_names[p], thread_counts[c],
+                         ops[ph], rate, base[ph] > 0 ? rate / base[ph] : 0);
+                fputs(row, stdout);
+                fflush(stdout);
+                if (out) fputs(row, out);
+            }
+            if (cache_entries > 0) {
+                char row[LINELEN];
+                stats_read(&after);
+                long hits = after.cache_hits - before.cache_hits;
+                long lookups = hits + after.cache_misses - before.cache_misses;
+                snprintf(row, sizeof(row), "# query cache hit rate %.1f%%\n",
+                         lookups > 0 ? 100.0 * hits / lookups : 0);
+                fputs(row, stdout);
+                if (out) fputs(row, out);
+            }
+        }
+    }
+
+    if (tombstones) ttl_stop();
+    db_rebalance_stop();
+    free(samples);
+    if (out) fclose(out);
+    return 0;
+}
@@ -0,0 +1,456 @@
+#define _GNU_SOURCE  // for ppoll()
+#include "./dbclient.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "./shmring.h"
+
+// Queued commands are written as soon as this many bytes have built up,
+// rather than waiting for the next poll.
+#define DBC_WRITE_BATCH (64 * 1024)
+
+// Space kept free in a connection's input buffer for each read.
+#define DBC_READ_SIZE (64 * 1024)
+
+// How long to sleep on the replies of a lone shared-memory connection before
+// checking that the server is still there (100ms), and how often to poll
+// shared-memory connections that are waited for along with others (100us).
+#define DBC_SHM_CHECK_NS 100000000LL
+#define DBC_SHM_SLICE_NS 100000LL
+
+typedef struct dbc_waiter {
+    dbc_callback_t cb;
+    void *arg;
+} dbc_waiter_t;
+
+struct dbc_conn {
+    char *host;
+    char *port;
+    int fd;              // -1 once the connection has failed
+    shm_channel_t *shm;  // for shm: addresses, carries the commands instead
+    char *out;           // commands not yet written, from out_off to out_len
+    size_t out_off, out_len, out_cap;
+    char *in;  // replies read and not yet handled
+    size_t in_len, in_cap;
+    dbc_waiter_t *waiters;  // circular queue of the commands in flight
+    size_t head, count, cap;
+};
+
+// Connects to the Unix socket at path. Returns the socket or -1.
+static int unix_socket(const char *path) {
+    struct sockaddr_un addr;
+    int sock;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: '%s'\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Failed to connect to '%s'!\n", path);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int dbc_socket(const char *host, const char *port) {
+    struct addrinfo hints;
+    struct addrinfo *result, *res;
+    int sock = -1, err;
+
+    if (strcmp(host, "unix") == 0 || strcmp(host, "shm") == 0) {
+        return unix_socket(port);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((err = getaddrinfo(host, port, &hints, &result)) != 0) {
+        fprintf(stderr, "Error in getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+    for (res = result; res != NULL; res = res->ai_next) {
+        if ((sock = socket(res->ai_family, res->ai_socktype,
+                           res->ai_protocol)) < 0) {
+            continue;
+        }
+        if (connect(sock, res->ai_addr, res->ai_addrlen) >= 0) break;
+        close(sock);
+    }
+    freeaddrinfo(result);
+
+    if (res == NULL) {
+        fprintf(stderr, "Failed to connect to '%s'!\n", host);
+        return -1;
+    }
+    return sock;
+}
+
+static int conn_open(dbc_conn_t *c) {
+    int one = 1;
+
+    if ((c->fd = dbc_socket(c->host, c->port)) == -1) return -1;
+    if (strcmp(c->host, "shm") == 0 && (c->shm = shm_offer(c->fd)) == NULL) {
+        fprintf(stderr, "Failed to set up shared memory with '%s'\n", c->port);
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    // commands are batched here, so Nagle's algorithm would only add delay
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    c->out_off = c->out_len = c->in_len = 0;
+    return 0;
+}
+
+/*
+ * Closes a connection that failed and fails every command in flight on it.
+ */
+static int conn_fail(dbc_pool_t *pool, dbc_conn_t *c) {
+    int n = 0;
+
+    close(c->fd);
+    c->fd = -1;
+    shm_close(c->shm, 1);
+    c->shm = NULL;
+    while (c->count > 0) {
+        dbc_waiter_t w = c->waiters[c->head];
+        c->head = (c->head + 1) % c->cap;
+        c->count--;
+        pool->pending--;
+        pool->failed++;
+        w.cb(w.arg, NULL, 0);
+        n++;
+    }
+    return n;
+}
+
+// Grows *buf so that it can hold need bytes. Returns -1 if out of memory.
+static int reserve(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return 0;
+    size_t ncap = *cap ? *cap : 4096;
+    while (ncap < need) ncap *= 2;
+    char *nbuf = realloc(*buf, ncap);
+    if (nbuf == NULL) return -1;
+    *buf = nbuf;
+    *cap = ncap;
+    return 0;
+}
+
+/*
+ * Writes as much of the queued output as the socket takes without blocking.
+ * Returns -1 if the connection failed.
+ */
+static int conn_write(dbc_conn_t *c) {
+    if (c->shm != NULL) {
+        c->out_off += shm_put(&c->shm->commands, c->out + c->out_off,
+                              c->out_len - c->out_off);
+        if (c->out_off == c->out_len) c->out_off = c->out_len = 0;
+        return 0;
+    }
+    while (c->out_off < c->out_len) {
+        // MSG_NOSIGNAL turns a closed connection into EPIPE, not SIGPIPE
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->out_off += n;
+    }
+    c->out_off = c->out_len = 0;
+    return 0;
+}
+
+/*
+ * Reads what has arrived on the socket and runs the callbacks of the complete
+ * replies. Returns the number of callbacks run, or -1 if the connection
+ * failed (the callbacks of the replies read before the failure have run).
+ */
+static int conn_read(dbc_pool_t *pool, dbc_conn_t *c) {
+    int n = 0;
+
+    while (1) {
+        if (reserve(&c->in, &c->in_cap, c->in_len + DBC_READ_SIZE) == -1) {
+            return -1;
+        }
+        ssize_t got;
+        if (c->shm != NULL) {
+            got = shm_get(&c->shm->replies, c->in + c->in_len,
+                          c->in_cap - c->in_len);
+            if (got == 0) return n;
+        } else {
+            got = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return n;
+            if (got <= 0) return -1;
+        }
+
+        char *start = c->in, *end = c->in + c->in_len + got, *nl;
+        // only the newly read bytes can hold the end of a reply
+        char *from = c->in + c->in_len;
+        while ((nl = memchr(from, '\n', end - from)) != NULL) {
+            if (c->count == 0) return -1;  // a reply to nothing
+            dbc_waiter_t w = c->waiters[c->head];
+            c->head = (c->head + 1) % c->cap;
+            c->count--;
+            pool->pending--;
+            *nl = '\0';
+            w.cb(w.arg, start, nl - start);
+            n++;
+            start = from = nl + 1;
+        }
+        c->in_len = end - start;
+        memmove(c->in, start, c->in_len);
+    }
+}
+
+// Frees a connection with no commands in flight.
+static void conn_free(dbc_conn_t *c) {
+    if (c == NULL) return;
+    if (c->fd != -1) close(c->fd);
+    shm_close(c->shm, 1);
+    free(c->host);
+    free(c->port);
+    free(c->out);
+    free(c->in);
+    free(c->waiters);
+    free(c);
+}
+
+// Adds conns_per_server connections to host:port to the pool.
+static int pool_connect(dbc_pool_t *pool, const char *host, const char *port) {
+    int per = pool->conns_per_server;
+    int num_conns = (pool->num_servers + 1) * per;
+    dbc_conn_t **conns = realloc(pool->conns, num_conns * sizeof(dbc_conn_t *));
+    int *next = realloc(pool->next, (pool->num_servers + 1) * sizeof(int));
+    struct pollfd *fds = realloc(pool->fds, num_conns * sizeof(struct pollfd));
+
+    if (conns != NULL) pool->conns = conns;
+    if (next != NULL) pool->next = next;
+    if (fds != NULL) pool->fds = fds;
+    if (conns == NULL || next == NULL || fds == NULL) return -1;
+    pool->next[pool->num_servers] = 0;
+    for (int i = num_conns - per; i < num_conns; i++) {
+        dbc_conn_t *c = calloc(1, sizeof(dbc_conn_t));
+        if ((pool->conns[i] = c) != NULL) {
+            c->fd = -1;
+            c->host = strdup(host);
+            c->port = strdup(port);
+        }
+        if (c == NULL || c->host == NULL || c->port == NULL ||
+            conn_open(c) == -1) {
+            // undo the connections made so far to this server
+            for (int j = num_conns - per; j <= i; j++)
+                conn_free(pool->conns[j]);
+            return -1;
+        }
+    }
+    return pool->num_servers++;
+}
+
+int dbc_pool_init(dbc_pool_t *pool, const char *servers, int conns_per_server) {
+    memset(pool, 0, sizeof(*pool));
+    if (conns_per_server < 1) return -1;
+    if (shard_ring_init(&pool->ring, servers, SHARD_VNODES) == -1) return -1;
+
+    pool->conns_per_server = conns_per_server;
+    for (int s = 0; s < pool->ring.num_shards; s++) {
+        if (pool_connect(pool, pool->ring.hosts[s], pool->ring.ports[s]) ==
+            -1) {
+            dbc_pool_destroy(pool);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int dbc_pool_add(dbc_pool_t *pool, const char *host, const char *port) {
+    return pool_connect(pool, host, port);
+}
+
+void dbc_pool_destroy(dbc_pool_t *pool) {
+    for (int i = 0; i < pool->num_servers * pool->conns_per_server; i++) {
+        dbc_conn_t *c = pool->conns[i];
+        if (c->fd != -1) conn_fail(pool, c);
+        conn_free(c);
+    }
+    free(pool->conns);
+    free(pool->next);
+    free(pool->fds);
+    shard_ring_destroy(&pool->ring);
+    memset(pool, 0, sizeof(*pool));
+}
+
+static int conn_send(dbc_pool_t *pool, dbc_conn_t *c, const char *cmd,
+                     dbc_callback_t cb, void *arg) {
+    size_t len = strlen(cmd);
+
+    if (c->fd == -1 && conn_open(c) == -1) return -1;
+    if (c->count == c->cap) {
+        size_t ncap = c->cap ? c->cap * 2 : 64;
+        dbc_waiter_t *w = malloc(ncap * sizeof(dbc_waiter_t));
+        if (w == NULL) return -1;
+        for (size_t i = 0; i < c->count; i++) {
+            w[i] = c->waiters[(c->head + i) % c->cap];
+        }
+        free(c->waiters);
+        c->waiters = w;
+        c->head = 0;
+        c->cap = ncap;
+    }
+    if (reserve(&c->out, &c->out_cap, c->out_len + len + 1) == -1) return -1;
+    memcpy(c->out + c->out_len, cmd, len);
+    c->out[c->out_len + len] = '\n';
+    c->out_len += len + 1;
+    c->waiters[(c->head + c->count) % c->cap] = (dbc_waiter_t){cb, arg};
+    c->count++;
+    pool->pending++;
+
+    // a failure shows up again, and is handled, at the next poll
+    if (c->out_len - c->out_off >= DBC_WRITE_BATCH) conn_write(c);
+    return 0;
+}
+
+int dbc_send(dbc_pool_t *pool, const char *key, const char *cmd,
+             dbc_callback_t cb, void *arg) {
+    if (key == NULL) return dbc_send_to(pool, 0, cmd, cb, arg);
+
+    // the key picks the connection as well as the shard, which keeps the
+    // commands on a key in order
+    int per = pool->conns_per_server;
+    uint64_t h = shard_hash(key, strlen(key));
+    int shard = shard_for_key(&pool->ring, key);
+    return conn_send(pool, pool->conns[shard * per + h % per], cmd, cb, arg);
+}
+
+int dbc_send_to(dbc_pool_t *pool, int server, const char *cmd,
+                dbc_callback_t cb, void *arg) {
+    int per = pool->conns_per_server;
+    int i = pool->next[server]++ % per;
+    return conn_send(pool, pool->conns[server * per + i], cmd, cb, arg);
+}
+
+int dbc_poll(dbc_pool_t *pool, long long timeout_ns) {
+    int num_conns = pool->num_servers * pool->conns_per_server;
+    int nfds = 0, n = 0, num_shm = 0;
+    dbc_conn_t *shm = NULL;
+
+    // most writes go through at once, so try them before waiting
+    for (int i = 0; i < num_conns; i++) {
+        dbc_conn_t *c = pool->conns[i];
+        if (c->fd == -1) continue;
+        if (conn_write(c) == -1) {
+            n += conn_fail(pool, c);
+            continue;
+        }
+        if (c->count == 0 && c->out_len == 0) continue;
+        if (c->shm != NULL) {
+            // replies may be there already, which spares the wait
+            int got = conn_read(pool, c);
+            if (got == -1) {
+                n += conn_fail(pool, c);
+                continue;
+            }
+            n += got;
+            if (c->count == 0) continue;
+            shm = c;
+            num_shm++;
+        }
+        pool->fds[nfds].fd = c->fd;
+        pool->fds[nfds].events =
+            POLLIN | (c->shm == NULL && c->out_len > 0 ? POLLOUT : 0);
+        pool->fds[nfds].revents = 0;
+        nfds++;
+    }
+    if (nfds == 0 || (num_shm > 0 && n > 0)) return n;
+
+    // a lone shared-memory connection is waited for on its ring, and others
+    // are polled for along with the sockets
+    if (num_shm == 1 && nfds == 1) {
+        long long wait = timeout_ns < 0 || timeout_ns > DBC_SHM_CHECK_NS
+                             ? DBC_SHM_CHECK_NS
+                             : timeout_ns;
+        int got = shm_wait_readable(&shm->shm->replies, wait) ||
+                          !shm_peer_gone(shm->fd)
+                      ? conn_read(pool, shm)
+                      : -1;
+        return n + (got == -1 ? conn_fail(pool, shm) : got);
+    }
+    if (num_shm > 0 && (timeout_ns < 0 || timeout_ns > DBC_SHM_SLICE_NS)) {
+        timeout_ns = DBC_SHM_SLICE_NS;
+    }
+
+    struct timespec ts = {timeout_ns / 1000000000LL, timeout_ns % 1000000000LL};
+    int ready = ppoll(pool->fds, nfds, timeout_ns < 0 ? NULL : &ts, NULL);
+    if (ready < 0) return errno == EINTR ? n : -1;
+
+    for (int i = 0, f = 0; i < num_conns && f < nfds; i++) {
+        dbc_conn_t *c = pool->conns[i];
+        if (c->fd != pool->fds[f].fd) continue;
+        short revents = pool->fds[f++].revents;
+        int got = 0;
+        if (c->shm != NULL) {
+            // the server never writes to the socket of a channel, so any
+            // event on it means that the server is gone
+            got = revents != 0 ? -1 : conn_read(pool, c);
+        } else {
+            if (revents == 0) continue;
+            if ((revents & POLLOUT) && conn_write(c) == -1) got = -1;
+            if (got == 0 && (revents & (POLLIN | POLLERR | POLLHUP))) {
+                got = conn_read(pool, c);
+            }
+        }
+        if (got == -1) {
+            n += conn_fail(pool, c);
+        } else {
+            n += got;
+        }
+    }
+    return n;
+}
+
+int dbc_wait(dbc_pool_t *pool) {
+    long failed = pool->failed;
+
+    while (pool->pending > 0) {
+        if (dbc_poll(pool, -1) == -1) return -1;
+    }
+    return pool->failed == failed ? 0 : -1;
+}
+
+typedef struct call_result {
+    char *reply;
+    int done;
+} call_result_t;
+
+static void call_done(void *arg, const char *reply, size_t len) {
+    call_result_t *res = (call_result_t *)arg;
+    res->reply = reply != NULL ? strndup(reply, len) : NULL;
+    res->done = 1;
+}
+
+char *dbc_call(dbc_pool_t *pool, const char *key, const char *cmd) {
+    call_result_t res = {NULL, 0};
+
+    if (dbc_send(pool, key, cmd, call_done, &res) == -1) return NULL;
+    while (!res.done) {
+        if (dbc_poll(pool, -1) == -1) return NULL;
+    }
+    return res.reply;
+}
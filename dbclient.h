@@ -0,0 +1,116 @@
+#ifndef DBCLIENT_H_
+#define DBCLIENT_H_
+
+#include <poll.h>
+#include <stddef.h>
+#include "./shard.h"
+
+/*
+ * Client library for the database server (libdbclient.a).
+ *
+ * A pool holds a few connections to each of one or more servers. With more
+ * than one server the keyspace is sharded over them by consistent hashing
+ * (see shard.h), and every command is routed by the key it names. Servers
+ * outside the ring, such as replicas, can be added and addressed directly.
+ *
+ * Commands are asynchronous: dbc_send() queues one and returns at once, and
+ * its callback runs from a later dbc_poll() or dbc_wait() once the reply has
+ * arrived. Each connection pipelines its commands, keeping any number of them
+ * in flight, and commands queued between two polls go out in a single write.
+ * Since the server answers the commands of a connection in order, replies are
+ * matched to callbacks by position. Commands on the same key always use the
+ * same connection, so they are applied in the order they were sent.
+ *
+ * A server on the same host can also be reached at "unix:path", over its Unix
+ * socket at path, or at "shm:path", which connects the same way and then
+ * moves the commands to a shared-memory channel (see shmring.h); such a
+ * connection is waited for without system calls while replies keep coming.
+ *
+ * A connection that fails is reopened by the next command sent over it. A
+ * pool is not thread-safe, so give each thread its own pool. Callbacks may
+ * send further commands but must not poll.
+ */
+
+/*
+ * Called with the reply to a command, without its newline. The reply is only
+ * valid during the call. If the connection failed before the reply arrived,
+ * reply is NULL and len is 0.
+ */
+typedef void (*dbc_callback_t)(void *arg, const char *reply, size_t len);
+
+typedef struct dbc_conn dbc_conn_t;
+
+typedef struct dbc_pool {
+    shard_ring_t ring;  // keys are routed over the first ring.num_shards
+    int num_servers;    // servers, then over none of those added later
+    int conns_per_server;
+    dbc_conn_t **conns;  // conns_per_server per server, server by server
+    int *next;           // connection of each server to use next
+    struct pollfd *fds;
+    long pending;  // commands sent and not yet answered
+    long failed;   // commands whose connection failed, over the pool's life
+} dbc_pool_t;
+
+/*
+ * Connects to every server in the comma-separated host:port list servers,
+ * with conns_per_server connections to each, and shards the keys over them.
+ * Returns 0 on success or -1 if the list is malformed or a connection fails.
+ */
+int dbc_pool_init(dbc_pool_t *pool, const char *servers, int conns_per_server);
+
+/*
+ * Connects to one more server, which takes no part in routing keys. Returns
+ * its index for dbc_send_to(), or -1 if a connection fails.
+ */
+int dbc_pool_add(dbc_pool_t *pool, const char *host, const char *port);
+
+/*
+ * Closes the pool's connections, failing the commands still pending.
+ */
+void dbc_pool_destroy(dbc_pool_t *pool);
+
+/*
+ * Queues cmd, a single command line without its newline, for the server
+ * owning key, and arranges for cb(arg, ...) to receive the reply. key may be
+ * NULL for commands that name no key, which go to the first server. Returns 0
+ * on success or -1 if the connection has failed, in which case cb is not
+ * called.
+ */
+int dbc_send(dbc_pool_t *pool, const char *key, const char *cmd,
+             dbc_callback_t cb, void *arg);
+
+/*
+ * Like dbc_send(), but to the given server of the pool rather than to the
+ * owner of a key. The servers are numbered in the order they were listed,
+ * so shard s of the ring is server s, followed by those added later.
+ */
+int dbc_send_to(dbc_pool_t *pool, int server, const char *cmd,
+                dbc_callback_t cb, void *arg);
+
+/*
+ * Writes queued commands and runs the callbacks of the replies that arrive,
+ * waiting up to timeout_ns nanoseconds for the first (forever if negative).
+ * Returns the number of callbacks run, including those of failed commands.
+ */
+int dbc_poll(dbc_pool_t *pool, long long timeout_ns);
+
+/*
+ * Polls until every command sent has been answered or has failed. Returns 0
+ * if all of them were answered or -1 if a connection failed.
+ */
+int dbc_wait(dbc_pool_t *pool);
+
+/*
+ * Sends cmd like dbc_send() and waits for the reply, which is returned as a
+ * malloc()ed string, or NULL if the connection failed. Replies to other
+ * commands that arrive meanwhile are handled as usual.
+ */
+char *dbc_call(dbc_pool_t *pool, const char *key, const char *cmd);
+
+/*
+ * Opens a blocking TCP connection to host:port, or one to the Unix socket at
+ * port if host is unix or shm. Returns the socket or -1.
+ */
+int dbc_socket(const char *host, const char *port);
+
+#endif  // DBCLIENT_H_
@@ -0,0 +1,158 @@
+#include "./ebr.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include "./comm.h"
+
+// Retires between attempts to advance the global epoch.
+#define EBR_ADVANCE_EVERY 64
+
+typedef struct ebr_item {
+    struct ebr_item *next;
+    void *ptr;
+    void (*free_fn)(void *);
+} ebr_item_t;
+
+/*
+ * State of one thread. Items retired in epoch e go to limbo[e % 3], which is
+ * freed when the global epoch reaches e + 2 or, lazily, when the bucket is
+ * next used for a later epoch. Records are never freed, so that
+ * try_advance() can walk the list without locking.
+ */
+typedef struct ebr_thread {
+    unsigned long active;  // (epoch << 1) | 1 while in a section, else 0
+    ebr_item_t *limbo[3];
+    unsigned long limbo_epoch[3];
+    int retired;  // since the last attempt to advance
+    int in_use;
+    struct ebr_thread *next;
+} ebr_thread_t;
+
+static unsigned long global_epoch;
+static ebr_thread_t *threads;
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static __thread ebr_thread_t *self;
+
+// pthread_key_t destructor: hands the record of an exiting thread over,
+// retired items included.
+static void release_thread(void *t) {
+    __atomic_store_n(&((ebr_thread_t *)t)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_thread_key(void) {
+    int err;
+    if ((err = pthread_key_create(&thread_key, release_thread)) != 0) {
+        handle_error_en(err, "pthread_key_create");
+    }
+}
+
+static ebr_thread_t *get_thread(void) {
+    ebr_thread_t *t;
+    int err;
+
+    if (self != NULL) return self;
+    pthread_once(&thread_key_once, make_thread_key);
+    if ((err = pthread_mutex_lock(&threads_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    for (t = threads; t != NULL; t = t->next) {
+        if (!__atomic_load_n(&t->in_use, __ATOMIC_ACQUIRE)) break;
+    }
+    if (t == NULL) {
+        if ((t = calloc(1, sizeof(ebr_thread_t))) == NULL) {
+            handle_error_en(ENOMEM, "calloc");
+        }
+        t->next = threads;
+        __atomic_store_n(&threads, t, __ATOMIC_RELEASE);
+    }
+    t->in_use = 1;
+    if ((err = pthread_mutex_unlock(&threads_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    if ((err = pthread_setspecific(thread_key, t)) != 0) {
+        handle_error_en(err, "pthread_setspecific");
+    }
+    return self = t;
+}
+
+static void free_items(ebr_item_t *item) {
+    while (item != NULL) {
+        ebr_item_t *next = item->next;
+        item->free_fn(item->ptr);
+        free(item);
+        item = next;
+    }
+}
+
+// Frees the buckets of t that were retired at least two epochs before epoch.
+static void reclaim(ebr_thread_t *t, unsigned long epoch) {
+    for (int b = 0; b < 3; b++) {
+        if (t->limbo[b] != NULL && t->limbo_epoch[b] + 2 <= epoch) {
+            free_items(t->limbo[b]);
+            t->limbo[b] = NULL;
+        }
+    }
+}
+
+// Advances the global epoch if every thread in a section has seen it.
+static void try_advance(void) {
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    for (ebr_thread_t *t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+         t != NULL; t = t->next) {
+        unsigned long active = __atomic_load_n(&t->active, __ATOMIC_ACQUIRE);
+        if ((active & 1) && (active >> 1) != epoch) return;
+    }
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+void ebr_enter(void) {
+    ebr_thread_t *t = get_thread();
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&t->active, (epoch << 1) | 1, __ATOMIC_RELAXED);
+    // the announcement must be visible before any shared memory is read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void ebr_exit(void) { __atomic_store_n(&self->active, 0, __ATOMIC_RELEASE); }
+
+void ebr_retire(void *ptr, void (*free_fn)(void *)) {
+    ebr_thread_t *t = get_thread();
+    ebr_item_t *item = malloc(sizeof(ebr_item_t));
+    unsigned long epoch;
+    int b;
+
+    if (item == NULL) return;
+    item->ptr = ptr;
+    item->free_fn = free_fn;
+    if (++t->retired >= EBR_ADVANCE_EVERY) {
+        t->retired = 0;
+        try_advance();
+    }
+    // the caller made ptr unreachable before this read of the epoch
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    reclaim(t, epoch);
+    b = epoch % 3;
+    if (t->limbo[b] != NULL && t->limbo_epoch[b] != epoch) {
+        // left over from an epoch at least three behind
+        free_items(t->limbo[b]);
+        t->limbo[b] = NULL;
+    }
+    item->next = t->limbo[b];
+    t->limbo[b] = item;
+    t->limbo_epoch[b] = epoch;
+}
+
+void ebr_flush(void) {
+    for (ebr_thread_t *t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE);
+         t != NULL; t = t->next) {
+        for (int b = 0; b < 3; b++) {
+            free_items(t->limbo[b]);
+            t->limbo[b] = NULL;
+        }
+    }
+}
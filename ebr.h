@@ -0,0 +1,41 @@
+#ifndef EBR_H_
+#define EBR_H_
+
+/*
+ * Epoch-based reclamation, for memory that threads may read without holding
+ * a lock (see the optimistic writers in db.c). Such reads are done between
+ * ebr_enter() and ebr_exit(), and memory that has been made unreachable is
+ * handed to ebr_retire() rather than freed. It is freed once every thread
+ * that was between ebr_enter() and ebr_exit() at the time has left, which is
+ * detected by a global epoch that can only advance when no thread is still
+ * in an older one.
+ *
+ * Retired memory is kept in per-thread lists and freed lazily by the same
+ * thread's later calls to ebr_retire(); the lists of an exiting thread are
+ * handed to the next new thread.
+ */
+
+/*
+ * Starts a section in which the calling thread may read retired memory.
+ * Sections don't nest.
+ */
+void ebr_enter(void);
+
+/*
+ * Ends the section started by ebr_enter().
+ */
+void ebr_exit(void);
+
+/*
+ * Arranges for free_fn(ptr) to be called once no thread can still be reading
+ * ptr. If memory runs out, ptr is never freed.
+ */
+void ebr_retire(void *ptr, void (*free_fn)(void *));
+
+/*
+ * Frees everything retired so far. Only safe when no other thread is using
+ * the memory in question, as when the database is cleaned up.
+ */
+void ebr_flush(void);
+
+#endif  // EBR_H_
@@ -0,0 +1,217 @@
+#include "./lockstat.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "./comm.h"
+#include "./slowlog.h"
+
+typedef struct lockstat_bucket {
+    unsigned long acquired;
+    unsigned long contended;
+    unsigned long long wait_ns;
+    unsigned long long wait_max_ns;
+    unsigned long long hold_ns;
+    unsigned long long hold_max_ns;
+} lockstat_bucket_t;
+
+// One entry per lock currently held by a thread, so that the hold time can be
+// computed on release. Locks are released roughly in LIFO order, so the
+// search from the top of the stack is short.
+typedef struct held_lock {
+    pthread_rwlock_t *lock;
+    unsigned long long acquired_ns;
+    int depth;
+    int write;
+} held_lock_t;
+
+static lockstat_bucket_t buckets[LOCKSTAT_DEPTHS][2];
+static unsigned long long reset_ns;
+
+static __thread held_lock_t *held;
+static __thread int num_held;
+static __thread int held_capacity;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void update_max(unsigned long long *max, unsigned long long val) {
+    unsigned long long cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (val > cur &&
+           !__atomic_compare_exchange_n(max, &cur, val, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+}
+
+void lockstat_lock(pthread_rwlock_t *lock, int write, int depth) {
+    unsigned long long start, wait = 0;
+    int err;
+
+    if (depth >= LOCKSTAT_DEPTHS) depth = LOCKSTAT_DEPTHS - 1;
+    lockstat_bucket_t *b = &buckets[depth][write != 0];
+
+    err =
+        write ? pthread_rwlock_trywrlock(lock) : pthread_rwlock_tryrdlock(lock);
+    start = now_ns();
+    if (err == EBUSY) {
+        long long slow_start = slowlog_wait_begin();
+        err = write ? pthread_rwlock_wrlock(lock) : pthread_rwlock_rdlock(lock);
+        slowlog_wait_end(slow_start);
+        unsigned long long end = now_ns();
+        wait = end - start;
+        start = end;
+        __atomic_fetch_add(&b->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&b->wait_ns, wait, __ATOMIC_RELAXED);
+        update_max(&b->wait_max_ns, wait);
+    }
+    if (err != 0) {
+        handle_error_en(
+            err, write ? "pthread_rwlock_wrlock" : "pthread_rwlock_rdlock");
+    }
+    __atomic_fetch_add(&b->acquired, 1, __ATOMIC_RELAXED);
+
+    if (num_held == held_capacity) {
+        held_capacity = held_capacity ? held_capacity * 2 : 16;
+        held = realloc(held, held_capacity * sizeof(held_lock_t));
+        if (held == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    held[num_held].lock = lock;
+    held[num_held].acquired_ns = start;
+    held[num_held].depth = depth;
+    held[num_held].write = write != 0;
+    num_held++;
+}
+
+void lockstat_unlock(pthread_rwlock_t *lock) {
+    unsigned long long end = now_ns();
+    int i;
+
+    for (i = num_held - 1; i >= 0; i--) {
+        if (held[i].lock == lock) break;
+    }
+
+    int err;
+    if ((err = pthread_rwlock_unlock(lock)) != 0) {
+        handle_error_en(err, "pthread_rwlock_unlock");
+    }
+
+    if (i < 0) return;  // not taken through lockstat_lock()
+
+    unsigned long long hold = end - held[i].acquired_ns;
+    lockstat_bucket_t *b = &buckets[held[i].depth][held[i].write];
+    __atomic_fetch_add(&b->hold_ns, hold, __ATOMIC_RELAXED);
+    update_max(&b->hold_max_ns, hold);
+
+    memmove(&held[i], &held[i + 1], (num_held - i - 1) * sizeof(held_lock_t));
+    num_held--;
+}
+
+#ifdef DB_LOCKSTAT
+static void print_row(FILE *out, const char *depth, const char *mode,
+                      lockstat_bucket_t *b) {
+    double cont_pct = b->acquired ? 100.0 * b->contended / b->acquired : 0;
+    double wait_avg = b->contended ? b->wait_ns / 1e3 / b->contended : 0;
+    double hold_avg = b->acquired ? b->hold_ns / 1e3 / b->acquired : 0;
+
+    fprintf(out,
+            "%5s %5s %12lu %10lu %6.2f %14.3f %11.2f %11.2f %11.2f %11.2f\n",
+            depth, mode, b->acquired, b->contended, cont_pct, b->wait_ns / 1e6,
+            wait_avg, b->wait_max_ns / 1e3, hold_avg, b->hold_max_ns / 1e3);
+}
+#endif
+
+int lockstat_print(char *filename) {
+    FILE *out = stdout;
+
+    if (filename != NULL) {
+        while (isspace(*filename)) filename++;
+        if (*filename != '\0' && (out = fopen(filename, "w+")) == NULL) {
+            return -1;
+        }
+    }
+
+#ifndef DB_LOCKSTAT
+    fprintf(out,
+            "lock statistics are not compiled in; rebuild with "
+            "`make clean && make LOCKSTAT=1`\n");
+#else
+    lockstat_bucket_t total[2];
+    memset(total, 0, sizeof(total));
+
+    fprintf(out,
+            "lock statistics over %.3f s (times in us, wait_total in ms)\n",
+            (now_ns() - __atomic_load_n(&reset_ns, __ATOMIC_RELAXED)) / 1e9);
+    fprintf(out, "%5s %5s %12s %10s %6s %14s %11s %11s %11s %11s\n", "depth",
+            "mode", "acquired", "contended", "cont%", "wait_total", "wait_avg",
+            "wait_max", "hold_avg", "hold_max");
+
+    for (int d = 0; d < LOCKSTAT_DEPTHS; d++) {
+        for (int w = 0; w < 2; w++) {
+            lockstat_bucket_t b;
+            b.acquired =
+                __atomic_load_n(&buckets[d][w].acquired, __ATOMIC_RELAXED);
+            if (b.acquired == 0) continue;
+            b.contended =
+                __atomic_load_n(&buckets[d][w].contended, __ATOMIC_RELAXED);
+            b.wait_ns =
+                __atomic_load_n(&buckets[d][w].wait_ns, __ATOMIC_RELAXED);
+            b.wait_max_ns =
+                __atomic_load_n(&buckets[d][w].wait_max_ns, __ATOMIC_RELAXED);
+            b.hold_ns =
+                __atomic_load_n(&buckets[d][w].hold_ns, __ATOMIC_RELAXED);
+            b.hold_max_ns =
+                __atomic_load_n(&buckets[d][w].hold_max_ns, __ATOMIC_RELAXED);
+
+            char depth[16];
+            snprintf(depth, sizeof(depth),
+                     d == LOCKSTAT_DEPTHS - 1 ? "%d+" : "%d", d);
+            print_row(out, depth, w ? "write" : "read", &b);
+
+            total[w].acquired += b.acquired;
+            total[w].contended += b.contended;
+            total[w].wait_ns += b.wait_ns;
+            total[w].hold_ns += b.hold_ns;
+            if (b.wait_max_ns > total[w].wait_max_ns)
+                total[w].wait_max_ns = b.wait_max_ns;
+            if (b.hold_max_ns > total[w].hold_max_ns)
+                total[w].hold_max_ns = b.hold_max_ns;
+        }
+    }
+    print_row(out, "all", "read", &total[0]);
+    print_row(out, "all", "write", &total[1]);
+#endif
+
+    if (out != stdout) {
+        fclose(out);
+    } else {
+        fflush(out);
+    }
+    return 0;
+}
+
+void lockstat_reset(void) {
+    for (int d = 0; d < LOCKSTAT_DEPTHS; d++) {
+        for (int w = 0; w < 2; w++) {
+            lockstat_bucket_t *b = &buckets[d][w];
+            __atomic_store_n(&b->acquired, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&b->contended, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&b->wait_ns, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&b->wait_max_ns, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&b->hold_ns, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&b->hold_max_ns, 0, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&reset_ns, now_ns(), __ATOMIC_RELAXED);
+}
+
+__attribute__((constructor)) static void lockstat_init(void) {
+    reset_ns = now_ns();
+}
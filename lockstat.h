@@ -0,0 +1,46 @@
+#ifndef LOCKSTAT_H_
+#define LOCKSTAT_H_
+
+#include <pthread.h>
+
+/*
+ * Optional profiler for the per-node reader/writer locks in db.c. It is only
+ * wired into the lock helpers when the server is built with LOCKSTAT=1
+ * (which defines DB_LOCKSTAT); otherwise the locks are taken directly and none
+ * of this code runs.
+ *
+ * Acquisitions are aggregated by the depth of the node in the tree (the root
+ * is depth 0) and by lock mode. For each bucket we keep the number of
+ * acquisitions, how many of those had to block, the total and maximum time
+ * spent blocked, and the total and maximum time the lock was held.
+ */
+
+// Depths at or beyond this are folded into the last bucket.
+#define LOCKSTAT_DEPTHS 32
+
+/*
+ * Acquires lock (for writing if write is nonzero, otherwise for reading) and
+ * records the acquisition against the given depth. A try-lock is attempted
+ * first so that the wait time is only measured when the lock is contended.
+ */
+void lockstat_lock(pthread_rwlock_t *lock, int write, int depth);
+
+/*
+ * Releases a lock previously acquired by the calling thread through
+ * lockstat_lock() and records how long it was held.
+ */
+void lockstat_unlock(pthread_rwlock_t *lock);
+
+/*
+ * Writes a per-depth, per-mode report to the given file, or to stdout if
+ * filename is NULL or empty. Returns 0 on success or -1 if the file cannot be
+ * opened.
+ */
+int lockstat_print(char *filename);
+
+/*
+ * Clears all counters collected so far.
+ */
+void lockstat_reset(void);
+
+#endif  // LOCKSTAT_H_
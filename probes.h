@@ -0,0 +1,52 @@
+#ifndef PROBES_H_
+#define PROBES_H_
+
+/*
+ * USDT (user-level statically defined tracing) probes for perf and bpftrace,
+ * all under the provider "db". A probe is a single nop until a tracer
+ * attaches to it, so they are always compiled in when <sys/sdt.h> (from
+ * systemtap-sdt-dev) is installed; without it, or with `make USDT=0` (which
+ * defines DB_NO_USDT), they compile to nothing. `bpftrace -l
+ * 'usdt:./server:db:*'` lists them; the .bt scripts in scripts/ use them.
+ *
+ *   command_start(command)            interpret_command() starts on command
+ *   command_end(command, response)    and is done; response is empty if the
+ *                                     reply is a blob
+ *   lock_acquire(node, depth, write)  a thread is about to lock node (at
+ *                                     depth in the tree, for writing if
+ *                                     write is 1)
+ *   lock_acquired(node, depth, write) and holds the lock
+ *   lock_release(node)                a thread unlocks node
+ *   node_alloc(node)                  a node has been allocated
+ *   node_free(node)                   and freed
+ *   conn_accept(fd)                   a client has connected on socket fd
+ *   conn_close(fd)                    its connection is being closed
+ *
+ * Strings are char pointers (read them with str() in bpftrace) and nodes are
+ * node_t pointers.
+ */
+
+#if !defined(DB_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define DB_USDT
+#endif
+#endif
+
+#ifdef DB_USDT
+#define PROBE1(name, a) DTRACE_PROBE1(db, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(db, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(db, name, a, b, c)
+#else
+#define PROBE1(name, a) \
+    do {                \
+    } while (0)
+#define PROBE2(name, a, b) \
+    do {                   \
+    } while (0)
+#define PROBE3(name, a, b, c) \
+    do {                      \
+    } while (0)
+#endif
+
+#endif  // PROBES_H_
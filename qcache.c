@@ -0,0 +1,140 @@
+#include "./qcache.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./comm.h"
+#include "./stats.h"
+#include "./ttl.h"
+
+// A cached result. buf holds the name and the value, each NUL-terminated.
+typedef struct qentry {
+    uint64_t hash;
+    unsigned long version;
+    long long expires;
+    char *buf;  // NULL if the entry is empty
+    size_t cap;
+    int recent;  // set on the more recently used entry of its pair
+} qentry_t;
+
+static int enabled;
+static int num_entries;  // a power of two, at least 2
+static unsigned long versions[QCACHE_STRIPES];
+static pthread_key_t table_key;
+static __thread qentry_t *table;
+
+static uint64_t hash_name(const char *name) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    }
+    return h ^ (h >> 29);
+}
+
+static inline unsigned long *version_of(uint64_t hash) {
+    return &versions[hash % QCACHE_STRIPES];
+}
+
+// Entries are 2-way set associative: a key may be cached in either entry of
+// the pair this returns, and the less recently used one is replaced.
+static inline qentry_t *pair_of(uint64_t hash) {
+    return &table[(hash / QCACHE_STRIPES) & (num_entries - 2)];
+}
+
+static inline void mark_recent(qentry_t *pair, int i) {
+    pair[i].recent = 1;
+    pair[1 - i].recent = 0;
+}
+
+// pthread_key_t destructor: frees the table of an exiting thread.
+static void free_table(void *t) {
+    qentry_t *entries = (qentry_t *)t;
+    for (int i = 0; i < num_entries; i++) free(entries[i].buf);
+    free(entries);
+}
+
+void qcache_enable(int entries) {
+    int err;
+    num_entries = 2;
+    while (num_entries < entries) num_entries <<= 1;
+    if ((err = pthread_key_create(&table_key, free_table)) != 0) {
+        handle_error_en(err, "pthread_key_create");
+    }
+    enabled = 1;
+}
+
+int qcache_enabled(void) { return enabled; }
+
+unsigned long qcache_version(const char *name) {
+    return __atomic_load_n(version_of(hash_name(name)), __ATOMIC_ACQUIRE);
+}
+
+int qcache_get(const char *name, char *result, int len) {
+    uint64_t hash = hash_name(name);
+    qentry_t *pair;
+
+    if (table != NULL) {
+        pair = pair_of(hash);
+        for (int i = 0; i < 2; i++) {
+            qentry_t *e = &pair[i];
+            if (e->buf == NULL || e->hash != hash ||
+                strcmp(e->buf, name) != 0) {
+                continue;
+            }
+            if (__atomic_load_n(version_of(hash), __ATOMIC_ACQUIRE) !=
+                    e->version ||
+                (e->expires != 0 && e->expires <= ttl_now_ms())) {
+                break;
+            }
+            snprintf(result, len, "%s", e->buf + strlen(e->buf) + 1);
+            mark_recent(pair, i);
+            stats_cache_lookup(1);
+            return 1;
+        }
+    }
+    stats_cache_lookup(0);
+    return 0;
+}
+
+void qcache_put(const char *name, const char *value, long long expires,
+                unsigned long version) {
+    uint64_t hash = hash_name(name);
+    size_t name_len = strlen(name), size = name_len + strlen(value) + 2;
+    qentry_t *pair, *e;
+    int i, err;
+
+    if (table == NULL) {
+        if ((table = calloc(num_entries, sizeof(qentry_t))) == NULL) return;
+        if ((err = pthread_setspecific(table_key, table)) != 0) {
+            handle_error_en(err, "pthread_setspecific");
+        }
+    }
+    pair = pair_of(hash);
+    // refill the key's own entry if it has one, so that it is never cached
+    // twice, otherwise replace the less recently used entry
+    for (i = 0; i < 2; i++) {
+        if (pair[i].buf != NULL && pair[i].hash == hash &&
+            strcmp(pair[i].buf, name) == 0) {
+            break;
+        }
+    }
+    if (i == 2) i = pair[0].recent;
+    e = &pair[i];
+    if (e->cap < size) {
+        char *buf = realloc(e->buf, size);
+        if (buf == NULL) return;
+        e->buf = buf;
+        e->cap = size;
+    }
+    memcpy(e->buf, name, name_len + 1);
+    strcpy(e->buf + name_len + 1, value);
+    e->hash = hash;
+    e->version = version;
+    e->expires = expires;
+    mark_recent(pair, i);
+}
+
+void qcache_invalidate(const char *name) {
+    __atomic_fetch_add(version_of(hash_name(name)), 1, __ATOMIC_RELEASE);
+}
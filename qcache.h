@@ -0,0 +1,57 @@
+#ifndef QCACHE_H_
+#define QCACHE_H_
+
+/*
+ * Per-thread cache of recent query results, so that reads of hot keys don't
+ * descend the tree. It is off unless qcache_enable() is called.
+ *
+ * Every thread has a 2-way set-associative table of its own, which is never
+ * shared and needs no locking. Entries are validated against a global array
+ * of QCACHE_STRIPES version counters, one per group of keys: writers bump the
+ * counter of a key while its node is write-locked, and a cached value is
+ * only returned while the counter still has the value it had before the
+ * value was read from the tree. A write to any key of the same stripe thus
+ * costs a miss, but never serves a stale value.
+ *
+ * Values stored in blobs (see blob.h) are not cached.
+ */
+
+#define QCACHE_STRIPES 4096
+
+/*
+ * Turns the cache on, with the given number of entries per thread (rounded
+ * up to a power of two).
+ */
+void qcache_enable(int entries);
+
+/*
+ * Returns nonzero if the cache is on.
+ */
+int qcache_enabled(void);
+
+/*
+ * Returns the current version of name, to be read before name is looked up
+ * in the tree and passed to qcache_put() with the result.
+ */
+unsigned long qcache_version(const char *name);
+
+/*
+ * Looks name up in the calling thread's cache. On a hit, copies the value
+ * into result (of len bytes) and returns 1; otherwise returns 0.
+ */
+int qcache_get(const char *name, char *result, int len);
+
+/*
+ * Caches value, which expires at the ttl_now_ms() time expires (0 for
+ * never), as the value of name at the given version.
+ */
+void qcache_put(const char *name, const char *value, long long expires,
+                unsigned long version);
+
+/*
+ * Invalidates the cached values of name in every thread. Called whenever the
+ * value, expiry or existence of a key changes, with its node write-locked.
+ */
+void qcache_invalidate(const char *name);
+
+#endif  // QCACHE_H_
@@ -0,0 +1,614 @@
+#include "./repl.h"
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "./comm.h"
+#include "./db.h"
+#include "./ttl.h"
+
+// Delay between attempts to reach the primary.
+#define REPL_RETRY_MS 1000
+
+/*
+ * A replica connected to this primary. Log records are appended to buf under
+ * the primary's mutex by whichever thread made the change, and written to the
+ * socket by the replica's sender thread.
+ */
+typedef struct replica {
+    struct replica *next;
+    int sock;
+    char addr[64];
+    unsigned long long start_seq;  // the log the snapshot does not cover
+    unsigned long long sent_seq;   // last record handed to the socket
+    char *buf;                     // log not yet sent
+    size_t len;
+    size_t cap;
+    int dropped;  // the backlog overflowed
+    pthread_cond_t cond;
+} replica_t;
+
+typedef struct primary {
+    pthread_mutex_t mutex;
+    pthread_cond_t idle;  // signalled when a sender exits
+    replica_t *replicas;
+    int num_replicas;  // also read without the mutex to skip logging
+    int num_senders;
+    unsigned long long seq;
+    int running;
+    int lsock;
+    int port;
+    pthread_t acceptor;
+} primary_t;
+
+typedef struct follower {
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+    int running;
+    char host[256];
+    char port[16];
+    int sock;  // -1 while not connected
+    pthread_t thread;
+
+    // status, read by repl_print_status()
+    const char *state;
+    unsigned long long applied_seq;
+    unsigned long long primary_seq;
+    long long lag_ms;        // delay of the last record applied
+    long long contact_ms;    // wall-clock time of the last line received
+    unsigned long applied;   // log records applied
+    unsigned long snapshot;  // keys in the last snapshot
+    unsigned long connects;
+} follower_t;
+
+static primary_t primary = {PTHREAD_MUTEX_INITIALIZER,
+                            PTHREAD_COND_INITIALIZER};
+static follower_t follower = {PTHREAD_MUTEX_INITIALIZER,
+                              PTHREAD_COND_INITIALIZER};
+
+// Wall-clock milliseconds, comparable between processes on the same host.
+static long long wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void repl_lock(pthread_mutex_t *mutex) {
+    int err;
+    if ((err = pthread_mutex_lock(mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static void repl_unlock(pthread_mutex_t *mutex) {
+    int err;
+    if ((err = pthread_mutex_unlock(mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+// Waits on cond for at most ms milliseconds.
+static void repl_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, long ms) {
+    struct timespec ts;
+    int err;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    err = pthread_cond_timedwait(cond, mutex, &ts);
+    if (err != 0 && err != ETIMEDOUT) {
+        handle_error_en(err, "pthread_cond_timedwait");
+    }
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Primary side */
+
+/*
+ * Appends a record to the backlog of every replica. The record is formatted
+ * under the mutex because its sequence number is assigned there.
+ */
+static void log_append(char op, const char *name, const char *value,
+                       long long ttl) {
+    size_t cap = strlen(name) + (value != NULL ? strlen(value) : 0) + 80;
+    char small[512];
+    char *rec = cap <= sizeof(small) ? small : malloc(cap);
+    int len;
+
+    repl_lock(&primary.mutex);
+    unsigned long long seq = ++primary.seq;
+    if (rec == NULL) {
+        // without the record the replicas can't stay consistent
+        for (replica_t *r = primary.replicas; r != NULL; r = r->next) {
+            r->dropped = 1;
+            pthread_cond_signal(&r->cond);
+        }
+        repl_unlock(&primary.mutex);
+        return;
+    }
+    if (op == 's') {
+        len = snprintf(rec, cap, "%llu %lld s %s %s %lld\n", seq, wall_ms(),
+                       name, value, ttl);
+    } else {
+        len = snprintf(rec, cap, "%llu %lld d %s\n", seq, wall_ms(), name);
+    }
+
+    for (replica_t *r = primary.replicas; r != NULL; r = r->next) {
+        if (r->dropped) continue;
+        if (r->len + len > REPL_MAX_BACKLOG) {
+            r->dropped = 1;
+        } else {
+            if (r->len + len > r->cap) {
+                size_t ncap = r->cap ? r->cap * 2 : 4096;
+                while (ncap < r->len + len) ncap *= 2;
+                char *nbuf = realloc(r->buf, ncap);
+                if (nbuf == NULL) {
+                    r->dropped = 1;
+                    pthread_cond_signal(&r->cond);
+                    continue;
+                }
+                r->buf = nbuf;
+                r->cap = ncap;
+            }
+            memcpy(r->buf + r->len, rec, len);
+            r->len += len;
+        }
+        pthread_cond_signal(&r->cond);
+    }
+    repl_unlock(&primary.mutex);
+    if (rec != small) free(rec);
+}
+
+void repl_log_set(const char *name, const char *value, long long expires) {
+    if (__atomic_load_n(&primary.num_replicas, __ATOMIC_RELAXED) == 0) return;
+
+    long long ttl = 0;
+    if (expires != 0 && (ttl = expires - ttl_now_ms()) <= 0) ttl = 1;
+    log_append('s', name, value, ttl);
+}
+
+void repl_log_del(const char *name) {
+    if (__atomic_load_n(&primary.num_replicas, __ATOMIC_RELAXED) == 0) return;
+    log_append('d', name, NULL, 0);
+}
+
+void repl_snapshot_entry(const char *name, const char *value, long long expires,
+                         FILE *out) {
+    long long ttl = 0;
+    if (expires != 0 && (ttl = expires - ttl_now_ms()) <= 0) ttl = 1;
+    fprintf(out, "0 %lld S %s %s %lld\n", wall_ms(), name, value, ttl);
+}
+
+// db_walk() visitor that writes a snapshot entry for node.
+static void snapshot_node(node_t *node, void *out) {
+    repl_snapshot_entry(node->name, node->value, node->expires, (FILE *)out);
+}
+
+/*
+ * Sends a snapshot to the replica. It is built in memory first so that the
+ * walk, which keeps writers out of the tree, doesn't wait on the network.
+ */
+static int send_snapshot(replica_t *r) {
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *out;
+    int ret;
+
+    if ((out = open_memstream(&buf, &size)) == NULL) return -1;
+    db_walk(snapshot_node, out);
+    fprintf(out, "%llu %lld e\n", r->start_seq, wall_ms());
+    fclose(out);
+    ret = write_all(r->sock, buf, size);
+    free(buf);
+    return ret;
+}
+
+// Unlinks r from the replica list. Must be called with the mutex held.
+static void remove_replica(replica_t *r) {
+    replica_t **pp = &primary.replicas;
+    while (*pp != r) pp = &(*pp)->next;
+    *pp = r->next;
+    __atomic_store_n(&primary.num_replicas, primary.num_replicas - 1,
+                     __ATOMIC_RELAXED);
+}
+
+static void *run_sender(void *arg) {
+    replica_t *r = (replica_t *)arg;
+    int failed = send_snapshot(r) != 0;
+
+    repl_lock(&primary.mutex);
+    r->sent_seq = r->start_seq;
+    while (!failed && primary.running && !r->dropped) {
+        if (r->len == 0) {
+            repl_wait(&r->cond, &primary.mutex, REPL_HEARTBEAT_MS);
+            if (!primary.running || r->dropped) break;
+        }
+
+        char hb[64];
+        char *buf = r->buf;
+        size_t len = r->len;
+        unsigned long long seq = primary.seq;
+        r->buf = NULL;
+        r->len = r->cap = 0;
+        repl_unlock(&primary.mutex);
+
+        if (len == 0) {
+            // everything up to seq has been sent to this replica
+            len = snprintf(hb, sizeof(hb), "%llu %lld h\n", seq, wall_ms());
+            failed = write_all(r->sock, hb, len) != 0;
+        } else {
+            failed = write_all(r->sock, buf, len) != 0;
+            free(buf);
+        }
+
+        repl_lock(&primary.mutex);
+        if (!failed) r->sent_seq = seq;
+    }
+    if (r->dropped) {
+        fprintf(stderr, "replica %s fell too far behind, disconnecting\n",
+                r->addr);
+    } else {
+        fprintf(stderr, "replica %s disconnected\n", r->addr);
+    }
+    remove_replica(r);
+    primary.num_senders--;
+    pthread_cond_broadcast(&primary.idle);
+    repl_unlock(&primary.mutex);
+
+    if (close(r->sock) < 0) perror("close");
+    free(r->buf);
+    pthread_cond_destroy(&r->cond);
+    free(r);
+    return NULL;
+}
+
+static void *run_acceptor(void *arg) {
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int sock;
+        int err;
+
+        if ((sock = accept(primary.lsock, (struct sockaddr *)&addr,
+                           &addr_len)) < 0) {
+            perror("accept");
+            continue;
+        }
+        // repl_stop() cancels this thread, which must not happen between
+        // counting a sender and starting it
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
+
+        replica_t *r = calloc(1, sizeof(replica_t));
+        if (r == NULL) {
+            perror("calloc");
+            close(sock);
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, 0);
+            continue;
+        }
+        r->sock = sock;
+        snprintf(r->addr, sizeof(r->addr), "%s#%hu", inet_ntoa(addr.sin_addr),
+                 ntohs(addr.sin_port));
+        pthread_cond_init(&r->cond, 0);
+
+        // the snapshot covers everything logged up to now, the backlog the
+        // rest
+        repl_lock(&primary.mutex);
+        if (!primary.running) {
+            repl_unlock(&primary.mutex);
+            close(sock);
+            free(r);
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, 0);
+            continue;
+        }
+        r->start_seq = primary.seq;
+        r->next = primary.replicas;
+        primary.replicas = r;
+        __atomic_store_n(&primary.num_replicas, primary.num_replicas + 1,
+                         __ATOMIC_RELAXED);
+        primary.num_senders++;
+        repl_unlock(&primary.mutex);
+        fprintf(stderr, "replica %s connected at seq %llu\n", r->addr,
+                r->start_seq);
+
+        pthread_t thread;
+        if ((err = pthread_create(&thread, 0, run_sender, r)) != 0) {
+            handle_error_en(err, "pthread_create");
+        }
+        if ((err = pthread_detach(thread)) != 0) {
+            handle_error_en(err, "pthread_detach");
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, 0);
+    }
+    return NULL;
+}
+
+void repl_start_primary(int port) {
+    struct sockaddr_in addr;
+    int err;
+    int one = 1;
+
+    if ((primary.lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(primary.lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(primary.lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(primary.lsock, 16) < 0) {
+        perror("replication listener");
+        exit(1);
+    }
+
+    primary.port = port;
+    primary.running = 1;
+    if ((err = pthread_create(&primary.acceptor, 0, run_acceptor, 0)) != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+    fprintf(stderr, "accepting replicas on port %d\n", port);
+}
+
+/* Replica side */
+
+static int connect_primary(void) {
+    struct addrinfo hints;
+    struct addrinfo *result, *res;
+    int sock = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(follower.host, follower.port, &hints, &result) != 0) {
+        return -1;
+    }
+    for (res = result; res != NULL; res = res->ai_next) {
+        if ((sock = socket(res->ai_family, res->ai_socktype,
+                           res->ai_protocol)) < 0) {
+            continue;
+        }
+        if (connect(sock, res->ai_addr, res->ai_addrlen) == 0) break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(result);
+    return sock;
+}
+
+/*
+ * Applies one line of the stream. Returns -1 if it is malformed.
+ */
+static int apply_line(char *line) {
+    char *save;
+    char *seq_field = strtok_r(line, " \n", &save);
+    char *ms_field = strtok_r(NULL, " \n", &save);
+    char *op = strtok_r(NULL, " \n", &save);
+    char *name = strtok_r(NULL, " \n", &save);
+    char *value = strtok_r(NULL, " \n", &save);
+    char *ttl_field = strtok_r(NULL, " \n", &save);
+
+    if (op == NULL || op[1] != '\0') return -1;
+    unsigned long long seq = strtoull(seq_field, NULL, 10);
+    long long sent = strtoll(ms_field, NULL, 10);
+    long long ttl = ttl_field != NULL ? strtoll(ttl_field, NULL, 10) : 0;
+    int apply = seq > follower.applied_seq;
+
+    switch (*op) {
+        case 'S':
+            if (ttl_field == NULL) return -1;
+            db_put(name, value, ttl);
+            break;
+        case 's':
+            if (ttl_field == NULL) return -1;
+            if (apply) db_put(name, value, ttl);
+            break;
+        case 'd':
+            if (name == NULL) return -1;
+            if (apply) db_remove(name);
+            break;
+        case 'e':
+        case 'h':
+            break;
+        default:
+            return -1;
+    }
+
+    long long now = wall_ms();
+    repl_lock(&follower.mutex);
+    switch (*op) {
+        case 'S':
+            follower.snapshot++;
+            break;
+        case 'e':
+            follower.applied_seq = follower.primary_seq = seq;
+            follower.state = "streaming";
+            break;
+        case 'h':
+            if (seq > follower.primary_seq) follower.primary_seq = seq;
+            break;
+        default:
+            if (apply) {
+                follower.applied_seq = seq;
+                follower.applied++;
+            }
+            if (seq > follower.primary_seq) follower.primary_seq = seq;
+            break;
+    }
+    follower.lag_ms = now - sent;
+    follower.contact_ms = now;
+    repl_unlock(&follower.mutex);
+    return 0;
+}
+
+static void *run_follower(void *arg) {
+    char *line = NULL;
+    size_t line_len = 0;
+
+    repl_lock(&follower.mutex);
+    while (follower.running) {
+        follower.state = "connecting";
+        repl_unlock(&follower.mutex);
+        int sock = connect_primary();
+        repl_lock(&follower.mutex);
+        if (sock < 0) {
+            repl_wait(&follower.wakeup, &follower.mutex, REPL_RETRY_MS);
+            continue;
+        }
+        if (!follower.running) {
+            close(sock);
+            break;
+        }
+        follower.sock = sock;
+        follower.state = "snapshot";
+        follower.snapshot = 0;
+        follower.applied_seq = follower.primary_seq = 0;
+        follower.connects++;
+        repl_unlock(&follower.mutex);
+        fprintf(stderr, "replicating from %s:%s\n", follower.host,
+                follower.port);
+
+        // start over from the snapshot
+        db_clear();
+        FILE *in = fdopen(sock, "r");
+        if (in == NULL) {
+            perror("fdopen");
+            close(sock);
+        } else {
+            while (getline(&line, &line_len, in) != -1) {
+                if (apply_line(line) != 0) {
+                    fprintf(stderr, "malformed replication record\n");
+                    break;
+                }
+            }
+            fclose(in);
+        }
+
+        repl_lock(&follower.mutex);
+        follower.sock = -1;
+        if (follower.running) {
+            fprintf(stderr, "lost the primary, reconnecting\n");
+            repl_wait(&follower.wakeup, &follower.mutex, REPL_RETRY_MS);
+        }
+    }
+    follower.state = "stopped";
+    repl_unlock(&follower.mutex);
+    free(line);
+    return NULL;
+}
+
+int repl_start_replica(const char *address) {
+    const char *colon = strrchr(address, ':');
+    int err;
+
+    if (colon == NULL || colon == address || colon[1] == '\0' ||
+        colon - address >= (long)sizeof(follower.host) ||
+        strlen(colon + 1) >= sizeof(follower.port)) {
+        return -1;
+    }
+    memcpy(follower.host, address, colon - address);
+    follower.host[colon - address] = '\0';
+    strcpy(follower.port, colon + 1);
+
+    follower.sock = -1;
+    follower.state = "connecting";
+    follower.running = 1;
+    if ((err = pthread_create(&follower.thread, 0, run_follower, 0)) != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+    return 0;
+}
+
+int repl_is_replica(void) { return follower.host[0] != '\0'; }
+
+void repl_stop(void) {
+    int err;
+
+    if (primary.port != 0) {
+        if ((err = pthread_cancel(primary.acceptor)) != 0) {
+            handle_error_en(err, "pthread_cancel");
+        }
+        if ((err = pthread_join(primary.acceptor, 0)) != 0) {
+            handle_error_en(err, "pthread_join");
+        }
+        close(primary.lsock);
+
+        // the senders notice either the flag or the failed write
+        repl_lock(&primary.mutex);
+        primary.running = 0;
+        for (replica_t *r = primary.replicas; r != NULL; r = r->next) {
+            shutdown(r->sock, SHUT_RDWR);
+            pthread_cond_signal(&r->cond);
+        }
+        while (primary.num_senders > 0) {
+            if ((err = pthread_cond_wait(&primary.idle, &primary.mutex)) != 0) {
+                handle_error_en(err, "pthread_cond_wait");
+            }
+        }
+        repl_unlock(&primary.mutex);
+        primary.port = 0;
+    }
+
+    if (follower.running) {
+        repl_lock(&follower.mutex);
+        follower.running = 0;
+        if (follower.sock >= 0) shutdown(follower.sock, SHUT_RDWR);
+        pthread_cond_signal(&follower.wakeup);
+        repl_unlock(&follower.mutex);
+        if ((err = pthread_join(follower.thread, 0)) != 0) {
+            handle_error_en(err, "pthread_join");
+        }
+    }
+}
+
+void repl_print_status(FILE *out) {
+    if (repl_is_replica()) {
+        repl_lock(&follower.mutex);
+        long long since =
+            follower.contact_ms ? wall_ms() - follower.contact_ms : -1;
+        fprintf(out,
+                "replica of %s:%s, %s\n"
+                "  applied seq %llu of %llu, lag %lld ms, last heard from "
+                "%lld ms ago\n"
+                "  %lu records applied, %lu keys in last snapshot, %lu "
+                "connects\n",
+                follower.host, follower.port, follower.state,
+                follower.applied_seq, follower.primary_seq, follower.lag_ms,
+                since, follower.applied, follower.snapshot, follower.connects);
+        repl_unlock(&follower.mutex);
+    } else if (primary.port != 0) {
+        repl_lock(&primary.mutex);
+        fprintf(out, "primary on port %d, seq %llu, %d replicas\n",
+                primary.port, primary.seq, primary.num_replicas);
+        for (replica_t *r = primary.replicas; r != NULL; r = r->next) {
+            fprintf(out, "  %s: sent seq %llu, %zu bytes pending\n", r->addr,
+                    r->sent_seq, r->len);
+        }
+        repl_unlock(&primary.mutex);
+    } else {
+        fprintf(out, "replication is off\n");
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef REPL_H_
+#define REPL_H_
+
+#include <stdio.h>
+
+/*
+ * Primary-to-replica replication. A primary accepts replica connections on a
+ * separate port. Each new replica is first sent a snapshot of the tree, taken
+ * with db_walk() so that the replica rebuilds a tree of the same shape, and
+ * then the mutation log from the point the snapshot was started.
+ *
+ * Mutations are logged by db.c while the changed node is still locked, so the
+ * log orders the changes to any one key the way they were applied. The
+ * snapshot is fuzzy: it may already contain some of the changes that follow
+ * it in the log. Replaying a record is idempotent (a set is an upsert and a
+ * delete of a missing key does nothing), so the replica still converges on
+ * the primary's state.
+ *
+ * Replicas apply the log on a single thread and refuse a, u and d from
+ * clients. When a replica loses its primary it keeps serving what it has,
+ * and on reconnecting it clears its tree and starts again from a new
+ * snapshot. Keys with a TTL are shipped with the time they have left, and
+ * each replica expires them on its own clock.
+ *
+ * The stream is line-based text. Every line starts with a sequence number and
+ * the primary's wall-clock time in milliseconds, which the replica uses to
+ * measure its lag:
+ *   0 <ms> S <key> <value> <ttl_ms>    snapshot entry (ttl 0 means none)
+ *   <seq> <ms> e                       end of snapshot, log follows seq
+ *   <seq> <ms> s <key> <value> <ttl_ms>  set
+ *   <seq> <ms> d <key>                 delete
+ *   <seq> <ms> h                       heartbeat, everything up to seq sent
+ */
+
+// Interval of heartbeats on an idle stream.
+#define REPL_HEARTBEAT_MS 100
+
+// A replica whose unsent log grows beyond this many bytes is disconnected.
+#define REPL_MAX_BACKLOG (64L << 20)
+
+/*
+ * Makes this server a primary that accepts replicas on the given port.
+ */
+void repl_start_primary(int port);
+
+/*
+ * Makes this server a replica of the primary at "host:port", which it keeps
+ * reconnecting to. Returns 0 on success or -1 if the address is malformed.
+ */
+int repl_start_replica(const char *primary);
+
+/*
+ * Stops replication: disconnects replicas or the primary and waits for the
+ * replication threads to finish. Must be called before db_cleanup().
+ */
+void repl_stop(void);
+
+/*
+ * Returns nonzero if this server is a replica.
+ */
+int repl_is_replica(void);
+
+/*
+ * Logs that name was set to value with the given expiry time (a ttl_now_ms()
+ * time, or 0 for none). Called by db.c with the node locked; does nothing if
+ * no replica is connected.
+ */
+void repl_log_set(const char *name, const char *value, long long expires);
+
+/*
+ * Logs that name was removed. Called by db.c with the node locked.
+ */
+void repl_log_del(const char *name);
+
+/*
+ * Writes the snapshot entry of a key, in the format of the stream above, to
+ * out. expires is a ttl_now_ms() time, or 0 for none. Also used by
+ * db_export().
+ */
+void repl_snapshot_entry(const char *name, const char *value, long long expires,
+                         FILE *out);
+
+/*
+ * Prints the replication status: the connected replicas and how much log
+ * each has pending on a primary, or the state and lag on a replica.
+ */
+void repl_print_status(FILE *out);
+
+#endif  // REPL_H_
@@ -0,0 +1,26 @@
+#!/bin/bash
+# Compares db_bench with threads pinned to CPUs and nodes taken from
+# per-NUMA-node arenas (db_bench -a) with unpinned threads and malloc().
+#
+# Usage: scripts/affinity_bench.sh [cpus] [threads] [repeat]
+#
+# cpus is a list such as 0-7,16-23 (default every online CPU) and threads a
+# comma-separated list of thread counts (default 1 and the number of CPUs in
+# the list). Spread the list over both sockets to see the effect of NUMA
+# placement. Writers are optimistic (-O), so that they don't serialize at the
+# root. Run from the repository root after building db_bench with make.
+
+cpus=${1:-0-$(($(nproc) - 1))}
+ncpus=$(echo "$cpus" | tr ',' '\n' |
+    awk -F- '{ n += NF == 2 ? $2 - $1 + 1 : 1 } END { print n }')
+threads=${2:-$( [ "$ncpus" -gt 1 ] && echo "1,$ncpus" || echo 1)}
+repeat=${3:-5}
+
+printf "%-9s %-7s %-7s %-7s %s\n" placement phase pattern threads ops_per_sec
+for mode in "" "-a $cpus"; do
+    ./db_bench -t "$threads" -p random,zipf -r "$repeat" -O $mode |
+        awk -v placement="${mode:+pinned}" 'NR > 2 {
+            printf "%-9s %-7s %-7s %-7s %s\n", placement ? placement : "floating",
+                $1, $2, $3, $5
+        }'
+done
@@ -0,0 +1,64 @@
+#!/bin/bash
+# Compares the debug build with the optimized ones (make release, make pgo).
+#
+# Usage: scripts/build_bench.sh [seconds] [port]
+#
+# For the debug build in the repository root and for build/release and
+# build/pgo, if they have been built, measures
+#   - the server under the closed-loop load generator (4 connections, 10%
+#     writes, keys from scripts/adict.txt) for that many seconds (default 5),
+#   - the time to replay scripts/dge.txt (300000 adds) on 4 connections,
+#   - db_bench's random add, query and remove rates on one thread,
+# and prints them with the gain over the debug build. The same client, the
+# debug one, drives every server. Run from the repository root after make.
+
+secs=${1:-5}
+port=${2:-6399}
+
+# Prints "ops_per_sec p99_us replay_seconds" for the server in $1.
+server_run() {
+    local load start end pid
+    # the REPL reads stdin, so keep it open until the run is over
+    (sleep $((secs + 120))) | "$1/server" "$port" > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    load=$(./client -b -P -c 4 -d "$secs" -w 0.1 -k scripts/adict.txt \
+        localhost "$port" |
+        sed -E 's/.*"throughput_ops": ([0-9.]+).*"all": \{[^}]*"p99": ([0-9.]+).*/\1 \2/')
+    start=$(date +%s.%N)
+    ./client localhost "$port" scripts/dge.txt 4 > /dev/null
+    end=$(date +%s.%N)
+    kill $pid
+    wait $pid 2> /dev/null
+    echo "$load $(awk -v s="$start" -v e="$end" 'BEGIN { print e - s }')"
+}
+
+# Prints db_bench's "add query remove" ops/sec for the build in $1.
+engine_run() {
+    "$1/db_bench" -t 1 -p random -r 3 |
+        awk '$2 == "random" { rate[$1] = $5 }
+             END { printf "%.0f %.0f %.0f\n", rate["add"], rate["query"],
+                   rate["remove"] }'
+}
+
+printf "%-8s %10s %8s %9s %9s %9s %9s  %s\n" build ops_per_sec p99_us \
+    replay_s add/s query/s remove/s gain
+for dir in . build/release build/pgo; do
+    if [ ! -x "$dir/server" ] || [ ! -x "$dir/db_bench" ]; then
+        continue
+    fi
+    read -r tput p99 replay <<< "$(server_run "$dir")"
+    port=$((port + 1))
+    read -r add query remove <<< "$(engine_run "$dir")"
+    if [ "$dir" = . ]; then
+        name=debug
+        base_tput=$tput
+        base_query=$query
+    else
+        name=${dir#build/}
+    fi
+    gain=$(awk -v t="$tput" -v bt="$base_tput" -v q="$query" -v bq="$base_query" \
+        'BEGIN { printf "server x%.2f, engine x%.2f", t / bt, q / bq }')
+    printf "%-8s %10.0f %8.0f %9.2f %9s %9s %9s  %s\n" "$name" "$tput" "$p99" \
+        "$replay" "$add" "$query" "$remove" "$gain"
+done
@@ -0,0 +1,49 @@
+#!/bin/bash
+# Measures db_export() throughput through the server's e command.
+#
+# Usage: scripts/export_bench.sh [keys] [threads] [port]
+#
+# Starts a server, adds that many random keys (default 300000) through the
+# client, then exports the tree in every format on each of the given
+# comma-separated thread counts (default 1,2,4) and prints the server's
+# report for each. Run from the repository root after building with make.
+
+keys=${1:-300000}
+threads=${2:-1,2,4}
+port=${3:-5999}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+awk -v n="$keys" 'BEGIN {
+    srand(42)
+    while (count < n) {
+        key = sprintf("k%.0f", int(rand() * 1e12))
+        if (!(key in seen)) {
+            seen[key] = 1
+            print "a " key " v" ++count
+        }
+    }
+}' > "$dir/load.txt"
+
+mkfifo "$dir/repl"
+./server "$port" < "$dir/repl" > "$dir/server.log" 2>&1 &
+exec 3> "$dir/repl"
+sleep 1
+./client localhost "$port" "$dir/load.txt" 1 > /dev/null
+
+# the REPL reads one command per read(), so they are sent one at a time
+for t in ${threads//,/ }; do
+    for format in tree sorted snapshot; do
+        echo "e $format $dir/export.txt $t" >&3
+        sleep 2
+    done
+done
+
+# the server's output is only flushed when it exits
+exec 3>&-
+wait
+for t in ${threads//,/ }; do
+    for format in tree sorted snapshot; do
+        echo $format
+    done
+done | paste - <(grep exported "$dir/server.log")
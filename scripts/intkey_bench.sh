@@ -0,0 +1,36 @@
+#!/bin/bash
+# Compares integer keys (db_bench -I) with string keys on the same numeric
+# keys.
+#
+# Usage: scripts/intkey_bench.sh [keys] [repeat]
+#
+# Builds a corpus of that many distinct random integers of up to 12 digits,
+# in random order, and runs db_bench on it once with string keys and once
+# with integer keys, on one thread. Run from the repository root after
+# building db_bench with make.
+
+keys=${1:-100000}
+repeat=${2:-5}
+corpus=$(mktemp)
+trap 'rm -f "$corpus"' EXIT
+
+awk -v n="$keys" 'BEGIN {
+    srand(42)
+    while (count < n) {
+        # %d would overflow in mawk, and print would use %.6g
+        id = sprintf("%.0f", int(rand() * 1e12))
+        if (!(id in seen)) {
+            seen[id] = 1
+            count++
+            print "a " id " " id
+        }
+    }
+}' > "$corpus"
+
+printf "%-7s %-7s %-7s %s\n" keys phase pattern ops_per_sec
+for mode in "" -I; do
+    ./db_bench -t 1 -p random,sorted -r "$repeat" -l "$corpus" $mode |
+        awk -v keys="${mode:+int}" 'NR > 2 {
+            printf "%-7s %-7s %-7s %s\n", keys ? keys : "string", $1, $2, $5
+        }'
+done
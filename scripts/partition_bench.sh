@@ -0,0 +1,28 @@
+#!/bin/bash
+# Measures how adds and removes scale with the number of partitions
+# (db_bench -P).
+#
+# Usage: scripts/partition_bench.sh [partitions] [threads] [repeat]
+#
+# partitions is a comma-separated list of partition counts (default
+# 1,2,4,8,16) and threads a comma-separated list of thread counts (default 1
+# and the number of CPUs, or 1 and 4 on a single CPU). Each count is run
+# with locking and with optimistic (-O) writers, on random keys. Run from the
+# repository root after building db_bench with make.
+
+partitions=${1:-1,2,4,8,16}
+threads=${2:-1,$( [ "$(nproc)" -gt 1 ] && nproc || echo 4)}
+repeat=${3:-5}
+
+printf "%-10s %-10s %-7s %-7s %s\n" writers partitions phase threads \
+    ops_per_sec
+for mode in "" -O; do
+    for p in $(echo "$partitions" | tr ',' ' '); do
+        ./db_bench -t "$threads" -p random -r "$repeat" -P "$p" $mode |
+            awk -v writers="${mode:+optimistic}" -v p="$p" \
+                'NR > 2 && $1 != "query" {
+                printf "%-10s %-10s %-7s %-7s %s\n",
+                    writers ? writers : "locking", p, $1, $3, $5
+            }'
+    done
+done
@@ -0,0 +1,35 @@
+#!/bin/bash
+# Runs the training workload for a profile-guided build (make pgo).
+#
+# Usage: scripts/pgo_train.sh <build directory> [port]
+#
+# Starts the instrumented server of the build directory and replays the
+# scripts/ workloads against it with its client: adict.txt, query.txt and
+# dge.txt add keys, adict_queries.txt queries them and adict_deletes.txt
+# removes them, each on 4 connections, followed by a few seconds of the load
+# generator. The profiles are written when the server and clients exit. Run
+# from the repository root.
+
+dir=${1:?usage: scripts/pgo_train.sh <build directory> [port]}
+port=${2:-6299}
+
+# the REPL reads stdin, so keep it open until the workload is over
+mkfifo "$dir/repl"
+"$dir/server" "$port" < "$dir/repl" > /dev/null 2>&1 &
+server=$!
+exec 3> "$dir/repl"
+rm "$dir/repl"
+sleep 0.5
+
+for script in adict.txt query.txt dge.txt adict_queries.txt \
+    adict_deletes.txt; do
+    echo "training on $script"
+    "$dir/client" localhost "$port" "scripts/$script" 4 > /dev/null
+done
+echo "training on the load generator"
+"$dir/client" -b -P -c 4 -d 3 -w 0.1 -k scripts/adict.txt localhost "$port" \
+    > /dev/null
+
+# end the server through its REPL, so that it exits and writes its profile
+exec 3>&-
+wait $server
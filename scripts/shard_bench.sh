@@ -0,0 +1,35 @@
+#!/bin/bash
+# Measures aggregate throughput against 1, 2 and 4 shards on localhost.
+#
+# Usage: scripts/shard_bench.sh [connections] [seconds] [base_port]
+#
+# For each shard count, starts that many servers, preloads the keys, runs the
+# closed-loop load generator with the given number of connections spread over
+# all shards, and prints one line per run. Run from the repository root after
+# building with make.
+
+conns=${1:-16}
+secs=${2:-5}
+base=${3:-7400}
+
+printf "%-7s %-12s %-10s %-10s\n" shards ops_per_sec p50_us p99_us
+for n in 1 2 4; do
+    pids=()
+    shards=""
+    for ((i = 0; i < n; i++)); do
+        port=$((base + i))
+        # the REPL reads stdin, so keep it open until the run is over
+        (sleep $((secs + 30))) | ./server $port > /dev/null 2>&1 &
+        pids+=($!)
+        shards+="${shards:+,}localhost:$port"
+    done
+    sleep 0.5
+
+    ./client -b -P -c "$conns" -d "$secs" -s "$shards" |
+        sed -E 's/.*"throughput_ops": ([0-9.]+).*"all": \{[^}]*"p50": ([0-9.]+), "p90": [0-9.]+, "p99": ([0-9.]+).*/\1 \2 \3/' |
+        { read -r tput p50 p99; printf "%-7s %-12s %-10s %-10s\n" "$n" "$tput" "$p50" "$p99"; }
+
+    kill "${pids[@]}"
+    wait "${pids[@]}" 2> /dev/null
+    base=$((base + n))
+done
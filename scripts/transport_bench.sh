@@ -0,0 +1,42 @@
+#!/bin/bash
+# Compares the latency of TCP loopback, the Unix socket and shared memory.
+#
+# Usage: scripts/transport_bench.sh [seconds] [port]
+#
+# Starts one server, listening on port (default 6399) and on a Unix socket,
+# adds the keys of scripts/adict.txt and runs the closed-loop load generator
+# (reads only) over each transport for that many seconds (default 5): first
+# with one request in flight, which measures the round trip, and then with 16
+# pipelined. Run from the repository root after make.
+
+secs=${1:-5}
+port=${2:-6399}
+sock=/tmp/db_transport_bench.$$.sock
+
+# the REPL reads stdin, so keep it open until the runs are over
+(sleep $((secs * 6 + 60))) | ./server -u "$sock" "$port" > /dev/null 2>&1 &
+pid=$!
+sleep 0.5
+./client -b -P -d 0.1 -k scripts/adict.txt localhost "$port" > /dev/null
+
+printf "%-6s %5s %11s %8s %8s %8s\n" via depth ops_per_sec p50_us p99_us \
+    p999_us
+for depth in 1 16; do
+    for via in tcp unix shm; do
+        if [ $via = tcp ]; then
+            addr="localhost $port"
+        else
+            addr="$via $sock"
+        fi
+        ./client -b -p $depth -d "$secs" -k scripts/adict.txt $addr |
+            sed -E 's/.*"throughput_ops": ([0-9.]+).*"all": \{[^}]*"p50": ([0-9.]+), "p90": [0-9.]+, "p99": ([0-9.]+), "p999": ([0-9.]+).*/\1 \2 \3 \4/' |
+            awk -v via=$via -v depth=$depth \
+                '{ printf "%-6s %5d %11.0f %8.1f %8.1f %8.1f\n", via, depth,
+                   $1, $2, $3, $4 }'
+    done
+done
+
+kill $pid
+wait $pid 2> /dev/null
+# killed, the server leaves its socket behind
+rm -f "$sock"
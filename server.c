@@ -11,8 +11,17 @@
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#include "./admit.h"
+#include "./affinity.h"
 #include "./comm.h"
 #include "./db.h"
+#include "./lockstat.h"
+#include "./qcache.h"
+#include "./repl.h"
+#include "./slowlog.h"
+#include "./ttl.h"
+#include "./vindex.h"
+#include "./watch.h"
 
 /*
  * Use the variables in this struct to synchronize your main thread with client
@@ -41,7 +50,14 @@ typedef struct client_control {
  */
 typedef struct client {
     pthread_t thread;
-    FILE *cxstr;  // File stream for input and output
+    FILE *cxstr;            // File stream for input and output
+    char *command;          // Current command, grown by comm_serve()
+    size_t command_len;     // Size of the command buffer
+    blob_t *reply;          // Reply to the current command if it is a blob
+    admit_bucket_t bucket;  // Token bucket for admission control
+    int admitted;           // Set while a command is admitted (see admit.h)
+    watcher_t *watcher;     // Set once the client watches keys (see watch.h)
+    comm_shm_t *shm;        // Set once the client uses shared memory
 
     // For client list
     struct client *prev;
@@ -144,9 +160,21 @@ void client_constructor(FILE *cxstr) {
     // to the input argument.
     // Step 2: Create the new client thread running the run_client routine.
     // Step 3: Detach the new client thread
+    if (admit_connection() != 0) {
+        comm_refuse(cxstr, "busy");
+        return;
+    }
+
     client_t *new_client = (client_t *)malloc(sizeof(client_t));
     new_client->prev = NULL;
     new_client->next = NULL;
+    new_client->command = NULL;
+    new_client->command_len = 0;
+    new_client->reply = NULL;
+    admit_bucket_init(&new_client->bucket);
+    new_client->admitted = 0;
+    new_client->watcher = NULL;
+    new_client->shm = NULL;
 
     if (cxstr != NULL) {
         new_client->cxstr = cxstr;
@@ -155,9 +183,13 @@ void client_constructor(FILE *cxstr) {
         fprintf(stderr, "File cannot be null!\n");
     }
 
+    pthread_attr_t attr;
+    // on the listener's node, next to the socket and its arena (affinity.h)
+    affinity_attr_local(&attr);
     int creat =
-        pthread_create(&new_client->thread, 0, (void *(*)(void *))run_client,
-                       (void *)new_client);
+        pthread_create(&new_client->thread, &attr,
+                       (void *(*)(void *))run_client, (void *)new_client);
+    pthread_attr_destroy(&attr);
     if (creat != 0) {
         new_client->cxstr = NULL;
         free(new_client);
@@ -176,8 +208,12 @@ void client_destructor(client_t *client) {
     // TODO: Free and close all resources associated with a client.
     // Whatever was malloc'd in client_constructor should
     // be freed here!
+    watch_release(client->watcher);
+    comm_shm_release(client->shm);
     comm_shutdown(client->cxstr);
     client->cxstr = NULL;
+    free(client->command);
+    blob_put(client->reply);
     client->prev = NULL;
     client->next = NULL;
     int cnt;
@@ -213,13 +249,10 @@ void *run_client(void *arg) {
         if (thread_list_head == NULL) {
             thread_list_head = new_client;
             printf("thread_list_head added\n");
-        } else if (thread_list_head->next == NULL) {
-            thread_list_head->next = new_client;
-            new_client->prev = thread_list_head;
-            printf("thread_list_head->next added\n");
         } else {
-            while (thread_list_head->next != NULL) {
-                curr_client = thread_list_head->next;
+            curr_client = thread_list_head;
+            while (curr_client->next != NULL) {
+                curr_client = curr_client->next;
             }
             curr_client->next = new_client;
             new_client->prev = curr_client;
@@ -233,7 +266,6 @@ void *run_client(void *arg) {
         pthread_cleanup_push(thread_cleanup, (void *)new_client);
 
         char response[1024];
-        char command[1024];
         response[0] = '\0';
 
         printf("hello\n");
@@ -252,13 +284,45 @@ void *run_client(void *arg) {
             handle_error_en(unlockerr2, "pthread_mutex_unlock");
         }
 
-        while ((recv = comm_serve(new_client->cxstr, response, command)) !=
-               -1) {
+        while ((recv = new_client->shm != NULL
+                           ? comm_shm_serve(
+                                 new_client->shm, response, new_client->reply,
+                                 &new_client->command, &new_client->command_len)
+                           : comm_serve(new_client->cxstr, response,
+                                        new_client->reply, &new_client->command,
+                                        &new_client->command_len)) != -1) {
+            blob_put(new_client->reply);
+            new_client->reply = NULL;
             if (clientcontrol.stopped == 1) {
                 printf("calling control_wait\n");
                 client_control_wait();
             }
-            interpret_command(command, response, 1024);
+            // shed load with an explicit reply rather than by stalling
+            int busy = admit_command(&new_client->bucket) != 0;
+            new_client->admitted = !busy;
+            // watches are answered by the notifier over the socket, see
+            // watch.h, so they are not available over shared memory
+            if (new_client->shm == NULL &&
+                watch_command(&new_client->watcher, new_client->cxstr,
+                              new_client->command, busy, response,
+                              sizeof(response))) {
+                // answered in response, or by the notifier
+            } else if (busy) {
+                snprintf(response, sizeof(response), "busy");
+            } else if (new_client->shm == NULL &&
+                       strcmp(new_client->command, "shm\n") == 0) {
+                new_client->shm = comm_shm_accept(new_client->cxstr, response,
+                                                  sizeof(response));
+            } else {
+                slowlog_begin(new_client->cxstr, new_client->command);
+                interpret_command(new_client->command, response, 1024,
+                                  &new_client->reply);
+                slowlog_end();
+            }
+            if (new_client->admitted) {
+                new_client->admitted = 0;
+                admit_done();
+            }
         }
 
         pthread_cleanup_pop(1);
@@ -337,6 +401,9 @@ void thread_cleanup(void *arg) {
             handle_error_en(cond, "pthread_cond_broadcast failed.\n");
         }
     }
+    // a client canceled in the middle of a command (an f, say) ends it here
+    if (curr_client->admitted) admit_done();
+    admit_release_connection();
     client_destructor(curr_client);
 }
 
@@ -402,7 +469,121 @@ void sig_handler_destructor(sig_handler_t *sighandler) {
     free(sighandler);
 }
 
-// The arguments to the server should be the port number.
+/*
+ * The REPL command "e <tree|sorted|snapshot> <file> [threads]": exports the
+ * database with db_export() on the given number of threads (by default one
+ * per CPU) and prints the throughput.
+ */
+static void export_command(char **tokens) {
+    static const char *formats[] = {"tree", "sorted", "snapshot"};
+    struct timespec start, end;
+    long cpus =
+        sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    int threads = cpus;
+    int format;
+    long bytes;
+    double seconds;
+
+    for (format = 0; format < 3; format++) {
+        if (tokens[1] != NULL && strcmp(tokens[1], formats[format]) == 0) {
+            break;
+        }
+    }
+    if (format == 3 || tokens[2] == NULL ||
+        (tokens[3] != NULL && (threads = atoi(tokens[3])) < 1)) {
+        fprintf(stderr, "usage: e <tree|sorted|snapshot> <file> [threads]\n");
+        return;
+    }
+    // as db_export() does, so that the number printed is the one used
+    if (threads > cpus * DB_EXPORT_THREADS_PER_CPU) {
+        threads = cpus * DB_EXPORT_THREADS_PER_CPU;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bytes = db_export(tokens[2], (enum export_format)format, threads);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (bytes < 0) {
+        fprintf(stderr, "Cannot write file.\n");
+        return;
+    }
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("exported %ld bytes on %d threads in %.3f s (%.1f MB/s)\n", bytes,
+           threads, seconds, seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+}
+
+// Parses a byte count such as 4096, 64K, 512M or 2G. Returns -1 if the
+// argument is malformed.
+static long parse_size(const char *arg) {
+    char *end;
+    long n = strtol(arg, &end, 10);
+
+    if (end == arg || n < 0) return -1;
+    switch (*end) {
+        case 'g':
+        case 'G':
+            n <<= 10;
+            // fall through
+        case 'm':
+        case 'M':
+            n <<= 10;
+            // fall through
+        case 'k':
+        case 'K':
+            n <<= 10;
+            end++;
+            break;
+    }
+    return *end == '\0' ? n : -1;
+}
+
+void usage(const char *cmd) {
+    fprintf(stderr,
+            "Usage: %s [-t] [-v] [-i] [-O] [-a cpus] [-c entries] "
+            "[-m memory_limit]\n"
+            "       [-n connections] [-q commands] [-b rate[,burst]] "
+            "[-S microseconds]\n"
+            "       [-u socket_path] [-P partitions] "
+            "[-R repl_port | -r primary_host:repl_port] <port>\n"
+            "  -t  delete keys by marking them as tombstones, which are "
+            "unlinked in the\n"
+            "      background\n"
+            "  -v  index keys by value for the v command\n"
+            "  -i  use 64-bit integer keys, ordered numerically (replicas "
+            "must use -i\n"
+            "      if their primary does)\n"
+            "  -O  let writers descend without locks, locking only the "
+            "nodes they change\n"
+            "  -a  pin the listener and client threads to these CPUs in "
+            "turn (e.g.\n"
+            "      0-3,8-11) and allocate nodes on the NUMA node of the "
+            "thread adding them\n"
+            "  -c  cache this many recent query results in each client "
+            "thread\n"
+            "  -m  evict least recently used keys once keys, values and "
+            "nodes take more\n"
+            "      than this many bytes (K, M and G suffixes are accepted)\n"
+            "  -n  answer connections beyond this many with busy\n"
+            "  -q  answer commands beyond this many in execution at once "
+            "with busy\n"
+            "  -b  let each connection run rate commands per second, in "
+            "bursts of up to\n"
+            "      burst (default rate), answering the others with busy; "
+            "lines of f\n"
+            "      files wait for their turn instead\n"
+            "  -S  log the commands that take at least this long, for the "
+            "sl command\n"
+            "  -u  also accept clients on a Unix socket at socket_path, "
+            "where they may\n"
+            "      move to shared memory (see shmring.h)\n"
+            "  -P  split the keys into this many ranges (up to 64), each "
+            "with a tree of\n"
+            "      its own, rebalanced as keys are added\n"
+            "  -R  accept replicas on repl_port\n"
+            "  -r  run as a read-only replica of the given primary\n",
+            cmd);
+}
+
+// The arguments to the server should be the options above and the port
+// number.
 int main(int argc, char *argv[]) {
     // TODO:
     // Step 1: Set up the signal handler for handling SIGINT.
@@ -419,9 +600,111 @@ int main(int argc, char *argv[]) {
     // happens in a call to delete_all() and ensure that there is no way for a
     // thread to add itself to the thread list after the server's final
     // delete_all().
-    pthread_t tid;
+    pthread_t tid, unix_tid = 0;
+    char *unix_path = NULL;
     sigset_t set;
     int s;
+    int opt;
+    long limit;
+    int repl_port = 0;
+    char *primary = NULL;
+    int max_connections = 0;
+    int max_pending = 0;
+    double rate = 0;
+    double burst = 0;
+    char *end;
+
+    while ((opt = getopt(argc, argv, "tviOa:c:m:n:q:b:S:u:P:R:r:")) != -1) {
+        switch (opt) {
+            case 't':
+                db_set_tombstones(1);
+                break;
+            case 'v':
+                vindex_enable();
+                break;
+            case 'i':
+                db_set_int_keys(1);
+                break;
+            case 'O':
+                db_set_optimistic(1);
+                break;
+            case 'a':
+                if (affinity_set(optarg) != 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                db_set_arenas(1);
+                break;
+            case 'c':
+                if (atoi(optarg) <= 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                qcache_enable(atoi(optarg));
+                break;
+            case 'm':
+                if ((limit = parse_size(optarg)) < 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                db_set_memory_limit(limit);
+                break;
+            case 'n':
+                if ((max_connections = atoi(optarg)) <= 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'q':
+                if ((max_pending = atoi(optarg)) <= 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                rate = strtod(optarg, &end);
+                burst = *end == ',' ? strtod(end + 1, &end) : rate;
+                if (rate <= 0 || burst < 1 || *end != '\0') {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'S':
+                if (atol(optarg) <= 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                slowlog_configure(atol(optarg));
+                break;
+            case 'u':
+                unix_path = optarg;
+                break;
+            case 'P':
+                if (db_set_partitions(atoi(optarg)) != 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'R':
+                if ((repl_port = atoi(optarg)) <= 0) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'r':
+                primary = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    if (optind != argc - 1 || (repl_port != 0 && primary != NULL)) {
+        usage(argv[0]);
+        exit(1);
+    }
+    admit_configure(max_connections, max_pending, rate, burst);
+    if (rate > 0) db_set_file_pacer(admit_pace);
 
     sigemptyset(&set);
     sigaddset(&set, SIGPIPE);
@@ -433,14 +716,29 @@ int main(int argc, char *argv[]) {
 
     sig_handler_t *sig_handler = sig_handler_constructor();
 
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
     if (port != 0) {
-        tid =
-            start_listener(atoi(argv[1]), (void (*)(FILE *))client_constructor);
+        tid = start_listener(port, (void (*)(FILE *))client_constructor);
     } else {
         fprintf(stderr, "Invalid port!\n");
         exit(1);
     }
+    if (unix_path != NULL) {
+        unix_tid = start_unix_listener(unix_path,
+                                       (void (*)(FILE *))client_constructor);
+    }
+
+    // expire keys with a ttl and even out the partitions in the background
+    ttl_start();
+    db_rebalance_start();
+    watch_start();
+
+    if (repl_port != 0) {
+        repl_start_primary(repl_port);
+    } else if (primary != NULL && repl_start_replica(primary) != 0) {
+        usage(argv[0]);
+        exit(1);
+    }
 
     int bytesRead;
     char *token;
@@ -451,7 +749,7 @@ int main(int argc, char *argv[]) {
     memset(tokens, 0, 512 * sizeof(char *));
 
     while (1) {
-        if ((bytesRead = read(0, buf, 1024)) == -1) {
+        if ((bytesRead = read(0, buf, 1023)) == -1) {
             perror("user input");
             continue;
         } else if (bytesRead == 0) {
@@ -470,7 +768,10 @@ int main(int argc, char *argv[]) {
         } else {
             int i = 0;
             char *str = buf;
-            while ((token = strtok(str, " \t\n")) != NULL) {
+            // don't let arguments from the previous line leak into this one
+            buf[bytesRead] = '\0';
+            memset(tokens, 0, 512 * sizeof(char *));
+            while (i < 511 && (token = strtok(str, " \t\n")) != NULL) {
                 tokens[i] = token;
                 str = NULL;
                 i += 1;
@@ -502,6 +803,49 @@ int main(int argc, char *argv[]) {
                     continue;
                 }
 
+            } else if (strcmp(tokens[0], "l") == 0) {
+                if (lockstat_print(tokens[1]) == -1) {
+                    fprintf(stderr, "Cannot open file.\n");
+                }
+                continue;
+            } else if (strcmp(tokens[0], "m") == 0) {
+                long used, limit, blobs, blob_bytes;
+                unsigned long evicted;
+                db_memory_stats(&used, &limit, &evicted);
+                blob_stats(&blobs, &blob_bytes);
+                printf(
+                    "memory used %ld bytes, limit %ld bytes, %lu keys "
+                    "evicted\n",
+                    used, limit, evicted);
+                printf("%ld blobs (%ld bytes) live\n", blobs, blob_bytes);
+                if (vindex_enabled()) {
+                    long values, entries, bytes;
+                    vindex_stats(&values, &entries, &bytes);
+                    printf("value index: %ld values, %ld keys, %ld bytes\n",
+                           values, entries, bytes);
+                }
+                continue;
+            } else if (strcmp(tokens[0], "r") == 0) {
+                repl_print_status(stdout);
+                continue;
+            } else if (strcmp(tokens[0], "c") == 0) {
+                admit_print_status(stdout);
+                watch_print_status(stdout);
+                continue;
+            } else if (strcmp(tokens[0], "sl") == 0) {
+                slowlog_print_status(stdout);
+                slowlog_print(
+                    stdout,
+                    tokens[1] != NULL ? atoi(tokens[1]) : SLOWLOG_ENTRIES,
+                    "\n");
+                continue;
+            } else if (strcmp(tokens[0], "e") == 0) {
+                export_command(tokens);
+                continue;
+            } else if (strcmp(tokens[0], "lr") == 0) {
+                printf("resetting lock statistics\n");
+                lockstat_reset();
+                continue;
             } else {
                 fprintf(stderr, "Invalid Command! \n");
                 continue;
@@ -512,6 +856,10 @@ int main(int argc, char *argv[]) {
     int join;
 
     sig_handler_destructor(sig_handler);
+    repl_stop();
+    ttl_stop();
+    db_rebalance_stop();
+    watch_stop();
     db_cleanup();
     delete_all();
 
@@ -540,6 +888,7 @@ int main(int argc, char *argv[]) {
     if (join != 0) {
         handle_error_en(cnt, "pthread_join failed.\n");
     }
+    if (unix_path != NULL) stop_unix_listener(unix_tid);
 
     pthread_exit(0);
 
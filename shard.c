@@ -0,0 +1,121 @@
+#include "./shard.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint64_t shard_hash(const char *data, size_t len) {
+    // FNV-1a, followed by a finalizer so that keys differing only in their
+    // last bytes still spread over the whole ring
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+typedef struct point {
+    uint64_t hash;
+    int owner;
+} point_t;
+
+static int cmp_points(const void *a, const void *b) {
+    const point_t *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->owner - y->owner;
+}
+
+// Splits "host:port" at its last colon. Returns -1 if either part is empty.
+static int split_address(const char *addr, size_t len, char **host,
+                         char **port) {
+    const char *colon = addr + len;
+
+    while (colon > addr && *colon != ':') colon--;
+    if (colon == addr || colon == addr + len - 1) return -1;
+    *host = strndup(addr, colon - addr);
+    *port = strndup(colon + 1, addr + len - colon - 1);
+    return *host != NULL && *port != NULL ? 0 : -1;
+}
+
+int shard_ring_init(shard_ring_t *ring, const char *list, int vnodes) {
+    const char *p = list;
+    point_t *points;
+    int max_shards = 1;
+
+    memset(ring, 0, sizeof(*ring));
+    if (vnodes < 1 || *list == '\0') return -1;
+
+    for (p = list; *p != '\0'; p++) max_shards += *p == ',';
+    ring->hosts = calloc(max_shards, sizeof(char *));
+    ring->ports = calloc(max_shards, sizeof(char *));
+    if (ring->hosts == NULL || ring->ports == NULL) goto fail;
+    for (p = list; ring->num_shards < max_shards; p++) {
+        size_t len = strcspn(p, ",");
+        int n = ring->num_shards++;
+        if (split_address(p, len, &ring->hosts[n], &ring->ports[n]) != 0) {
+            goto fail;
+        }
+        p += len;
+    }
+
+    ring->num_points = ring->num_shards * vnodes;
+    points = malloc(ring->num_points * sizeof(point_t));
+    ring->points = malloc(ring->num_points * sizeof(uint64_t));
+    ring->owners = malloc(ring->num_points * sizeof(int));
+    if (points == NULL || ring->points == NULL || ring->owners == NULL) {
+        free(points);
+        goto fail;
+    }
+    for (int s = 0; s < ring->num_shards; s++) {
+        for (int v = 0; v < vnodes; v++) {
+            char label[512];
+            int len = snprintf(label, sizeof(label), "%s:%s#%d", ring->hosts[s],
+                               ring->ports[s], v);
+            points[s * vnodes + v].hash = shard_hash(label, len);
+            points[s * vnodes + v].owner = s;
+        }
+    }
+    qsort(points, ring->num_points, sizeof(point_t), cmp_points);
+    for (int i = 0; i < ring->num_points; i++) {
+        ring->points[i] = points[i].hash;
+        ring->owners[i] = points[i].owner;
+    }
+    free(points);
+    return 0;
+
+fail:
+    shard_ring_destroy(ring);
+    return -1;
+}
+
+void shard_ring_destroy(shard_ring_t *ring) {
+    for (int i = 0; i < ring->num_shards; i++) {
+        free(ring->hosts[i]);
+        free(ring->ports[i]);
+    }
+    free(ring->hosts);
+    free(ring->ports);
+    free(ring->points);
+    free(ring->owners);
+    memset(ring, 0, sizeof(*ring));
+}
+
+int shard_for_key(const shard_ring_t *ring, const char *key) {
+    uint64_t h = shard_hash(key, strlen(key));
+    int lo = 0, hi = ring->num_points;
+
+    // first point at or after h, wrapping around to the first point
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ring->points[mid] < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return ring->owners[lo == ring->num_points ? 0 : lo];
+}
@@ -0,0 +1,50 @@
+#ifndef SHARD_H_
+#define SHARD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Consistent hashing of keys onto a set of servers ("shards"). Every shard is
+ * placed on a 64-bit hash ring at vnodes points, derived from its address, and
+ * a key belongs to the shard owning the first point at or after the key's
+ * hash. Adding or removing a shard thus only moves the keys between its points
+ * and their predecessors, about 1/n of them, and the virtual nodes keep the
+ * shares of the shards within a few percent of each other.
+ */
+
+// Points per shard unless the caller asks for another number.
+#define SHARD_VNODES 160
+
+typedef struct shard_ring {
+    int num_shards;
+    char **hosts;  // address of each shard, split into host and port
+    char **ports;
+    int num_points;
+    uint64_t *points;  // sorted
+    int *owners;       // shard owning each point
+} shard_ring_t;
+
+/*
+ * Builds a ring from a comma-separated list of host:port addresses with
+ * vnodes points per shard. Returns 0 on success or -1 if the list is
+ * malformed or memory runs out.
+ */
+int shard_ring_init(shard_ring_t *ring, const char *list, int vnodes);
+
+/*
+ * Frees the memory held by ring.
+ */
+void shard_ring_destroy(shard_ring_t *ring);
+
+/*
+ * Returns the index of the shard that key belongs to.
+ */
+int shard_for_key(const shard_ring_t *ring, const char *key);
+
+/*
+ * 64-bit hash used for both keys and ring points.
+ */
+uint64_t shard_hash(const char *data, size_t len);
+
+#endif  // SHARD_H_
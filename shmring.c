@@ -0,0 +1,247 @@
+#define _GNU_SOURCE  // for memfd_create()
+#include "./shmring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_MAGIC 0x53484d31  // "SHM1"
+
+// Rounds to spin before sleeping; 0 on a single CPU, where spinning only
+// keeps the other side from running. -1 until first needed.
+static int spin_limit = -1;
+
+static long futex(uint32_t *addr, int op, uint32_t val, long long timeout_ns) {
+    struct timespec ts = {timeout_ns / 1000000000LL, timeout_ns % 1000000000LL};
+    return syscall(SYS_futex, addr, op, val, timeout_ns < 0 ? NULL : &ts, NULL,
+                   0);
+}
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static int spins(void) {
+    int n = __atomic_load_n(&spin_limit, __ATOMIC_RELAXED);
+    if (n < 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+        __atomic_store_n(&spin_limit, n, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+size_t shm_put(shm_ring_t *ring, const char *data, size_t len) {
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t used = (uint32_t)(tail - head);
+    size_t off = tail % SHM_RING_SIZE, first;
+
+    // the other side can write to the ring, so don't trust it to be sane
+    if (used > SHM_RING_SIZE) return 0;
+    if (len > SHM_RING_SIZE - used) len = SHM_RING_SIZE - used;
+    if (len == 0) return 0;
+    first = len < SHM_RING_SIZE - off ? len : SHM_RING_SIZE - off;
+    memcpy(ring->data + off, data, first);
+    memcpy(ring->data, data + first, len - first);
+    __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+    // pairs with the fence in ring_wait(): either the consumer sees the new
+    // tail or this sees that it waits
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->consumer_waiting, __ATOMIC_RELAXED)) {
+        futex(&ring->tail, FUTEX_WAKE, 1, -1);
+    }
+    return len;
+}
+
+size_t shm_get(shm_ring_t *ring, char *buf, size_t len) {
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t avail = (uint32_t)(tail - head);
+    size_t off = head % SHM_RING_SIZE, first;
+
+    if (avail > SHM_RING_SIZE) return 0;
+    if (len > avail) len = avail;
+    if (len == 0) return 0;
+    first = len < SHM_RING_SIZE - off ? len : SHM_RING_SIZE - off;
+    memcpy(buf, ring->data + off, first);
+    memcpy(buf + first, ring->data, len - first);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->producer_waiting, __ATOMIC_RELAXED)) {
+        futex(&ring->head, FUTEX_WAKE, 1, -1);
+    }
+    return len;
+}
+
+/*
+ * Waits for the other side to move *word away from the value it had when
+ * ready() last returned 0: spins, then sleeps on the futex with *waiting set.
+ */
+static int ring_wait(shm_ring_t *ring, uint32_t *word, uint32_t *waiting,
+                     int (*ready)(shm_ring_t *), long long timeout_ns) {
+    int n = spins();
+
+    for (int i = 0; i < n; i++) {
+        if (ready(ring)) return 1;
+        cpu_relax();
+    }
+    __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t seen = __atomic_load_n(word, __ATOMIC_RELAXED);
+    if (!ready(ring)) futex(word, FUTEX_WAIT, seen, timeout_ns);
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    return ready(ring);
+}
+
+static int readable(shm_ring_t *ring) {
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head;
+}
+
+static int writable(shm_ring_t *ring) {
+    return (uint32_t)(ring->tail -
+                      __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) <
+           SHM_RING_SIZE;
+}
+
+int shm_wait_readable(shm_ring_t *ring, long long timeout_ns) {
+    return ring_wait(ring, &ring->tail, &ring->consumer_waiting, readable,
+                     timeout_ns);
+}
+
+int shm_wait_writable(shm_ring_t *ring, long long timeout_ns) {
+    return ring_wait(ring, &ring->head, &ring->producer_waiting, writable,
+                     timeout_ns);
+}
+
+int shm_peer_gone(int sock) {
+    struct pollfd pfd = {sock, POLLIN, 0};
+    return poll(&pfd, 1, 0) != 0;
+}
+
+// Reads a line from sock a byte at a time, so as not to read past it, and
+// returns 0 if it is expected.
+static int expect_line(int sock, const char *expected) {
+    char line[64];
+    size_t len = 0;
+
+    while (len < sizeof(line) - 1) {
+        ssize_t n = read(sock, line + len, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        if (line[len] == '\n') break;
+        len++;
+    }
+    line[len] = '\0';
+    return strcmp(line, expected) == 0 ? 0 : -1;
+}
+
+shm_channel_t *shm_offer(int sock) {
+    shm_channel_t *ch;
+    char byte = 'c';
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fd;
+
+    if ((fd = memfd_create("db-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0) {
+        return NULL;
+    }
+    // the server checks for the seals, without which the memory could be
+    // truncated under it
+    if (ftruncate(fd, sizeof(shm_channel_t)) < 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+        (ch = mmap(NULL, sizeof(shm_channel_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    ch->magic = SHM_MAGIC;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (write(sock, "shm\n", 4) != 4 || expect_line(sock, "shm") != 0 ||
+        sendmsg(sock, &msg, MSG_NOSIGNAL) != 1 ||
+        expect_line(sock, "ok") != 0) {
+        munmap(ch, sizeof(shm_channel_t));
+        close(fd);
+        return NULL;
+    }
+    // the mapping keeps the memory alive
+    close(fd);
+    return ch;
+}
+
+shm_channel_t *shm_accept(int sock) {
+    shm_channel_t *ch;
+    char byte;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct stat st;
+    int seals;
+    int fd = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) return NULL;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        return NULL;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    // the size is checked once it is sealed, so that the client can't shrink
+    // the memory under the mapping (SIGBUS) or grow it afterwards
+    seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 ||
+        (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) !=
+            (F_SEAL_SHRINK | F_SEAL_GROW) ||
+        fstat(fd, &st) < 0 || st.st_size != sizeof(shm_channel_t) ||
+        (ch = mmap(NULL, sizeof(shm_channel_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    if (ch->magic != SHM_MAGIC) {
+        munmap(ch, sizeof(shm_channel_t));
+        return NULL;
+    }
+    return ch;
+}
+
+void shm_close(shm_channel_t *ch, int client) {
+    if (ch == NULL) return;
+    if (client) {
+        __atomic_store_n(&ch->closed, 1, __ATOMIC_RELEASE);
+        futex(&ch->commands.tail, FUTEX_WAKE, 1, -1);
+    }
+    munmap(ch, sizeof(shm_channel_t));
+}
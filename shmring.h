@@ -0,0 +1,89 @@
+#ifndef SHMRING_H_
+#define SHMRING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared-memory transport for clients on the same host as the server. A
+ * client connected to the server's Unix socket (see the -u option) sends the
+ * line "shm"; the server answers "shm", the client passes it a memfd holding
+ * a channel (with SCM_RIGHTS), and the server answers "ok" once it has mapped
+ * the channel. From then on commands and replies go through the channel's
+ * two rings, in the same newline-terminated format as on a socket, and the
+ * socket is only used to notice that the other side has gone away.
+ *
+ * Each ring has a single producer and a single consumer, which own its tail
+ * and head respectively and publish them with release stores. A side that
+ * finds its ring empty (or full) spins for up to SHM_SPIN rounds (not at all
+ * on a single CPU), then flags that it waits and sleeps on a futex on the
+ * tail (or head). The other side only makes the futex_wake() system call if
+ * it sees that flag, so while commands keep arriving neither side makes
+ * system calls.
+ */
+
+#define SHM_RING_SIZE (256 * 1024)  // bytes per ring, a power of two
+#define SHM_SPIN 1000
+
+// The consumer waits on tail and the producer on head; the two are kept on
+// cache lines of their own.
+typedef struct shm_ring {
+    uint32_t tail;  // bytes ever written
+    uint32_t consumer_waiting;
+    char pad1[56];
+    uint32_t head;  // bytes ever read
+    uint32_t producer_waiting;
+    char pad2[56];
+    char data[SHM_RING_SIZE];
+} shm_ring_t;
+
+typedef struct shm_channel {
+    uint32_t magic;
+    uint32_t closed;  // set by the client once it stops using the channel
+    char pad[56];
+    shm_ring_t commands;  // to the server
+    shm_ring_t replies;   // and back
+} shm_channel_t;
+
+/*
+ * Client side of the handshake on sock, a connected Unix socket with nothing
+ * in flight: creates a channel and hands it to the server. Returns the
+ * channel, or NULL if it could not be set up or the server refused it.
+ */
+shm_channel_t *shm_offer(int sock);
+
+/*
+ * Server side of the handshake, once "shm" has been read from sock and
+ * answered: receives the channel the client sends. Returns NULL if none
+ * arrives or it is not a channel.
+ */
+shm_channel_t *shm_accept(int sock);
+
+/*
+ * Unmaps a channel. The client's side marks it closed first, and wakes the
+ * server if it sleeps on it.
+ */
+void shm_close(shm_channel_t *ch, int client);
+
+/*
+ * Copies up to len bytes of data into (or out of) the ring without waiting,
+ * waking the other side if it waits. Returns the number of bytes copied.
+ */
+size_t shm_put(shm_ring_t *ring, const char *data, size_t len);
+size_t shm_get(shm_ring_t *ring, char *buf, size_t len);
+
+/*
+ * Waits until the ring has bytes to read (or room to write), or timeout_ns
+ * nanoseconds have passed (forever if negative). Returns 1 if it has and 0
+ * otherwise.
+ */
+int shm_wait_readable(shm_ring_t *ring, long long timeout_ns);
+int shm_wait_writable(shm_ring_t *ring, long long timeout_ns);
+
+/*
+ * Returns 1 if the peer on sock, whose socket carries no data after the
+ * handshake, has closed it or sent something unexpected.
+ */
+int shm_peer_gone(int sock);
+
+#endif  // SHMRING_H_
@@ -0,0 +1,197 @@
+#include "./slowlog.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+typedef struct slowlog_entry {
+    // 2 * lap + 1 while the entry of the lap-th round of the ring is being
+    // written, 2 * lap + 2 once it has been
+    unsigned long seq;
+    long long when_ms;  // wall clock time the command was read
+    long long parse_ns;
+    long long wait_ns;
+    long long walk_ns;
+    long long write_ns;
+    int command_len;  // before truncation
+    char client[INET6_ADDRSTRLEN + 8];
+    char command[SLOWLOG_CMDLEN];
+} slowlog_entry_t;
+
+// The command the calling thread is timing.
+typedef struct slowlog_timer {
+    long long start_ns;  // 0 if none
+    long long walk_ns;   // when it reached the tree, or 0
+    long long wait_ns;
+    long long end_ns;
+    FILE *cxstr;
+    const char *command;
+} slowlog_timer_t;
+
+static long long threshold_ns;  // 0 while the log is off
+static slowlog_entry_t ring[SLOWLOG_ENTRIES];
+static unsigned long next;  // number of entries ever claimed
+static unsigned long dropped;
+
+static __thread slowlog_timer_t cur;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void slowlog_configure(long threshold_us) {
+    // a threshold of 0 would turn the log off
+    threshold_ns = threshold_us > 0 ? threshold_us * 1000LL : 1;
+}
+
+void slowlog_begin(FILE *cxstr, const char *command) {
+    if (threshold_ns == 0) return;
+    cur.start_ns = now_ns();
+    cur.walk_ns = 0;
+    cur.wait_ns = 0;
+    cur.end_ns = 0;
+    cur.cxstr = cxstr;
+    cur.command = command;
+}
+
+void slowlog_walk_begin(void) {
+    if (cur.start_ns != 0 && cur.walk_ns == 0) cur.walk_ns = now_ns();
+}
+
+long long slowlog_wait_begin(void) { return cur.start_ns != 0 ? now_ns() : 0; }
+
+void slowlog_wait_end(long long start) {
+    if (start != 0) cur.wait_ns += now_ns() - start;
+}
+
+void slowlog_end(void) {
+    if (cur.start_ns != 0) cur.end_ns = now_ns();
+}
+
+// Writes the address of the peer of cxstr to buf, or "-" if it has none.
+static void peer_name(FILE *cxstr, char *buf, size_t size) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    char host[INET6_ADDRSTRLEN];
+
+    snprintf(buf, size, "-");
+    if (getpeername(fileno(cxstr), (struct sockaddr *)&addr, &addrlen) != 0) {
+        return;
+    }
+    if (addr.ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        snprintf(buf, size, "%s:%d", host, ntohs(in->sin_port));
+    } else if (addr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        snprintf(buf, size, "[%s]:%d", host, ntohs(in6->sin6_port));
+    } else if (addr.ss_family == AF_UNIX) {
+        snprintf(buf, size, "local");
+    }
+}
+
+void slowlog_replied(void) {
+    long long now, walk;
+    unsigned long idx, lap, seq;
+    slowlog_entry_t *e;
+    struct timespec ts;
+    size_t len;
+
+    if (cur.start_ns == 0) return;
+    now = now_ns();
+    if (cur.end_ns == 0 || now - cur.start_ns < threshold_ns) {
+        cur.start_ns = 0;
+        return;
+    }
+
+    idx = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+    lap = idx / SLOWLOG_ENTRIES;
+    e = &ring[idx % SLOWLOG_ENTRIES];
+    // claim the entry, unless another writer is at it or a later lap has
+    // already been written to it
+    seq = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || seq > 2 * lap ||
+        !__atomic_compare_exchange_n(&e->seq, &seq, 2 * lap + 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        cur.start_ns = 0;
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    walk = cur.walk_ns != 0 ? cur.walk_ns : cur.end_ns;
+    e->when_ms = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 -
+                 (now - cur.start_ns) / 1000000;
+    e->parse_ns = walk - cur.start_ns;
+    e->wait_ns = cur.wait_ns;
+    e->walk_ns = cur.end_ns - walk - cur.wait_ns;
+    e->write_ns = now - cur.end_ns;
+    len = strcspn(cur.command, "\r\n");
+    e->command_len = (int)len;
+    if (len >= SLOWLOG_CMDLEN) len = SLOWLOG_CMDLEN - 1;
+    memcpy(e->command, cur.command, len);
+    e->command[len] = '\0';
+    peer_name(cur.cxstr, e->client, sizeof(e->client));
+
+    __atomic_store_n(&e->seq, 2 * lap + 2, __ATOMIC_RELEASE);
+    cur.start_ns = 0;
+}
+
+// Copies the entry claimed as the idx-th into copy; returns 0 if it has been
+// overwritten or is being written.
+static int read_entry(unsigned long idx, slowlog_entry_t *copy) {
+    slowlog_entry_t *e = &ring[idx % SLOWLOG_ENTRIES];
+    unsigned long seq = 2 * (idx / SLOWLOG_ENTRIES) + 2;
+
+    if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != seq) return 0;
+    memcpy(copy, e, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq;
+}
+
+int slowlog_print(FILE *out, int max, const char *sep) {
+    unsigned long last = __atomic_load_n(&next, __ATOMIC_ACQUIRE);
+    unsigned long first = last > SLOWLOG_ENTRIES ? last - SLOWLOG_ENTRIES : 0;
+    slowlog_entry_t e;
+    struct tm tm;
+    time_t secs;
+    char when[32];
+    int printed = 0;
+
+    for (unsigned long idx = last; idx > first && printed < max; idx--) {
+        if (!read_entry(idx - 1, &e)) continue;
+        secs = e.when_ms / 1000;
+        localtime_r(&secs, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+        fprintf(out,
+                "%s.%03lld %s total %lldus parse %lldus lock %lldus walk "
+                "%lldus write %lldus: %s%s",
+                when, e.when_ms % 1000, e.client,
+                (e.parse_ns + e.wait_ns + e.walk_ns + e.write_ns) / 1000,
+                e.parse_ns / 1000, e.wait_ns / 1000, e.walk_ns / 1000,
+                e.write_ns / 1000, e.command,
+                e.command_len >= SLOWLOG_CMDLEN ? "..." : "");
+        fputs(sep, out);
+        printed++;
+    }
+    return printed;
+}
+
+void slowlog_print_status(FILE *out) {
+    if (threshold_ns == 0) {
+        fprintf(out, "slow log off\n");
+        return;
+    }
+    unsigned long claimed = __atomic_load_n(&next, __ATOMIC_RELAXED);
+    unsigned long lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+
+    fprintf(out,
+            "%lu commands over %lldus logged (the last %d are kept), %lu "
+            "dropped\n",
+            claimed - lost, threshold_ns / 1000, SLOWLOG_ENTRIES, lost);
+}
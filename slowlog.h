@@ -0,0 +1,76 @@
+#ifndef SLOWLOG_H_
+#define SLOWLOG_H_
+
+#include <stdio.h>
+
+/*
+ * Slow log: the last SLOWLOG_ENTRIES client commands that took longer than a
+ * threshold, from the moment the command was read to the moment its response
+ * was written, together with the client's address and how that time was
+ * split between
+ *
+ *   - parsing: from reading the command until it first touches the tree (or
+ *     the query cache),
+ *   - lock waits: blocked on node locks, or spinning on nodes being changed by
+ *     optimistic writers,
+ *   - walking: the rest of the time until interpret_command() returns,
+ *   - writing: sending the response.
+ *
+ * The entries are kept in a fixed ring that threads add to without a lock;
+ * readers skip an entry being overwritten. Commands are truncated to
+ * SLOWLOG_CMDLEN bytes. With the log off (the default) none of the phases are
+ * timed.
+ */
+
+#define SLOWLOG_ENTRIES 128
+#define SLOWLOG_CMDLEN 256
+
+/*
+ * Turns the slow log on for commands that take at least threshold_us
+ * microseconds. Must be called before any client thread is started.
+ */
+void slowlog_configure(long threshold_us);
+
+/*
+ * Starts timing a command read from the connection cxstr. command must stay
+ * unchanged until slowlog_replied().
+ */
+void slowlog_begin(FILE *cxstr, const char *command);
+
+/*
+ * Notes that the calling thread's command has reached the tree. Only the
+ * first call after slowlog_begin() counts.
+ */
+void slowlog_walk_begin(void);
+
+/*
+ * Bracket a wait for a lock: slowlog_wait_end() adds the time since
+ * slowlog_wait_begin() returned start to the command's lock waits. start is 0
+ * if no command is being timed.
+ */
+long long slowlog_wait_begin(void);
+void slowlog_wait_end(long long start);
+
+/*
+ * Notes that interpret_command() has returned.
+ */
+void slowlog_end(void);
+
+/*
+ * Called once the response to the command has been sent: logs the command if
+ * it was slow. Does nothing if no command is being timed.
+ */
+void slowlog_replied(void);
+
+/*
+ * Writes up to max of the logged commands, newest first, each followed by
+ * sep. Returns the number written.
+ */
+int slowlog_print(FILE *out, int max, const char *sep);
+
+/*
+ * Prints the threshold and how many commands have been logged.
+ */
+void slowlog_print_status(FILE *out);
+
+#endif  // SLOWLOG_H_
@@ -0,0 +1,131 @@
+#include "./stats.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./comm.h"
+
+/*
+ * Counters of one thread. Only the owner writes them, with relaxed atomic
+ * stores so that readers see whole values. Slots are never freed: they form
+ * an append-only list that readers walk without locking, and a slot whose
+ * thread has exited is handed to the next thread that needs one.
+ */
+typedef struct stats_slot {
+    long keys;
+    long bytes;
+    long depths[STATS_MAX_DEPTH];
+    long cache_hits;
+    long cache_misses;
+    int in_use;
+    struct stats_slot *next;
+} stats_slot_t;
+
+static stats_slot_t *slots;
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+static __thread stats_slot_t *my_slot;
+
+// pthread_key_t destructor: gives the slot of an exiting thread back.
+static void release_slot(void *slot) {
+    // the release hands the counters over to the slot's next owner
+    __atomic_store_n(&((stats_slot_t *)slot)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_slot_key(void) {
+    int err;
+    if ((err = pthread_key_create(&slot_key, release_slot)) != 0) {
+        handle_error_en(err, "pthread_key_create");
+    }
+}
+
+static stats_slot_t *get_slot(void) {
+    stats_slot_t *slot;
+    int err;
+
+    if (my_slot != NULL) return my_slot;
+    pthread_once(&slot_key_once, make_slot_key);
+    if ((err = pthread_mutex_lock(&slots_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    for (slot = slots; slot != NULL; slot = slot->next) {
+        if (!__atomic_load_n(&slot->in_use, __ATOMIC_ACQUIRE)) break;
+    }
+    if (slot == NULL) {
+        if ((slot = calloc(1, sizeof(stats_slot_t))) == NULL) {
+            handle_error_en(ENOMEM, "calloc");
+        }
+        slot->next = slots;
+        __atomic_store_n(&slots, slot, __ATOMIC_RELEASE);
+    }
+    slot->in_use = 1;
+    if ((err = pthread_mutex_unlock(&slots_mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    if ((err = pthread_setspecific(slot_key, slot)) != 0) {
+        handle_error_en(err, "pthread_setspecific");
+    }
+    return my_slot = slot;
+}
+
+// Adds delta to a counter of the calling thread's slot.
+static inline void bump(long *counter, long delta) {
+    __atomic_store_n(counter,
+                     __atomic_load_n(counter, __ATOMIC_RELAXED) + delta,
+                     __ATOMIC_RELAXED);
+}
+
+static inline int bucket(int depth) {
+    return depth < STATS_MAX_DEPTH ? depth : STATS_MAX_DEPTH - 1;
+}
+
+void stats_add_key(int depth) {
+    stats_slot_t *slot = get_slot();
+    bump(&slot->keys, 1);
+    bump(&slot->depths[bucket(depth)], 1);
+}
+
+void stats_remove_key(int depth) {
+    stats_slot_t *slot = get_slot();
+    bump(&slot->keys, -1);
+    bump(&slot->depths[bucket(depth)], -1);
+}
+
+void stats_move_key(int from, int to) {
+    stats_slot_t *slot = get_slot();
+    if (bucket(from) == bucket(to)) return;
+    bump(&slot->depths[bucket(from)], -1);
+    bump(&slot->depths[bucket(to)], 1);
+}
+
+void stats_add_bytes(long delta) { bump(&get_slot()->bytes, delta); }
+
+void stats_cache_lookup(int hit) {
+    stats_slot_t *slot = get_slot();
+    bump(hit ? &slot->cache_hits : &slot->cache_misses, 1);
+}
+
+long stats_bytes(void) {
+    long bytes = 0;
+    for (stats_slot_t *slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE);
+         slot != NULL; slot = slot->next) {
+        bytes += __atomic_load_n(&slot->bytes, __ATOMIC_RELAXED);
+    }
+    return bytes;
+}
+
+void stats_read(stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (stats_slot_t *slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE);
+         slot != NULL; slot = slot->next) {
+        out->keys += __atomic_load_n(&slot->keys, __ATOMIC_RELAXED);
+        out->bytes += __atomic_load_n(&slot->bytes, __ATOMIC_RELAXED);
+        out->cache_hits += __atomic_load_n(&slot->cache_hits, __ATOMIC_RELAXED);
+        out->cache_misses +=
+            __atomic_load_n(&slot->cache_misses, __ATOMIC_RELAXED);
+        for (int d = 0; d < STATS_MAX_DEPTH; d++) {
+            out->depths[d] +=
+                __atomic_load_n(&slot->depths[d], __ATOMIC_RELAXED);
+        }
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+/*
+ * Tree statistics kept incrementally, so that reading them costs the same
+ * however large the tree is: the number of keys, the bytes used by nodes and
+ * their strings, and a histogram of key depths.
+ *
+ * Every thread updates counters of its own, which readers add up, so the
+ * writers never contend on a shared cache line. The counters are deltas: a
+ * thread that removes more keys than it added has a negative key count. When
+ * a thread exits its counters are kept and handed to the next new thread.
+ *
+ * The depth of a key is recorded when it is added. Removing a node moves the
+ * subtree below it up a level, which can't be tracked without visiting that
+ * subtree, so a recorded depth is an upper bound. It becomes exact again
+ * when an operation finds the key (see stats_move_key()).
+ */
+
+// Depths of STATS_MAX_DEPTH - 1 and more share the last bucket.
+#define STATS_MAX_DEPTH 128
+
+typedef struct stats {
+    long keys;
+    long bytes;
+    long depths[STATS_MAX_DEPTH];  // keys by depth, the root's children at 1
+    long cache_hits;               // query cache lookups (see qcache.h)
+    long cache_misses;
+} stats_t;
+
+/*
+ * Counts a key added at the given depth.
+ */
+void stats_add_key(int depth);
+
+/*
+ * Counts the removal of a key recorded at the given depth.
+ */
+void stats_remove_key(int depth);
+
+/*
+ * Moves a key's recorded depth from one depth to another.
+ */
+void stats_move_key(int from, int to);
+
+/*
+ * Adds delta to the bytes used.
+ */
+void stats_add_bytes(long delta);
+
+/*
+ * Counts a query cache lookup, a hit if hit is nonzero.
+ */
+void stats_cache_lookup(int hit);
+
+/*
+ * Returns the bytes used, summed over all threads.
+ */
+long stats_bytes(void);
+
+/*
+ * Sums the counters of all threads into out. The sum is not a snapshot:
+ * changes made while it runs may be partly included.
+ */
+void stats_read(stats_t *out);
+
+#endif  // STATS_H_
@@ -0,0 +1,245 @@
+#include "./ttl.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "./comm.h"
+#include "./db.h"
+
+/*
+ * The wheel has TTL_LEVELS levels of TTL_SLOTS slots. A slot on level 0 covers
+ * one tick, a slot on level n covers TTL_SLOTS^n ticks. With 100ms ticks the
+ * levels span 6.4s, 6.8min, 7.3h and 19.4 days; timers further out than that
+ * are parked in the last level and re-filed when their slot comes around.
+ */
+#define TTL_LEVEL_BITS 6
+#define TTL_SLOTS (1 << TTL_LEVEL_BITS)
+#define TTL_LEVELS 4
+#define TTL_SPAN (1ULL << (TTL_LEVEL_BITS * TTL_LEVELS))
+
+// Maximum number of keys handed to db_expire() at once.
+#define TTL_BATCH 256
+
+typedef struct ttl_timer {
+    struct ttl_timer *next;
+    long long expires;
+    char name[];
+} ttl_timer_t;
+
+typedef struct ttl_wheel {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    ttl_timer_t *slots[TTL_LEVELS][TTL_SLOTS];
+    unsigned long long tick;  // next tick to be processed
+    long pending;
+    int running;
+    pthread_t thread;
+} ttl_wheel_t;
+
+static ttl_wheel_t wheel = {PTHREAD_MUTEX_INITIALIZER};
+static pthread_once_t wheel_once = PTHREAD_ONCE_INIT;
+
+long long ttl_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void wheel_init(void) {
+    pthread_condattr_t attr;
+    int err;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if ((err = pthread_cond_init(&wheel.cond, &attr)) != 0) {
+        handle_error_en(err, "pthread_cond_init");
+    }
+    pthread_condattr_destroy(&attr);
+    wheel.tick = ttl_now_ms() / TTL_TICK_MS;
+}
+
+static void wheel_lock(void) {
+    int err;
+    if ((err = pthread_mutex_lock(&wheel.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static void wheel_unlock(void) {
+    int err;
+    if ((err = pthread_mutex_unlock(&wheel.mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+// Files a timer into its slot. Must be called with the wheel mutex held.
+static void wheel_insert(ttl_timer_t *timer) {
+    unsigned long long due = (timer->expires + TTL_TICK_MS - 1) / TTL_TICK_MS;
+    unsigned long long delta;
+    int level;
+
+    if (due < wheel.tick) due = wheel.tick;
+    delta = due - wheel.tick;
+    if (delta >= TTL_SPAN) {
+        due = wheel.tick + TTL_SPAN - 1;
+        delta = TTL_SPAN - 1;
+    }
+    for (level = 0; level < TTL_LEVELS - 1; level++) {
+        if (delta < 1ULL << (TTL_LEVEL_BITS * (level + 1))) break;
+    }
+
+    int slot = (due >> (TTL_LEVEL_BITS * level)) & (TTL_SLOTS - 1);
+    timer->next = wheel.slots[level][slot];
+    wheel.slots[level][slot] = timer;
+}
+
+/*
+ * Processes the next tick: timers in higher-level slots that now fall within
+ * the range of a lower level are re-filed, and the timers in the current
+ * level-0 slot are moved to the due list. Must be called with the wheel
+ * mutex held.
+ */
+static void wheel_advance(ttl_timer_t **due) {
+    unsigned long long t = wheel.tick;
+
+    for (int level = TTL_LEVELS - 1; level > 0; level--) {
+        int shift = TTL_LEVEL_BITS * level;
+        if ((t & ((1ULL << shift) - 1)) != 0) continue;
+        int slot = (t >> shift) & (TTL_SLOTS - 1);
+        ttl_timer_t *timer = wheel.slots[level][slot];
+        wheel.slots[level][slot] = NULL;
+        while (timer != NULL) {
+            ttl_timer_t *next = timer->next;
+            wheel_insert(timer);
+            timer = next;
+        }
+    }
+
+    int slot = t & (TTL_SLOTS - 1);
+    ttl_timer_t *timer = wheel.slots[0][slot];
+    wheel.slots[0][slot] = NULL;
+    while (timer != NULL) {
+        ttl_timer_t *next = timer->next;
+        timer->next = *due;
+        *due = timer;
+        wheel.pending--;
+        timer = next;
+    }
+    wheel.tick = t + 1;
+}
+
+void ttl_schedule(const char *name, long long expires) {
+    size_t len = strlen(name);
+    ttl_timer_t *timer = malloc(sizeof(ttl_timer_t) + len + 1);
+
+    if (timer == NULL) {
+        // the key still expires lazily on access
+        perror("malloc");
+        return;
+    }
+    memcpy(timer->name, name, len + 1);
+    timer->expires = expires;
+
+    pthread_once(&wheel_once, wheel_init);
+    wheel_lock();
+    wheel_insert(timer);
+    wheel.pending++;
+    wheel_unlock();
+}
+
+// Hands the due timers to db_expire() in batches and frees them.
+static void expire_due(ttl_timer_t *due) {
+    char *names[TTL_BATCH];
+    ttl_timer_t *batch = due;
+
+    while (batch != NULL) {
+        int n = 0;
+        ttl_timer_t *timer = batch;
+        for (; timer != NULL && n < TTL_BATCH; timer = timer->next) {
+            names[n++] = timer->name;
+        }
+        db_expire(names, n);
+        while (batch != timer) {
+            ttl_timer_t *next = batch->next;
+            free(batch);
+            batch = next;
+        }
+    }
+}
+
+static void *run_expiry(void *arg) {
+    wheel_lock();
+    while (wheel.running) {
+        ttl_timer_t *due = NULL;
+        unsigned long long now = ttl_now_ms() / TTL_TICK_MS;
+        while (wheel.tick <= now) {
+            wheel_advance(&due);
+        }
+
+        if (due != NULL) {
+            wheel_unlock();
+            expire_due(due);
+            wheel_lock();
+            continue;
+        }
+
+        struct timespec next;
+        unsigned long long ms = wheel.tick * TTL_TICK_MS;
+        next.tv_sec = ms / 1000;
+        next.tv_nsec = (ms % 1000) * 1000000;
+        int err = pthread_cond_timedwait(&wheel.cond, &wheel.mutex, &next);
+        if (err != 0 && err != ETIMEDOUT) {
+            handle_error_en(err, "pthread_cond_timedwait");
+        }
+    }
+    wheel_unlock();
+    return NULL;
+}
+
+void ttl_start(void) {
+    int err;
+
+    pthread_once(&wheel_once, wheel_init);
+    wheel_lock();
+    wheel.running = 1;
+    if ((err = pthread_create(&wheel.thread, 0, run_expiry, 0)) != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+    wheel_unlock();
+}
+
+void ttl_stop(void) {
+    int err;
+
+    pthread_once(&wheel_once, wheel_init);
+    wheel_lock();
+    int running = wheel.running;
+    wheel.running = 0;
+    if ((err = pthread_cond_signal(&wheel.cond)) != 0) {
+        handle_error_en(err, "pthread_cond_signal");
+    }
+    wheel_unlock();
+
+    if (running && (err = pthread_join(wheel.thread, 0)) != 0) {
+        handle_error_en(err, "pthread_join");
+    }
+
+    for (int level = 0; level < TTL_LEVELS; level++) {
+        for (int slot = 0; slot < TTL_SLOTS; slot++) {
+            ttl_timer_t *timer = wheel.slots[level][slot];
+            while (timer != NULL) {
+                ttl_timer_t *next = timer->next;
+                free(timer);
+                timer = next;
+            }
+            wheel.slots[level][slot] = NULL;
+        }
+    }
+    wheel.pending = 0;
+}
+
+long ttl_pending(void) {
+    return __atomic_load_n(&wheel.pending, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,45 @@
+#ifndef TTL_H_
+#define TTL_H_
+
+/*
+ * Key expiry. Keys added or updated with a TTL get an absolute expiry time
+ * (in milliseconds on the monotonic clock) stored in their node, which reads
+ * check lazily, and a timer in a hierarchical timing wheel. A single
+ * background thread advances the wheel and hands the keys whose timers fired
+ * to db_expire() in batches, so expiry never scans the tree.
+ *
+ * Timers are not cancelled when a key is updated or removed; db_expire()
+ * re-checks the expiry time stored in the node, so a stale timer is simply
+ * ignored.
+ */
+
+// Resolution of the wheel.
+#define TTL_TICK_MS 100
+
+/*
+ * Returns the current time in milliseconds on the clock used for expiry.
+ */
+long long ttl_now_ms(void);
+
+/*
+ * Arranges for db_expire() to be called on name once expires (a time returned
+ * by ttl_now_ms() plus the TTL) has passed.
+ */
+void ttl_schedule(const char *name, long long expires);
+
+/*
+ * Starts the expiry thread.
+ */
+void ttl_start(void);
+
+/*
+ * Stops the expiry thread, if it is running, and frees all pending timers.
+ */
+void ttl_stop(void);
+
+/*
+ * Returns the number of timers currently in the wheel.
+ */
+long ttl_pending(void);
+
+#endif  // TTL_H_
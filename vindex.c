@@ -0,0 +1,280 @@
+#include "./vindex.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./comm.h"
+
+typedef struct ventry {
+    const char *name;
+    const char *value;
+} ventry_t;
+
+// The keys sharing one value, in a linear-probing hash set keyed by the
+// address of the name, which is unique to the key. value is the value of one
+// of the entries, so that it stays valid.
+typedef struct vgroup {
+    uint64_t hash;
+    const char *value;
+    ventry_t *slots;  // empty slots have a NULL name
+    int count;
+    int cap;  // a power of two, at least twice count
+    struct vgroup *next;
+} vgroup_t;
+
+typedef struct vstripe {
+    pthread_mutex_t lock;
+    vgroup_t **buckets;
+    size_t num_buckets;  // a power of two
+    long groups;
+    long entries;
+    long bytes;
+    long lost;  // entries that memory ran out for and are still in the tree
+} vstripe_t;
+
+static int enabled;
+static vstripe_t stripes[VINDEX_STRIPES];
+
+static uint64_t hash_value(const char *value) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)value; *p; p++) {
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    }
+    return h ^ (h >> 32);
+}
+
+static inline vstripe_t *stripe_of(uint64_t hash) {
+    return &stripes[hash % VINDEX_STRIPES];
+}
+
+static inline vgroup_t **bucket_of(vstripe_t *s, uint64_t hash) {
+    return &s->buckets[(hash / VINDEX_STRIPES) & (s->num_buckets - 1)];
+}
+
+static vgroup_t *find_group(vstripe_t *s, uint64_t hash, const char *value) {
+    if (s->num_buckets == 0) return NULL;
+    for (vgroup_t *g = *bucket_of(s, hash); g != NULL; g = g->next) {
+        if (g->hash == hash && strcmp(g->value, value) == 0) {
+            return g;
+        }
+    }
+    return NULL;
+}
+
+// Doubles the buckets of s, which must be locked. Returns -1 if out of memory.
+static int grow_buckets(vstripe_t *s) {
+    size_t n = s->num_buckets ? s->num_buckets * 2 : 16;
+    vgroup_t **buckets = calloc(n, sizeof(vgroup_t *));
+
+    if (buckets == NULL) return -1;
+    for (size_t i = 0; i < s->num_buckets; i++) {
+        vgroup_t *g = s->buckets[i];
+        while (g != NULL) {
+            vgroup_t *next = g->next;
+            vgroup_t **b = &buckets[(g->hash / VINDEX_STRIPES) & (n - 1)];
+            g->next = *b;
+            *b = g;
+            g = next;
+        }
+    }
+    s->bytes += (n - s->num_buckets) * sizeof(vgroup_t *);
+    free(s->buckets);
+    s->buckets = buckets;
+    s->num_buckets = n;
+    return 0;
+}
+
+static inline int home_slot(vgroup_t *g, const char *name) {
+    return ((uintptr_t)name * 0x9E3779B97F4A7C15ULL >> 32) & (g->cap - 1);
+}
+
+static void slot_insert(vgroup_t *g, ventry_t e) {
+    int i = home_slot(g, e.name);
+    while (g->slots[i].name != NULL) i = (i + 1) & (g->cap - 1);
+    g->slots[i] = e;
+}
+
+// Resizes the slots of g to cap. Returns -1 if out of memory.
+static int resize_group(vstripe_t *s, vgroup_t *g, int cap) {
+    ventry_t *old = g->slots;
+    int old_cap = g->cap;
+
+    if ((g->slots = calloc(cap, sizeof(ventry_t))) == NULL) {
+        g->slots = old;
+        return -1;
+    }
+    g->cap = cap;
+    for (int i = 0; i < old_cap; i++) {
+        if (old[i].name != NULL) slot_insert(g, old[i]);
+    }
+    s->bytes += (long)(cap - old_cap) * sizeof(ventry_t);
+    free(old);
+    return 0;
+}
+
+// Removes the entry for name from g, if present, by shifting back the
+// entries after it that would otherwise become unreachable. Returns the
+// removed entry's value, or NULL.
+static const char *slot_remove(vgroup_t *g, const char *name) {
+    int mask = g->cap - 1;
+    int i = home_slot(g, name);
+    const char *value;
+
+    while (g->slots[i].name != name) {
+        if (g->slots[i].name == NULL) return NULL;
+        i = (i + 1) & mask;
+    }
+    value = g->slots[i].value;
+    for (int j = (i + 1) & mask; g->slots[j].name != NULL; j = (j + 1) & mask) {
+        int k = home_slot(g, g->slots[j].name);
+        // the entry at j may move to i unless its home lies in (i, j]
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            g->slots[i] = g->slots[j];
+            i = j;
+        }
+    }
+    g->slots[i].name = NULL;
+    g->count--;
+    return value;
+}
+
+void vindex_enable(void) {
+    for (int i = 0; i < VINDEX_STRIPES; i++) {
+        int err;
+        if ((err = pthread_mutex_init(&stripes[i].lock, 0)) != 0) {
+            handle_error_en(err, "pthread_mutex_init");
+        }
+    }
+    enabled = 1;
+}
+
+int vindex_enabled(void) { return enabled; }
+
+void vindex_add(const char *value, const char *name) {
+    uint64_t hash = hash_value(value);
+    vstripe_t *s = stripe_of(hash);
+    vgroup_t *g;
+    int err;
+
+    if ((err = pthread_mutex_lock(&s->lock)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    if ((g = find_group(s, hash, value)) == NULL) {
+        if (s->groups >= (long)s->num_buckets && grow_buckets(s) == -1) {
+            goto lost;
+        }
+        if ((g = calloc(1, sizeof(vgroup_t))) == NULL) goto lost;
+        vgroup_t **b = bucket_of(s, hash);
+        g->hash = hash;
+        g->value = value;
+        g->next = *b;
+        *b = g;
+        s->groups++;
+        s->bytes += sizeof(vgroup_t);
+    }
+    if (2 * (g->count + 1) > g->cap &&
+        resize_group(s, g, g->cap ? g->cap * 2 : 2) == -1) {
+        goto lost;
+    }
+    slot_insert(g, (ventry_t){name, value});
+    g->count++;
+    s->entries++;
+    goto out;
+
+lost:
+    // lookups in this stripe fail until the key is removed again
+    s->lost++;
+out:
+    if ((err = pthread_mutex_unlock(&s->lock)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+void vindex_remove(const char *value, const char *name) {
+    uint64_t hash = hash_value(value);
+    vstripe_t *s = stripe_of(hash);
+    vgroup_t *g;
+    const char *removed;
+    int err;
+
+    if ((err = pthread_mutex_lock(&s->lock)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    if ((g = find_group(s, hash, value)) == NULL ||
+        (removed = slot_remove(g, name)) == NULL) {
+        // only entries that vindex_add() ran out of memory for are missing
+        if (s->lost > 0) s->lost--;
+    } else {
+        s->entries--;
+        if (g->count > 0 && removed == g->value) {
+            // the group's value is about to be freed; use another entry's
+            for (int i = 0; i < g->cap; i++) {
+                if (g->slots[i].name != NULL) {
+                    g->value = g->slots[i].value;
+                    break;
+                }
+            }
+        }
+        if (g->count == 0) {
+            vgroup_t **p = bucket_of(s, hash);
+            while (*p != g) p = &(*p)->next;
+            *p = g->next;
+            s->groups--;
+            s->bytes -= sizeof(vgroup_t) + g->cap * sizeof(ventry_t);
+            free(g->slots);
+            free(g);
+        }
+    }
+    if ((err = pthread_mutex_unlock(&s->lock)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+int vindex_lookup(const char *value, char ***names) {
+    uint64_t hash = hash_value(value);
+    vstripe_t *s = stripe_of(hash);
+    vgroup_t *g;
+    int n = 0, err;
+
+    *names = NULL;
+    if ((err = pthread_mutex_lock(&s->lock)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+    if (s->lost > 0) {
+        // the keys found would be incomplete
+        n = -1;
+    } else if ((g = find_group(s, hash, value)) != NULL &&
+               (*names = malloc(g->count * sizeof(char *))) != NULL) {
+        for (int i = 0; i < g->cap; i++) {
+            if (g->slots[i].name == NULL) continue;
+            if (((*names)[n] = strdup(g->slots[i].name)) == NULL) break;
+            n++;
+        }
+        if (n < g->count) {
+            while (n > 0) free((*names)[--n]);
+            free(*names);
+            *names = NULL;
+            n = -1;
+        }
+    } else if (g != NULL) {
+        n = -1;
+    }
+    if ((err = pthread_mutex_unlock(&s->lock)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+    return n;
+}
+
+void vindex_stats(long *values, long *entries, long *bytes) {
+    *values = *entries = *bytes = 0;
+    if (!enabled) return;
+    for (int i = 0; i < VINDEX_STRIPES; i++) {
+        vstripe_t *s = &stripes[i];
+        pthread_mutex_lock(&s->lock);
+        *values += s->groups;
+        *entries += s->entries;
+        *bytes += s->bytes;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef VINDEX_H_
+#define VINDEX_H_
+
+/*
+ * Secondary index from values to the keys holding them, for the v command.
+ * It is off unless vindex_enable() is called before any keys are added.
+ *
+ * The index stores no strings of its own: each entry points at the name and
+ * value of a node. db.c adds and removes entries while the node is
+ * write-locked, before the strings are freed, so they are valid whenever
+ * the index's own lock is held. Entries are grouped by value in a hash
+ * table split into VINDEX_STRIPES independently locked stripes.
+ *
+ * An entry is not dropped when its key expires or becomes a tombstone, only
+ * when the node is freed, so lookups return candidates that the caller
+ * checks against the tree.
+ */
+
+#define VINDEX_STRIPES 64
+
+/*
+ * Turns the index on. Must be called before any keys are added.
+ */
+void vindex_enable(void);
+
+/*
+ * Returns nonzero if the index is on.
+ */
+int vindex_enabled(void);
+
+/*
+ * Records that the key name holds value. Both strings must stay valid until
+ * the entry is removed. If memory runs out, the entry is counted as lost
+ * instead, and vindex_lookup() fails for the values in the same stripe
+ * until the key is removed.
+ */
+void vindex_add(const char *value, const char *name);
+
+/*
+ * Removes the entry added for name and value.
+ */
+void vindex_remove(const char *value, const char *name);
+
+/*
+ * Stores malloc()ed copies of the keys indexed under value in a malloc()ed
+ * array at *names and returns how many there are. Returns -1 if memory runs
+ * out, or ran out for an entry the keys could include (see vindex_add()).
+ */
+int vindex_lookup(const char *value, char ***names);
+
+/*
+ * Reports the number of distinct values and of entries in the index, and the
+ * bytes allocated for it.
+ */
+void vindex_stats(long *values, long *entries, long *bytes);
+
+#endif  // VINDEX_H_
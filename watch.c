@@ -0,0 +1,468 @@
+#include "./watch.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include "./comm.h"
+#include "./db.h"
+
+#define WATCH_KEYLEN 256  // keys are shorter, see interpret_command()
+#define WATCH_BUCKETS 1024
+#define WATCH_RETRY_MS 10  // before trying again to send to a full socket
+
+typedef struct change {
+    char name[WATCH_KEYLEN];
+    int deleted;
+} change_t;
+
+// A watch on a key (len is -1) or on the prefix of len bytes key.
+typedef struct watch {
+    struct watch *next;  // in its bucket or in the list of prefixes
+    watcher_t *watcher;
+    int len;
+    char key[];
+} watch_t;
+
+typedef struct queued {
+    char *name;
+    int deleted;
+} queued_t;
+
+typedef struct reply_line {
+    struct reply_line *next;
+    char line[];
+} reply_line_t;
+
+struct watcher {
+    struct watcher *prev;
+    struct watcher *next;
+    int fd;
+    int broken;    // a send has failed, the connection is going away
+    int overflow;  // changes were dropped since the last line was queued
+    int num_queued;
+    queued_t queue[WATCH_QUEUE];
+    reply_line_t *replies;  // replies to w and wp, in order
+    reply_line_t **replies_end;
+    char *out;  // lines being sent
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+};
+
+typedef struct watches {
+    // the watches, the watchers and their queues
+    pthread_mutex_t mutex;
+    watch_t *buckets[WATCH_BUCKETS];
+    watch_t *prefixes;
+    watcher_t *watchers;
+    int num_watchers;
+    unsigned long overflows;
+
+    // the writers' queue, two buffers that the notifier swaps
+    pthread_mutex_t changes_mutex;
+    pthread_cond_t cond;
+    change_t *changes;
+    change_t *spare;
+    int num_changes;
+    int lost;     // a change didn't fit
+    int kicked;   // a reply has been queued
+    int running;  // the notifier is
+    pthread_t thread;
+
+    int num_watches;  // read by writers without a lock
+} watches_t;
+
+static change_t buffers[2][WATCH_CHANGES];
+static watches_t watches = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                            .changes_mutex = PTHREAD_MUTEX_INITIALIZER,
+                            .cond = PTHREAD_COND_INITIALIZER,
+                            .changes = buffers[0],
+                            .spare = buffers[1]};
+
+static void lock(pthread_mutex_t *mutex) {
+    int err;
+    if ((err = pthread_mutex_lock(mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_lock");
+    }
+}
+
+static void unlock(pthread_mutex_t *mutex) {
+    int err;
+    if ((err = pthread_mutex_unlock(mutex)) != 0) {
+        handle_error_en(err, "pthread_mutex_unlock");
+    }
+}
+
+static unsigned hash(const char *name) {
+    unsigned h = 2166136261u;
+    for (; *name != '\0'; name++) h = (h ^ (unsigned char)*name) * 16777619u;
+    return h % WATCH_BUCKETS;
+}
+
+// Wakes the notifier up to send the replies just queued.
+static void kick(void) {
+    lock(&watches.changes_mutex);
+    watches.kicked = 1;
+    pthread_cond_signal(&watches.cond);
+    unlock(&watches.changes_mutex);
+}
+
+void watch_notify(const char *name, int deleted) {
+    if (__atomic_load_n(&watches.num_watches, __ATOMIC_RELAXED) == 0) return;
+
+    lock(&watches.changes_mutex);
+    if (watches.num_changes == WATCH_CHANGES) {
+        watches.lost = 1;
+    } else {
+        change_t *c = &watches.changes[watches.num_changes++];
+        snprintf(c->name, WATCH_KEYLEN, "%s", name);
+        c->deleted = deleted;
+    }
+    pthread_cond_signal(&watches.cond);
+    unlock(&watches.changes_mutex);
+}
+
+/* Everything below runs with watches.mutex held. */
+
+// Drops the changes queued for watcher in favor of an overflow line.
+static void overflow(watcher_t *watcher) {
+    for (int i = 0; i < watcher->num_queued; i++) {
+        free(watcher->queue[i].name);
+    }
+    watcher->num_queued = 0;
+    if (!watcher->overflow) watches.overflows++;
+    watcher->overflow = 1;
+}
+
+// Queues a change for watcher, coalescing it with one to the same key.
+static void enqueue(watcher_t *watcher, const char *name, int deleted) {
+    queued_t *q;
+
+    if (watcher->overflow || watcher->broken) return;
+    for (int i = 0; i < watcher->num_queued; i++) {
+        if (strcmp(watcher->queue[i].name, name) == 0) {
+            watcher->queue[i].deleted = deleted;
+            return;
+        }
+    }
+    q = &watcher->queue[watcher->num_queued];
+    if (watcher->num_queued == WATCH_QUEUE || (q->name = strdup(name)) == 0) {
+        overflow(watcher);
+        return;
+    }
+    q->deleted = deleted;
+    watcher->num_queued++;
+}
+
+// Queues the change for every watcher of its key.
+static void dispatch(const change_t *c) {
+    for (watch_t *w = watches.buckets[hash(c->name)]; w != 0; w = w->next) {
+        if (strcmp(w->key, c->name) == 0) {
+            enqueue(w->watcher, c->name, c->deleted);
+        }
+    }
+    for (watch_t *w = watches.prefixes; w != 0; w = w->next) {
+        if (strncmp(w->key, c->name, w->len) == 0) {
+            enqueue(w->watcher, c->name, c->deleted);
+        }
+    }
+}
+
+// Appends a line to the output of watcher; returns -1 if memory runs out.
+static int out_line(watcher_t *watcher, const char *format, ...) {
+    va_list ap;
+    int n;
+
+    while (1) {
+        size_t room = watcher->out_cap - watcher->out_len;
+        va_start(ap, format);
+        n = vsnprintf(watcher->out + watcher->out_len, room, format, ap);
+        va_end(ap);
+        if ((size_t)n < room) break;
+        size_t cap = watcher->out_cap ? 2 * watcher->out_cap : 4096;
+        while (cap < watcher->out_len + n + 1) cap *= 2;
+        char *out = realloc(watcher->out, cap);
+        if (out == 0) return -1;
+        watcher->out = out;
+        watcher->out_cap = cap;
+    }
+    watcher->out_len += n;
+    return 0;
+}
+
+// Moves the replies and changes queued for watcher to its output.
+static void fill(watcher_t *watcher) {
+    reply_line_t *reply;
+
+    watcher->out_len = watcher->out_sent = 0;
+    while ((reply = watcher->replies) != 0) {
+        if (out_line(watcher, "%s\n", reply->line) != 0) return;
+        watcher->replies = reply->next;
+        free(reply);
+    }
+    watcher->replies_end = &watcher->replies;
+    if (watcher->overflow) {
+        if (out_line(watcher, "overflow\n") != 0) return;
+        watcher->overflow = 0;
+    }
+    for (int i = 0; i < watcher->num_queued; i++) {
+        queued_t *q = &watcher->queue[i];
+        if (out_line(watcher, "%s %s\n", q->deleted ? "deleted" : "changed",
+                     q->name) != 0) {
+            // the rest is left queued
+            memmove(watcher->queue, q,
+                    (watcher->num_queued - i) * sizeof(queued_t));
+            watcher->num_queued -= i;
+            return;
+        }
+        free(q->name);
+    }
+    watcher->num_queued = 0;
+}
+
+// Sends what it can of the output of watcher without blocking. Returns 1 if
+// the socket is full and there is output left.
+static int flush(watcher_t *watcher) {
+    ssize_t n;
+
+    while (!watcher->broken) {
+        if (watcher->out_sent == watcher->out_len) fill(watcher);
+        if (watcher->out_sent == watcher->out_len) return 0;
+        n = send(watcher->fd, watcher->out + watcher->out_sent,
+                 watcher->out_len - watcher->out_sent,
+                 MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            // the connection's thread will see the error too and release it
+            watcher->broken = 1;
+            return 0;
+        }
+        watcher->out_sent += n;
+    }
+    return 0;
+}
+
+static void *run_notifier(void *arg) {
+    change_t *batch;
+    int num, lost;
+    int blocked = 0;  // some socket is full
+    struct timespec retry;
+    int err;
+
+    lock(&watches.changes_mutex);
+    while (watches.running) {
+        if (watches.num_changes == 0 && !watches.lost && !watches.kicked) {
+            if (!blocked) {
+                err = pthread_cond_wait(&watches.cond, &watches.changes_mutex);
+            } else {
+                clock_gettime(CLOCK_REALTIME, &retry);
+                retry.tv_nsec += WATCH_RETRY_MS * 1000000L;
+                if (retry.tv_nsec >= 1000000000L) {
+                    retry.tv_sec++;
+                    retry.tv_nsec -= 1000000000L;
+                }
+                err = pthread_cond_timedwait(&watches.cond,
+                                             &watches.changes_mutex, &retry);
+            }
+            if (err != 0 && err != ETIMEDOUT) {
+                handle_error_en(err, "pthread_cond_wait");
+            }
+            if (err != ETIMEDOUT) continue;
+        }
+        batch = watches.changes;
+        num = watches.num_changes;
+        lost = watches.lost;
+        watches.changes = watches.spare;
+        watches.spare = batch;
+        watches.num_changes = 0;
+        watches.lost = 0;
+        watches.kicked = 0;
+        unlock(&watches.changes_mutex);
+
+        lock(&watches.mutex);
+        for (int i = 0; i < num; i++) dispatch(&batch[i]);
+        blocked = 0;
+        for (watcher_t *w = watches.watchers; w != 0; w = w->next) {
+            if (lost) overflow(w);
+            blocked |= flush(w);
+        }
+        unlock(&watches.mutex);
+
+        lock(&watches.changes_mutex);
+    }
+    unlock(&watches.changes_mutex);
+    return NULL;
+}
+
+void watch_start(void) {
+    int err;
+
+    lock(&watches.changes_mutex);
+    watches.running = 1;
+    if ((err = pthread_create(&watches.thread, 0, run_notifier, 0)) != 0) {
+        handle_error_en(err, "pthread_create");
+    }
+    unlock(&watches.changes_mutex);
+}
+
+void watch_stop(void) {
+    int err;
+
+    lock(&watches.changes_mutex);
+    int running = watches.running;
+    watches.running = 0;
+    pthread_cond_signal(&watches.cond);
+    unlock(&watches.changes_mutex);
+
+    if (running && (err = pthread_join(watches.thread, 0)) != 0) {
+        handle_error_en(err, "pthread_join");
+    }
+}
+
+// Queues a reply line for watcher, to be sent by the notifier.
+static void reply(watcher_t *watcher, const char *format, const char *arg) {
+    size_t size = strlen(format) + strlen(arg);
+    reply_line_t *r = malloc(sizeof(reply_line_t) + size);
+
+    // without memory for the reply, the client may be left waiting for it
+    if (r == 0) handle_error_en(ENOMEM, "malloc");
+    snprintf(r->line, size, format, arg);
+    r->next = 0;
+    *watcher->replies_end = r;
+    watcher->replies_end = &r->next;
+}
+
+static watcher_t *new_watcher(FILE *cxstr) {
+    watcher_t *watcher = calloc(1, sizeof(watcher_t));
+
+    if (watcher == 0) return 0;
+    watcher->fd = fileno(cxstr);
+    watcher->replies_end = &watcher->replies;
+    watcher->next = watches.watchers;
+    if (watches.watchers != 0) watches.watchers->prev = watcher;
+    watches.watchers = watcher;
+    watches.num_watchers++;
+    return watcher;
+}
+
+// Adds a watch on key (or on the prefix key) for watcher, unless it has one.
+static int add_watch(watcher_t *watcher, const char *key, int prefix) {
+    watch_t **list = prefix ? &watches.prefixes : &watches.buckets[hash(key)];
+    int len = prefix ? (int)strlen(key) : -1;
+    watch_t *w;
+
+    for (w = *list; w != 0; w = w->next) {
+        if (w->watcher == watcher && w->len == len && strcmp(w->key, key) == 0)
+            return 0;
+    }
+    if ((w = malloc(sizeof(watch_t) + strlen(key) + 1)) == 0) return -1;
+    w->watcher = watcher;
+    w->len = len;
+    strcpy(w->key, key);
+    w->next = *list;
+    *list = w;
+    __atomic_add_fetch(&watches.num_watches, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int watch_command(watcher_t **watcher, FILE *cxstr, char *command, int busy,
+                  char *response, int len) {
+    char verb[4];
+    char key[WATCH_KEYLEN + 1];  // one more, to tell a key that is too long
+    int n = sscanf(command, "%3s %256s", verb, key);
+    int prefix = n >= 1 && strcmp(verb, "wp") == 0;
+    const char *error = 0;
+
+    if (!(n >= 1 && (prefix || strcmp(verb, "w") == 0)) && *watcher == 0) {
+        return 0;
+    }
+    if (busy) {
+        error = "busy";
+    } else if (!(n >= 1 && (prefix || strcmp(verb, "w") == 0))) {
+        error = "watching connection";
+    } else if (n < 2) {
+        error = "ill-formed command";
+    } else if (strlen(key) >= WATCH_KEYLEN) {
+        error = "key too long";
+    } else if (!prefix && !db_key_valid(key)) {
+        error = "key is not an integer";
+    }
+    if (error != 0 && *watcher == 0) {
+        snprintf(response, len, "%s", error);
+        return 1;
+    }
+
+    response[0] = '\0';
+    lock(&watches.mutex);
+    if (*watcher == 0 && (*watcher = new_watcher(cxstr)) == 0) {
+        unlock(&watches.mutex);
+        snprintf(response, len, "out of memory");
+        return 1;
+    }
+    if (error != 0) {
+        reply(*watcher, "%s", error);
+    } else if (add_watch(*watcher, key, prefix) != 0) {
+        reply(*watcher, "%s", "out of memory");
+    } else {
+        reply(*watcher, "watching %s", key);
+    }
+    unlock(&watches.mutex);
+    kick();
+    return 1;
+}
+
+// Frees the watches of watcher in list.
+static void drop_watches(watch_t **list, watcher_t *watcher) {
+    watch_t *w;
+
+    while ((w = *list) != 0) {
+        if (w->watcher == watcher) {
+            *list = w->next;
+            free(w);
+            __atomic_sub_fetch(&watches.num_watches, 1, __ATOMIC_RELAXED);
+        } else {
+            list = &w->next;
+        }
+    }
+}
+
+void watch_release(watcher_t *watcher) {
+    reply_line_t *r;
+
+    if (watcher == 0) return;
+    lock(&watches.mutex);
+    for (int b = 0; b < WATCH_BUCKETS; b++) {
+        drop_watches(&watches.buckets[b], watcher);
+    }
+    drop_watches(&watches.prefixes, watcher);
+    if (watcher->prev != 0)
+        watcher->prev->next = watcher->next;
+    else
+        watches.watchers = watcher->next;
+    if (watcher->next != 0) watcher->next->prev = watcher->prev;
+    watches.num_watchers--;
+    unlock(&watches.mutex);
+
+    for (int i = 0; i < watcher->num_queued; i++) {
+        free(watcher->queue[i].name);
+    }
+    while ((r = watcher->replies) != 0) {
+        watcher->replies = r->next;
+        free(r);
+    }
+    free(watcher->out);
+    free(watcher);
+}
+
+void watch_print_status(FILE *out) {
+    lock(&watches.mutex);
+    fprintf(out, "%d watching connections, %d watches, %lu overflows\n",
+            watches.num_watchers,
+            __atomic_load_n(&watches.num_watches, __ATOMIC_RELAXED),
+            watches.overflows);
+    unlock(&watches.mutex);
+}
@@ -0,0 +1,71 @@
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include <stdio.h>
+
+/*
+ * Key watches, so that clients are told of changes instead of polling. A
+ * connection that sends "w key" or "wp prefix" becomes a watching connection:
+ * it is answered "watching key" (or "watching prefix"), and from then on is
+ * sent a line "changed key" or "deleted key" after every change to that key,
+ * or to any key starting with prefix. A watching connection may only send
+ * more w and wp commands; everything else is answered "watching connection".
+ * Use another connection to read the keys.
+ *
+ * Writers only copy the name of the key they changed into a bounded queue
+ * (watch_notify()). A notifier thread matches the changes against the
+ * watches and appends them to the queue of each watching connection, where
+ * further changes to a key not yet sent are coalesced into the latest one,
+ * and sends them without blocking, so that a slow connection only holds up
+ * its own queue. When a connection's queue fills up, or changes have been
+ * lost because the writers' queue did, the changes queued for it are
+ * replaced by a single "overflow" line: the connection should then read the
+ * keys it watches again.
+ */
+
+// Changes queued by writers for the notifier, and for each connection.
+#define WATCH_CHANGES 1024
+#define WATCH_QUEUE 64
+
+typedef struct watcher watcher_t;
+
+/*
+ * Starts the notifier thread.
+ */
+void watch_start(void);
+
+/*
+ * Stops the notifier thread, if it is running.
+ */
+void watch_stop(void);
+
+/*
+ * Handles command if it is a w or wp command, or if *watcher is a watching
+ * connection, and returns 1; otherwise returns 0 and leaves the command to
+ * interpret_command(). *watcher starts out NULL, and is set by the first w or
+ * wp command of the connection cxstr. The replies to a watching connection
+ * are sent by the notifier, so response is left empty. busy is the verdict of
+ * admit_command(): if set, a command handled here is answered "busy".
+ */
+int watch_command(watcher_t **watcher, FILE *cxstr, char *command, int busy,
+                  char *response, int len);
+
+/*
+ * Drops the watches of a connection that is being closed (watcher may be
+ * NULL). Must be called before cxstr is closed.
+ */
+void watch_release(watcher_t *watcher);
+
+/*
+ * Called by db.c, with the node locked, after name has been set (deleted is
+ * 0) or removed (deleted is 1). Does nothing if no key is watched.
+ */
+void watch_notify(const char *name, int deleted);
+
+/*
+ * Prints the number of watching connections and watches and how many
+ * overflows there have been.
+ */
+void watch_print_status(FILE *out);
+
+#endif  // WATCH_H_